@@ -0,0 +1,1758 @@
+/*
+  Copyright (c) 2016-2018 Lester Hedges <lester.hedges+aabbcc@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty. In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions:
+
+  1. The origin of this software must not be misrepresented; you must not
+     claim that you wrote the original software. If you use this software
+     in a product, an acknowledgment in the product documentation would be
+     appreciated but is not required.
+
+  2. Altered source versions must be plainly marked as such, and must not be
+     misrepresented as being the original software.
+
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <type_traits>
+
+#include "AABB.h"
+#include "MersenneTwister.h"
+
+#ifndef M_PI
+    #define M_PI 3.1415926535897932384626433832795
+#endif
+
+/*! \file benchmark.cc
+
+  Benchmarks for the AABB tree. The workload is a Monte Carlo simulation
+  of monodisperse hard discs (2D) or hard spheres (3D) in a periodic box,
+  which is dominated by tree queries, as in the hard_disc demo.
+
+  Run without arguments to perform all benchmarks, or pass the name of
+  a benchmark to run it on its own.
+*/
+
+// FUNCTION PROTOTYPES
+
+// Compute the squared minimum image distance between two particles.
+template <class Vector>
+double distanceSqd(const Vector&, const Vector&, const std::vector<double>&);
+
+// Wrap a position vector into the periodic box.
+template <class Vector>
+void periodicBoundaries(Vector&, const std::vector<double>&);
+
+// Test whether a particle overlaps any other particle in the tree.
+template <class TreeType>
+bool isOverlapping(TreeType&, unsigned int, const typename TreeType::Vector&,
+    const std::vector<typename TreeType::Vector>&, const std::vector<double>&);
+
+// Fill a tree with a random, non-overlapping configuration.
+template <class TreeType>
+void initialise(TreeType&, std::vector<typename TreeType::Vector>&,
+    const std::vector<double>&, MersenneTwister&);
+
+// Perform Monte Carlo sweeps, returning the wall-clock time in seconds.
+template <class TreeType>
+double monteCarlo(TreeType&, std::vector<typename TreeType::Vector>&,
+    const std::vector<double>&, unsigned int, MersenneTwister&, bool useAnyOverlap=false);
+
+// Work out the base length of the simulation box.
+template <unsigned int D>
+double computeBaseLength(unsigned int);
+
+// Compare node memory layouts for a query-heavy Monte Carlo workload.
+template <unsigned int D>
+void benchmarkLayout(unsigned int, unsigned int);
+
+// Compare query-and-filter overlap tests with the any-hit sphere query.
+template <unsigned int D>
+void benchmarkAnyHit(unsigned int, unsigned int);
+
+// Compare serial neighbour queries with the parallel batch query.
+template <unsigned int D>
+void benchmarkBatch(unsigned int, unsigned int);
+
+// Compare per-particle queries with the all-pairs self-traversal.
+template <unsigned int D>
+void benchmarkAllPairs(unsigned int, unsigned int);
+
+// Compare incremental insertion with the binned SAH bulk builder.
+template <unsigned int D>
+void benchmarkBuild(unsigned int);
+
+// Compare linear BVH rebuilds with incremental and SAH builds.
+template <unsigned int D>
+void benchmarkLinear(unsigned int);
+
+// Track the tree quality and query cost over a long Monte Carlo simulation.
+template <unsigned int D>
+void benchmarkBalance(unsigned int, unsigned int, unsigned int);
+
+// Compare ways of updating the tree as every particle moves a small distance.
+template <unsigned int D>
+void benchmarkUpdate(unsigned int, unsigned int);
+
+// Compare fixed, adaptive and displacement-aware skins for particles moving at different speeds.
+template <unsigned int D>
+void benchmarkSkin(unsigned int, unsigned int);
+
+// Compare dense and sparse particle indices in an update-heavy loop.
+template <unsigned int D>
+void benchmarkIndex(unsigned int, unsigned int);
+
+// Compare neighbour queries in non-periodic and periodic boxes, with and without ghosts.
+template <unsigned int D, unsigned int TreeD>
+void benchmarkPeriodic(unsigned int, unsigned int);
+
+// Compare ray casts for all hits and the closest hit against a brute-force search.
+template <unsigned int D>
+void benchmarkRay(unsigned int, unsigned int);
+
+// Compare k-nearest-neighbour searches against repeatedly growing an AABB query.
+template <unsigned int D>
+void benchmarkNearest(unsigned int, unsigned int);
+
+// Compare radius queries against AABB queries filtered by distance.
+template <unsigned int D>
+void benchmarkRadius(unsigned int, double, unsigned int);
+
+// Compare neighbour queries culled with double, mixed and single-precision node bounds.
+template <unsigned int D, class Layout>
+void benchmarkPrecision(unsigned int, unsigned int);
+
+// Compare the memory use and query cost of the tree with its compressed snapshots.
+template <unsigned int D>
+void benchmarkCompressed(unsigned int, unsigned int);
+
+// Compare the query cost of the tree with its 4- and 8-wide snapshots.
+template <unsigned int D>
+void benchmarkWide(unsigned int, unsigned int);
+
+// Compare reloading a saved tree with rebuilding it by insertion.
+template <unsigned int D>
+void benchmarkCheckpoint(unsigned int, unsigned int);
+
+// Compare the AABB kernels with the scalar loops that they replaced.
+template <unsigned int D>
+void benchmarkKernels(unsigned int, unsigned int);
+
+// Run queries on a shared tree from many threads, checking them against a serial pass.
+template <unsigned int D>
+void benchmarkConcurrent(unsigned int, unsigned int);
+
+// Time a kernel applied to pairs of boxes, returning nanoseconds per pair.
+template <class AABBType, class Kernel>
+double timeKernel(const std::vector<AABBType>&, unsigned int, Kernel&&);
+
+// The scalar AABB overlap test, with an early exit.
+template <unsigned int D>
+bool scalarOverlaps(const aabb::BasicAABB<D>&, const aabb::BasicAABB<D>&, bool);
+
+// The scalar AABB containment test, with an early exit.
+template <unsigned int D>
+bool scalarContains(const aabb::BasicAABB<D>&, const aabb::BasicAABB<D>&);
+
+// The scalar AABB merge.
+template <unsigned int D>
+void scalarMerge(aabb::BasicAABB<D>&, const aabb::BasicAABB<D>&, const aabb::BasicAABB<D>&);
+
+// Time queries of the AABB of every particle, returning the number of candidates found.
+template <class TreeType, class SnapshotType>
+double timeSnapshotQueries(const TreeType&, const SnapshotType&, unsigned int, unsigned long&);
+
+// Time neighbour queries for every particle in a tree.
+template <class TreeType>
+double timeQueries(const TreeType&, unsigned int);
+
+// GLOBAL PARAMETERS
+
+// The particle diameter.
+const double diameter = 1.0;
+
+// The maximum trial displacement (in units of diameter).
+const double maxDisp = 0.1;
+
+// The packing fraction.
+const double packingFraction = 0.3;
+
+// MAIN FUNCTION
+
+int main(int argc, char** argv)
+{
+    // The name of the benchmark to run (empty for all).
+    std::string name = (argc > 1) ? argv[1] : "";
+
+    if (name.empty() || (name == "layout"))
+    {
+        std::cout << "\nNode layout (Monte Carlo sweeps, periodic box):\n";
+        benchmarkLayout<2>(10000, 20);
+        benchmarkLayout<3>(10000, 20);
+    }
+
+    if (name.empty() || (name == "anyhit"))
+    {
+        std::cout << "\nOverlap test (Monte Carlo sweeps, periodic box):\n";
+        benchmarkAnyHit<2>(10000, 20);
+        benchmarkAnyHit<3>(10000, 20);
+    }
+
+    if (name.empty() || (name == "batch"))
+    {
+        std::cout << "\nNeighbour queries (all particles, periodic box):\n";
+        benchmarkBatch<2>(20000, 10);
+        benchmarkBatch<3>(20000, 10);
+    }
+
+    if (name.empty() || (name == "pairs"))
+    {
+        std::cout << "\nAll overlapping pairs (periodic box):\n";
+        benchmarkAllPairs<2>(20000, 10);
+        benchmarkAllPairs<3>(20000, 10);
+    }
+
+    if (name.empty() || (name == "build"))
+    {
+        std::cout << "\nTree construction (random overlapping particles):\n";
+        benchmarkBuild<2>(1000000);
+        benchmarkBuild<3>(1000000);
+    }
+
+    if (name.empty() || (name == "lbvh"))
+    {
+        std::cout << "\nLinear BVH (random overlapping particles, periodic box):\n";
+        benchmarkLinear<2>(200000);
+        benchmarkLinear<3>(200000);
+    }
+
+    if (name.empty() || (name == "balance"))
+    {
+        std::cout << "\nTree balancing (long Monte Carlo simulation, periodic box):\n";
+        benchmarkBalance<2>(10000, 200, 50);
+        benchmarkBalance<3>(10000, 200, 50);
+    }
+
+    if (name.empty() || (name == "update"))
+    {
+        std::cout << "\nTree updates (Brownian dynamics, periodic box):\n";
+        benchmarkUpdate<2>(20000, 100);
+        benchmarkUpdate<3>(20000, 100);
+    }
+
+    if (name.empty() || (name == "skin"))
+    {
+        std::cout << "\nParticle skin (mixed speeds, update and query every step, periodic box):\n";
+        benchmarkSkin<2>(10000, 50);
+        benchmarkSkin<3>(10000, 50);
+    }
+
+    if (name.empty() || (name == "index"))
+    {
+        std::cout << "\nParticle index (insert, update and remove, periodic box):\n";
+        benchmarkIndex<2>(100000, 20);
+        benchmarkIndex<3>(100000, 20);
+    }
+
+    if (name.empty() || (name == "periodic"))
+    {
+        std::cout << "\nPeriodic boundaries (neighbour queries, all particles):\n";
+        benchmarkPeriodic<2, 2>(20000, 10);
+        benchmarkPeriodic<3, 3>(20000, 10);
+        benchmarkPeriodic<3, 0>(20000, 10);
+    }
+
+    if (name.empty() || (name == "ray"))
+    {
+        std::cout << "\nRay casting (random rays, a quarter of the box long, periodic box):\n";
+        benchmarkRay<2>(20000, 10000);
+        benchmarkRay<3>(20000, 10000);
+    }
+
+    if (name.empty() || (name == "nearest"))
+    {
+        std::cout << "\nNearest neighbours (12 per particle, all particles, periodic box):\n";
+        benchmarkNearest<2>(20000, 12);
+        benchmarkNearest<3>(20000, 12);
+    }
+
+    if (name.empty() || (name == "radius"))
+    {
+        std::cout << "\nRadius queries (all particles, periodic box):\n";
+        benchmarkRadius<2>(20000, 1.0, 10);
+        benchmarkRadius<2>(20000, 5.0, 10);
+        benchmarkRadius<3>(20000, 1.0, 10);
+        benchmarkRadius<3>(20000, 5.0, 2);
+    }
+
+    if (name.empty() || (name == "precision"))
+    {
+        std::cout << "\nNode precision (neighbour queries, all particles, open box):\n";
+        benchmarkPrecision<2, aabb::AoS>(200000, 5);
+        benchmarkPrecision<2, aabb::SoA>(200000, 5);
+        benchmarkPrecision<3, aabb::AoS>(200000, 5);
+        benchmarkPrecision<3, aabb::SoA>(200000, 5);
+    }
+
+    if (name.empty() || (name == "compressed"))
+    {
+        std::cout << "\nCompressed snapshot (neighbour queries, all particles, open box):\n";
+        benchmarkCompressed<2>(200000, 5);
+        benchmarkCompressed<3>(200000, 5);
+    }
+
+    if (name.empty() || (name == "wide"))
+    {
+        std::cout << "\nWide snapshot (neighbour queries, all particles, open box):\n";
+        benchmarkWide<2>(200000, 5);
+        benchmarkWide<3>(200000, 5);
+    }
+
+    if (name.empty() || (name == "checkpoint"))
+    {
+        std::cout << "\nCheckpoint (insert all particles vs save and load):\n";
+        benchmarkCheckpoint<2>(200000, 3);
+        benchmarkCheckpoint<3>(200000, 3);
+    }
+
+    if (name.empty() || (name == "kernels"))
+    {
+        std::cout << "\nAABB kernels (pairs of random boxes, scalar vs kernel):\n";
+        benchmarkKernels<2>(1 << 16, 7);
+        benchmarkKernels<3>(1 << 16, 7);
+        benchmarkKernels<4>(1 << 16, 7);
+    }
+
+    if (name.empty() || (name == "concurrent"))
+    {
+        std::cout << "\nConcurrent queries (AABB, radius, nearest and ray, shared tree, periodic box):\n";
+        benchmarkConcurrent<2>(100000, 10000);
+        benchmarkConcurrent<3>(100000, 10000);
+    }
+
+    return (EXIT_SUCCESS);
+}
+
+// FUNCTION DEFINITIONS
+
+template <class Vector>
+double distanceSqd(const Vector& position1, const Vector& position2,
+    const std::vector<double>& boxSize)
+{
+    double rSqd = 0;
+
+    for (unsigned int i=0;i<boxSize.size();i++)
+    {
+        double separation = position1[i] - position2[i];
+
+        if      (separation < -0.5*boxSize[i]) separation += boxSize[i];
+        else if (separation >= 0.5*boxSize[i]) separation -= boxSize[i];
+
+        rSqd += separation*separation;
+    }
+
+    return rSqd;
+}
+
+template <class Vector>
+void periodicBoundaries(Vector& position, const std::vector<double>& boxSize)
+{
+    for (unsigned int i=0;i<boxSize.size();i++)
+    {
+        if      (position[i] < 0)           position[i] += boxSize[i];
+        else if (position[i] >= boxSize[i]) position[i] -= boxSize[i];
+    }
+}
+
+template <class TreeType>
+bool isOverlapping(TreeType& tree, unsigned int particle, const typename TreeType::Vector& position,
+    const std::vector<typename TreeType::Vector>& positions, const std::vector<double>& boxSize)
+{
+    typename TreeType::Vector lowerBound = position;
+    typename TreeType::Vector upperBound = position;
+
+    for (unsigned int i=0;i<boxSize.size();i++)
+    {
+        lowerBound[i] -= 0.5*diameter;
+        upperBound[i] += 0.5*diameter;
+    }
+
+    typename TreeType::AABBType aabb(lowerBound, upperBound);
+
+    // Query the tree for candidate overlaps.
+    std::vector<unsigned int> particles = tree.query(particle, aabb);
+
+    // Test for a true overlap.
+    for (unsigned int i=0;i<particles.size();i++)
+    {
+        if (distanceSqd(position, positions[particles[i]], boxSize) < diameter*diameter)
+            return true;
+    }
+
+    return false;
+}
+
+template <class TreeType>
+void initialise(TreeType& tree, std::vector<typename TreeType::Vector>& positions,
+    const std::vector<double>& boxSize, MersenneTwister& rng)
+{
+    for (unsigned int i=0;i<positions.size();i++)
+    {
+        typename TreeType::Vector position = positions[i];
+
+        // Keep trying until there is no overlap.
+        do
+        {
+            for (unsigned int j=0;j<boxSize.size();j++)
+                position[j] = boxSize[j]*rng();
+        }
+        while ((i > 0) && isOverlapping(tree, i, position, positions, boxSize));
+
+        tree.insertParticle(i, position, 0.5*diameter);
+        positions[i] = position;
+    }
+}
+
+template <class TreeType>
+double monteCarlo(TreeType& tree, std::vector<typename TreeType::Vector>& positions,
+    const std::vector<double>& boxSize, unsigned int nSweeps, MersenneTwister& rng, bool useAnyOverlap)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int i=0;i<nSweeps;i++)
+    {
+        for (unsigned int j=0;j<positions.size();j++)
+        {
+            // Choose a random particle.
+            unsigned int particle = rng.integer(0, positions.size()-1);
+
+            // Generate a trial position.
+            typename TreeType::Vector position = positions[particle];
+            for (unsigned int k=0;k<boxSize.size();k++)
+                position[k] += maxDisp*diameter*(2.0*rng() - 1.0);
+            periodicBoundaries(position, boxSize);
+
+            // Test for overlaps.
+            bool isOverlap = useAnyOverlap ?
+                tree.anyOverlap(particle, position, 0.5*diameter) :
+                isOverlapping(tree, particle, position, positions, boxSize);
+
+            // Accept the move.
+            if (!isOverlap)
+            {
+                positions[particle] = position;
+                tree.updateParticle(particle, position, 0.5*diameter);
+            }
+        }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double>(end - start).count();
+}
+
+template <unsigned int D>
+double computeBaseLength(unsigned int nParticles)
+{
+    double volume = (D == 2) ? (0.25*M_PI*diameter*diameter)
+                             : (M_PI*diameter*diameter*diameter/6.0);
+
+    return std::pow(nParticles*volume/packingFraction, 1.0/D);
+}
+
+template <unsigned int D>
+void benchmarkLayout(unsigned int nParticles, unsigned int nSweeps)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    // AoS layout.
+    MersenneTwister rngAoS;
+    rngAoS.setSeed(42);
+    aabb::BasicTree<D, aabb::AoS> treeAoS(D, maxDisp, periodicity, boxSize, nParticles);
+    std::vector<typename aabb::BasicTree<D, aabb::AoS>::Vector> positionsAoS(nParticles);
+    initialise(treeAoS, positionsAoS, boxSize, rngAoS);
+    double timeAoS = monteCarlo(treeAoS, positionsAoS, boxSize, nSweeps, rngAoS);
+
+    // SoA layout.
+    MersenneTwister rngSoA;
+    rngSoA.setSeed(42);
+    aabb::BasicTree<D, aabb::SoA> treeSoA(D, maxDisp, periodicity, boxSize, nParticles);
+    std::vector<typename aabb::BasicTree<D, aabb::SoA>::Vector> positionsSoA(nParticles);
+    initialise(treeSoA, positionsSoA, boxSize, rngSoA);
+    double timeSoA = monteCarlo(treeSoA, positionsSoA, boxSize, nSweeps, rngSoA);
+
+    printf("  %uD, %u particles, %u sweeps: AoS %.3f s, SoA %.3f s\n",
+        D, nParticles, nSweeps, timeAoS, timeSoA);
+}
+
+template <unsigned int D>
+void benchmarkAnyHit(unsigned int nParticles, unsigned int nSweeps)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    // Query the tree, then test candidates for a true overlap.
+    MersenneTwister rngQuery;
+    rngQuery.setSeed(42);
+    aabb::BasicTree<D> treeQuery(D, maxDisp, periodicity, boxSize, nParticles);
+    std::vector<typename aabb::BasicTree<D>::Vector> positionsQuery(nParticles);
+    initialise(treeQuery, positionsQuery, boxSize, rngQuery);
+    double timeQuery = monteCarlo(treeQuery, positionsQuery, boxSize, nSweeps, rngQuery);
+
+    // Stop at the first true overlap.
+    MersenneTwister rngAnyHit;
+    rngAnyHit.setSeed(42);
+    aabb::BasicTree<D> treeAnyHit(D, maxDisp, periodicity, boxSize, nParticles);
+    std::vector<typename aabb::BasicTree<D>::Vector> positionsAnyHit(nParticles);
+    initialise(treeAnyHit, positionsAnyHit, boxSize, rngAnyHit);
+    double timeAnyHit = monteCarlo(treeAnyHit, positionsAnyHit, boxSize, nSweeps, rngAnyHit, true);
+
+    printf("  %uD, %u particles, %u sweeps: query %.3f s, anyOverlap %.3f s\n",
+        D, nParticles, nSweeps, timeQuery, timeAnyHit);
+}
+
+template <unsigned int D>
+void benchmarkBatch(unsigned int nParticles, unsigned int nRepeats)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    MersenneTwister rng;
+    rng.setSeed(42);
+    aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+    std::vector<typename aabb::BasicTree<D>::Vector> positions(nParticles);
+    initialise(tree, positions, boxSize, rng);
+
+    std::vector<unsigned int> particles(nParticles);
+    for (unsigned int i=0;i<nParticles;i++) particles[i] = i;
+
+    // Query each particle in turn.
+    unsigned int nSerial = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nRepeats;i++)
+    {
+        for (unsigned int j=0;j<nParticles;j++)
+            nSerial += tree.query(j).size();
+    }
+    double timeSerial = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Batch queries, single threaded then using all hardware threads.
+    std::vector<unsigned int> offsets, indices;
+    unsigned int nThreads[2] = {1, std::max(1u, std::thread::hardware_concurrency())};
+    double timeBatch[2];
+
+    for (unsigned int i=0;i<2;i++)
+    {
+        unsigned int nBatch = 0;
+        start = std::chrono::steady_clock::now();
+        for (unsigned int j=0;j<nRepeats;j++)
+        {
+            tree.queryBatch(particles, offsets, indices, nThreads[i]);
+            nBatch += indices.size();
+        }
+        timeBatch[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (nBatch != nSerial)
+            std::cerr << "[ERROR]: Batch query results don't match!\n";
+    }
+
+    printf("  %uD, %u particles, %u repeats: query %.3f s, queryBatch (1 thread) %.3f s, "
+        "queryBatch (%u threads) %.3f s\n", D, nParticles, nRepeats, timeSerial, timeBatch[0],
+        nThreads[1], timeBatch[1]);
+}
+
+template <unsigned int D>
+void benchmarkAllPairs(unsigned int nParticles, unsigned int nRepeats)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    MersenneTwister rng;
+    rng.setSeed(42);
+    aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+    std::vector<typename aabb::BasicTree<D>::Vector> positions(nParticles);
+    initialise(tree, positions, boxSize, rng);
+
+    // Query each particle in turn, keeping each pair once.
+    unsigned int nQuery = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nRepeats;i++)
+    {
+        for (unsigned int j=0;j<nParticles;j++)
+        {
+            tree.query(j, tree.getAABB(j), [&](unsigned int particle)
+            {
+                if (particle > j) nQuery++;
+                return true;
+            });
+        }
+    }
+    double timeQuery = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Self-traversal of the tree.
+    unsigned int nPairs = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nRepeats;i++)
+    {
+        tree.queryAllPairs([&](unsigned int, unsigned int)
+        {
+            nPairs++;
+            return true;
+        });
+    }
+    double timePairs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Parallel self-traversal, using all hardware threads.
+    unsigned int nThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<unsigned int> nParallel(0);
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nRepeats;i++)
+    {
+        tree.queryAllPairs([&](unsigned int, unsigned int)
+        {
+            nParallel++;
+            return true;
+        }, nThreads);
+    }
+    double timeParallel = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if ((nPairs != nQuery) || (nParallel != nQuery))
+        std::cerr << "[ERROR]: Pair counts don't match!\n";
+
+    printf("  %uD, %u particles, %u repeats: query %.3f s, queryAllPairs %.3f s, "
+        "queryAllPairs (%u threads) %.3f s\n", D, nParticles, nRepeats, timeQuery, timePairs,
+        nThreads, timeParallel);
+}
+
+template <unsigned int D>
+void benchmarkBuild(unsigned int nParticles)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    // Generate random particle bounds. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<typename aabb::BasicTree<D>::Vector> lowerBounds(nParticles);
+    std::vector<typename aabb::BasicTree<D>::Vector> upperBounds(nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        for (unsigned int j=0;j<D;j++)
+        {
+            double position = boxSize[j]*rng();
+            lowerBounds[i][j] = position - 0.5*diameter;
+            upperBounds[i][j] = position + 0.5*diameter;
+        }
+    }
+
+    // Insert the particles one at a time.
+    auto start = std::chrono::steady_clock::now();
+    aabb::BasicTree<D> treeInsert(D, maxDisp, periodicity, boxSize, nParticles);
+    for (unsigned int i=0;i<nParticles;i++)
+        treeInsert.insertParticle(i, lowerBounds[i], upperBounds[i]);
+    double timeInsert = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Bulk load.
+    start = std::chrono::steady_clock::now();
+    aabb::BasicTree<D> treeBulk(D, maxDisp, periodicity, boxSize, lowerBounds, upperBounds);
+    double timeBulk = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Rebuild the incrementally built tree.
+    start = std::chrono::steady_clock::now();
+    treeInsert.rebuild();
+    double timeRebuild = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("  %uD, %u particles: insert %.3f s, bulk load %.3f s, rebuild %.3f s (%u threads)\n",
+        D, nParticles, timeInsert, timeBulk, timeRebuild, std::max(1u, std::thread::hardware_concurrency()));
+}
+
+template <class TreeType>
+double timeQueries(const TreeType& tree, unsigned int nParticles)
+{
+    unsigned int nNeighbours = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        tree.query(i, tree.getAABB(i), [&](unsigned int)
+        {
+            nNeighbours++;
+            return true;
+        });
+    }
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <unsigned int D>
+void benchmarkLinear(unsigned int nParticles)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<typename aabb::BasicTree<D>::Vector> positions(nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        for (unsigned int j=0;j<D;j++)
+            positions[i][j] = boxSize[j]*rng();
+    }
+
+    // Insert the particles one at a time.
+    auto start = std::chrono::steady_clock::now();
+    aabb::BasicTree<D> treeInsert(D, maxDisp, periodicity, boxSize, nParticles);
+    for (unsigned int i=0;i<nParticles;i++)
+        treeInsert.insertParticle(i, positions[i], 0.5*diameter);
+    double timeInsert = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Rebuild copies of the tree using the SAH and linear builders.
+    aabb::BasicTree<D> treeSAH(treeInsert);
+    start = std::chrono::steady_clock::now();
+    treeSAH.rebuild();
+    double timeSAH = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    aabb::BasicTree<D> treeLinear(treeInsert);
+    start = std::chrono::steady_clock::now();
+    treeLinear.rebuildLinear();
+    double timeLinear = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("  %uD, %u particles:\n", D, nParticles);
+    printf("    insert:        build %.3f s, surface area ratio %.1f, queries %.3f s\n",
+        timeInsert, treeInsert.computeSurfaceAreaRatio(), timeQueries(treeInsert, nParticles));
+    printf("    rebuild (SAH): build %.3f s, surface area ratio %.1f, queries %.3f s\n",
+        timeSAH, treeSAH.computeSurfaceAreaRatio(), timeQueries(treeSAH, nParticles));
+    printf("    rebuildLinear: build %.3f s, surface area ratio %.1f, queries %.3f s\n",
+        timeLinear, treeLinear.computeSurfaceAreaRatio(), timeQueries(treeLinear, nParticles));
+}
+
+template <unsigned int D>
+void benchmarkBalance(unsigned int nParticles, unsigned int nSweeps, unsigned int sampleInterval)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    aabb::Balance methods[2] = {aabb::Balance::Height, aabb::Balance::SurfaceArea};
+    const char* names[2] = {"height", "surface area"};
+
+    printf("  %uD, %u particles (sweeps: surface area ratio, Monte Carlo time)\n", D, nParticles);
+
+    for (unsigned int i=0;i<2;i++)
+    {
+        MersenneTwister rng;
+        rng.setSeed(42);
+        aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+        tree.setBalance(methods[i]);
+        std::vector<typename aabb::BasicTree<D>::Vector> positions(nParticles);
+        initialise(tree, positions, boxSize, rng);
+
+        printf("    %-12s", names[i]);
+        for (unsigned int j=0;j<nSweeps;j+=sampleInterval)
+        {
+            double time = monteCarlo(tree, positions, boxSize, sampleInterval, rng, true);
+            printf("  %u: %.1f, %.3f s", j + sampleInterval, tree.computeSurfaceAreaRatio(), time);
+        }
+        printf("\n");
+    }
+}
+
+template <unsigned int D>
+void benchmarkUpdate(unsigned int nParticles, unsigned int nSteps)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    const char* names[3] = {"updateParticle", "reinsert", "refit"};
+
+    printf("  %uD, %u particles, %u steps:\n", D, nParticles, nSteps);
+
+    for (unsigned int i=0;i<3;i++)
+    {
+        // Generate random particle positions. (Overlaps don't matter here.)
+        MersenneTwister rng;
+        rng.setSeed(42);
+        std::vector<typename aabb::BasicTree<D>::Vector> positions(nParticles);
+        std::vector<unsigned int> particles(nParticles);
+
+        aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+        if (i == 2) tree.setUpdate(aabb::Update::Refit);
+
+        for (unsigned int j=0;j<nParticles;j++)
+        {
+            for (unsigned int k=0;k<D;k++)
+                positions[j][k] = boxSize[k]*rng();
+
+            tree.insertParticle(j, positions[j], 0.5*diameter);
+            particles[j] = j;
+        }
+
+        std::vector<double> lowerBounds(D*nParticles);
+        std::vector<double> upperBounds(D*nParticles);
+        double time = 0;
+
+        for (unsigned int j=0;j<nSteps;j++)
+        {
+            // Displace every particle by a small random amount.
+            for (unsigned int k=0;k<nParticles;k++)
+            {
+                for (unsigned int l=0;l<D;l++)
+                    positions[k][l] += 0.1*diameter*(2.0*rng() - 1.0);
+
+                periodicBoundaries(positions[k], boxSize);
+
+                for (unsigned int l=0;l<D;l++)
+                {
+                    lowerBounds[D*k + l] = positions[k][l] - 0.5*diameter;
+                    upperBounds[D*k + l] = positions[k][l] + 0.5*diameter;
+                }
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            if (i == 0)
+            {
+                for (unsigned int k=0;k<nParticles;k++)
+                    tree.updateParticle(k, positions[k], 0.5*diameter);
+            }
+            else tree.updateParticles(particles, lowerBounds.data(), upperBounds.data());
+            time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        printf("    %-15s update %.3f s, surface area ratio %.1f, queries %.3f s\n",
+            names[i], time, tree.computeSurfaceAreaRatio(), timeQueries(tree, nParticles));
+    }
+}
+
+template <unsigned int D>
+void benchmarkSkin(unsigned int nParticles, unsigned int nSteps)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    const char* names[4] = {"fixed", "adaptive", "displacement", "both"};
+
+    printf("  %uD, %u particles, %u steps:\n", D, nParticles, nSteps);
+
+    for (unsigned int i=0;i<4;i++)
+    {
+        // One in ten particles moves ten times faster than the rest.
+        MersenneTwister rng;
+        rng.setSeed(42);
+        std::vector<typename aabb::BasicTree<D>::Vector> positions(nParticles);
+        std::vector<typename aabb::BasicTree<D>::Vector> velocities(nParticles);
+
+        aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+        if ((i == 1) || (i == 3)) tree.setAdaptiveSkin(true);
+
+        for (unsigned int j=0;j<nParticles;j++)
+        {
+            double speed = (j % 10 == 0) ? 0.1*diameter : 0.01*diameter;
+
+            for (unsigned int k=0;k<D;k++)
+            {
+                positions[j][k] = boxSize[k]*rng();
+                velocities[j][k] = speed*(2.0*rng() - 1.0);
+            }
+
+            tree.insertParticle(j, positions[j], 0.5*diameter);
+        }
+
+        unsigned int nReinserted = 0;
+        double timeUpdate = 0;
+        double timeQuery = 0;
+        typename aabb::BasicTree<D>::Vector displacement;
+
+        for (unsigned int j=0;j<nSteps;j++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned int k=0;k<nParticles;k++)
+            {
+                // Move the particle, with a little noise.
+                for (unsigned int l=0;l<D;l++)
+                {
+                    displacement[l] = velocities[k][l] + 0.005*diameter*(2.0*rng() - 1.0);
+                    positions[k][l] += displacement[l];
+                }
+
+                periodicBoundaries(positions[k], boxSize);
+
+                if (i < 2) nReinserted += tree.updateParticle(k, positions[k], 0.5*diameter);
+                else       nReinserted += tree.updateParticle(k, positions[k], 0.5*diameter, displacement);
+            }
+            timeUpdate += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            timeQuery += timeQueries(tree, nParticles);
+        }
+
+        printf("    %-13s update %.3f s (%u reinsertions), queries %.3f s, total %.3f s\n",
+            names[i], timeUpdate, nReinserted, timeQuery, timeUpdate + timeQuery);
+    }
+}
+
+template <unsigned int D>
+void benchmarkIndex(unsigned int nParticles, unsigned int nSteps)
+{
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    aabb::ParticleIndex indices[2] = {aabb::ParticleIndex::Dense, aabb::ParticleIndex::Sparse};
+    const char* names[2] = {"dense", "sparse"};
+
+    printf("  %uD, %u particles, %u steps:\n", D, nParticles, nSteps);
+
+    for (unsigned int i=0;i<2;i++)
+    {
+        // Generate random particle positions. (Overlaps don't matter here.)
+        MersenneTwister rng;
+        rng.setSeed(42);
+        std::vector<typename aabb::BasicTree<D>::Vector> positions(nParticles);
+
+        for (unsigned int j=0;j<nParticles;j++)
+        {
+            for (unsigned int k=0;k<D;k++)
+                positions[j][k] = boxSize[k]*rng();
+        }
+
+        // Start from the default capacity, so that the index has to grow.
+        auto start = std::chrono::steady_clock::now();
+        aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, 16, true, indices[i]);
+        for (unsigned int j=0;j<nParticles;j++)
+            tree.insertParticle(j, positions[j], 0.5*diameter);
+        double timeInsert = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // Jiggle the particles, visiting them in a random order. Few leave
+        // their fattened AABBs, so the updates are dominated by lookups.
+        start = std::chrono::steady_clock::now();
+        for (unsigned int j=0;j<nSteps;j++)
+        {
+            for (unsigned int k=0;k<nParticles;k++)
+            {
+                unsigned int particle = rng.integer(0, nParticles-1);
+
+                for (unsigned int l=0;l<D;l++)
+                    positions[particle][l] += 0.001*diameter*(2.0*rng() - 1.0);
+
+                tree.updateParticle(particle, positions[particle], 0.5*diameter);
+            }
+        }
+        double timeUpdate = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        for (unsigned int j=0;j<nParticles;j++)
+            tree.removeParticle(j);
+        double timeRemove = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("    %-7s insert %.3f s, update %.3f s, remove %.3f s\n",
+            names[i], timeInsert, timeUpdate, timeRemove);
+    }
+}
+
+template <unsigned int D, unsigned int TreeD>
+void benchmarkPeriodic(unsigned int nParticles, unsigned int nRepeats)
+{
+    typedef aabb::BasicTree<TreeD> TreeType;
+
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<typename TreeType::Vector> positions(nParticles, aabb::VectorTraits<TreeD>::create(D));
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        for (unsigned int j=0;j<D;j++)
+            positions[i][j] = boxSize[j]*rng();
+    }
+
+    printf("  %uD%s, %u particles:", D, (TreeD == 0) ? " (dynamic)" : "", nParticles);
+
+    const char* names[] = {" non-periodic", ", periodic", ", ghosts"};
+
+    for (unsigned int i=0;i<3;i++)
+    {
+        // Build identical trees, with and without periodic boundaries.
+        std::vector<bool> periodicity(D, i > 0);
+        TreeType tree(D, maxDisp, periodicity, boxSize, nParticles);
+        tree.setPeriodicGhosts(i == 2);
+
+        for (unsigned int j=0;j<nParticles;j++)
+            tree.insertParticle(j, positions[j], 0.5*diameter);
+
+        double time = 0;
+        for (unsigned int j=0;j<nRepeats;j++)
+            time += timeQueries(tree, nParticles);
+
+        printf("%s %.3f s", names[i], time);
+    }
+    printf("\n");
+}
+
+template <unsigned int D>
+void benchmarkRay(unsigned int nParticles, unsigned int nRays)
+{
+    typedef typename aabb::BasicTree<D>::Vector Vector;
+
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+    double radius = 0.5*diameter;
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<Vector> positions(nParticles);
+    aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        for (unsigned int j=0;j<D;j++)
+            positions[i][j] = boxSize[j]*rng();
+
+        tree.insertParticle(i, positions[i], radius);
+    }
+
+    // Generate random rays with unit directions.
+    std::vector<Vector> origins(nRays);
+    std::vector<Vector> directions(nRays);
+
+    for (unsigned int i=0;i<nRays;i++)
+    {
+        double norm = 0;
+        for (unsigned int j=0;j<D;j++)
+        {
+            origins[i][j] = boxSize[j]*rng();
+            directions[i][j] = 2.0*rng() - 1.0;
+            norm += directions[i][j]*directions[i][j];
+        }
+        for (unsigned int j=0;j<D;j++)
+            directions[i][j] /= std::sqrt(norm);
+    }
+
+    double maxT = 0.25*boxSize[0];
+    unsigned int nHits = 0;
+
+    // Visit every hit.
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nRays;i++)
+    {
+        tree.rayCast(origins[i], directions[i], maxT, [&](unsigned int, double)
+        {
+            nHits++;
+            return maxT;
+        });
+    }
+    double timeAll = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Search for the closest hit.
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nRays;i++)
+    {
+        tree.rayCast(origins[i], directions[i], maxT, [&](unsigned int, double t)
+        {
+            nHits++;
+            return t;
+        });
+    }
+    double timeClosest = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Test every particle. The ray is short enough to use minimum image separations.
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nRays;i++)
+    {
+        double tClosest = maxT;
+
+        for (unsigned int j=0;j<nParticles;j++)
+        {
+            double b = 0, c = 0;
+            for (unsigned int k=0;k<D;k++)
+            {
+                double separation = origins[i][k] - positions[j][k];
+
+                if      (separation < -0.5*boxSize[k]) separation += boxSize[k];
+                else if (separation >= 0.5*boxSize[k]) separation -= boxSize[k];
+
+                b += separation*directions[i][k];
+                c += separation*separation;
+            }
+            c -= radius*radius;
+
+            double discriminant = b*b - c;
+            if ((discriminant >= 0) && (b <= 0))
+                tClosest = std::min(tClosest, std::max(0.0, -b - std::sqrt(discriminant)));
+        }
+
+        if (tClosest < maxT) nHits++;
+    }
+    double timeBrute = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("  %uD, %u particles, %u rays: all hits %.3f s, closest hit %.3f s, brute force %.3f s\n",
+        D, nParticles, nRays, timeAll, timeClosest, timeBrute);
+}
+
+template <unsigned int D>
+void benchmarkNearest(unsigned int nParticles, unsigned int k)
+{
+    typedef typename aabb::BasicTree<D>::Vector Vector;
+
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<Vector> positions(nParticles);
+    aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        for (unsigned int j=0;j<D;j++)
+            positions[i][j] = boxSize[j]*rng();
+
+        tree.insertParticle(i, positions[i], 0.5*diameter);
+    }
+
+    std::vector<unsigned int> particles(nParticles);
+    for (unsigned int i=0;i<nParticles;i++) particles[i] = i;
+
+    // Grow an AABB around each particle until it holds k neighbours, then sort them.
+    std::vector<std::pair<double, unsigned int> > neighbours;
+    unsigned int nFound = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        double cutOff = diameter;
+
+        while (true)
+        {
+            Vector lowerBound, upperBound;
+            for (unsigned int j=0;j<D;j++)
+            {
+                lowerBound[j] = positions[i][j] - cutOff;
+                upperBound[j] = positions[i][j] + cutOff;
+            }
+
+            neighbours.clear();
+            tree.query(i, aabb::BasicAABB<D>(lowerBound, upperBound), [&](unsigned int particle)
+            {
+                double rSqd = distanceSqd(positions[i], positions[particle], boxSize);
+                if (rSqd <= cutOff*cutOff) neighbours.push_back(std::make_pair(rSqd, particle));
+                return true;
+            });
+
+            if (neighbours.size() >= k) break;
+
+            cutOff *= 1.5;
+        }
+
+        std::partial_sort(neighbours.begin(), neighbours.begin() + k, neighbours.end());
+        nFound += k;
+    }
+    double timeGrow = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Search each particle in turn.
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nParticles;i++)
+        nFound += tree.nearest(positions[i], k + 1).size();
+    double timeNearest = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Build the whole kNN graph in a single batch.
+    std::vector<unsigned int> offsets, indices;
+    start = std::chrono::steady_clock::now();
+    tree.nearestBatch(particles, k, offsets, indices);
+    double timeBatch = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("  %uD, %u particles: growing query %.3f s, nearest %.3f s, nearestBatch %.3f s\n",
+        D, nParticles, timeGrow, timeNearest, timeBatch);
+}
+
+template <unsigned int D>
+void benchmarkRadius(unsigned int nParticles, double cutOff, unsigned int nRepeats)
+{
+    typedef typename aabb::BasicTree<D>::Vector Vector;
+
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+    double radius = 0.5*diameter;
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<Vector> positions(nParticles);
+    aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        for (unsigned int j=0;j<D;j++)
+            positions[i][j] = boxSize[j]*rng();
+
+        tree.insertParticle(i, positions[i], radius);
+    }
+
+    // Find the particles that overlap a sphere of radius cutOff around each particle.
+    double rSqdMax = (cutOff + radius)*(cutOff + radius);
+    unsigned int nFilter = 0, nRadius = 0;
+
+    // Query the bounding box of the sphere, then filter by distance.
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nRepeats;i++)
+    {
+        for (unsigned int j=0;j<nParticles;j++)
+        {
+            Vector lowerBound, upperBound;
+            for (unsigned int k=0;k<D;k++)
+            {
+                lowerBound[k] = positions[j][k] - cutOff;
+                upperBound[k] = positions[j][k] + cutOff;
+            }
+
+            tree.query(aabb::BasicAABB<D>(lowerBound, upperBound), [&](unsigned int particle)
+            {
+                if (distanceSqd(positions[j], positions[particle], boxSize) < rSqdMax) nFilter++;
+                return true;
+            });
+        }
+    }
+    double timeFilter = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Query the sphere directly.
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nRepeats;i++)
+    {
+        for (unsigned int j=0;j<nParticles;j++)
+        {
+            tree.queryRadius(positions[j], cutOff, [&](unsigned int)
+            {
+                nRadius++;
+                return true;
+            });
+        }
+    }
+    double timeRadius = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("  %uD, %u particles, radius %.1f: query and filter %.3f s, queryRadius %.3f s (%s)\n",
+        D, nParticles, cutOff, timeFilter, timeRadius, (nFilter == nRadius) ? "same particles" : "MISMATCH");
+}
+
+template <unsigned int D, class Layout>
+void benchmarkPrecision(unsigned int nParticles, unsigned int nRepeats)
+{
+    typedef typename aabb::BasicTree<D, Layout>::Vector Vector;
+
+    // Place the box away from the origin, so that rounding to float is coarse.
+    double baseLength = computeBaseLength<D>(nParticles);
+    double offset = 1000.0;
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<Vector> lowerBounds(nParticles), upperBounds(nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        for (unsigned int j=0;j<D;j++)
+        {
+            double position = offset + baseLength*rng();
+            lowerBounds[i][j] = position - 0.5*diameter;
+            upperBounds[i][j] = position + 0.5*diameter;
+        }
+    }
+
+    aabb::BasicTree<D, Layout> tree(D, maxDisp, lowerBounds, upperBounds);
+
+    // Query the neighbours of every particle with double precision, for reference.
+    std::vector<std::vector<unsigned int> > reference(nParticles);
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        reference[i] = tree.query(i, tree.getAABB(i));
+        std::sort(reference[i].begin(), reference[i].end());
+    }
+
+    const char* names[] = {"double", "mixed", "single"};
+    aabb::Precision precisions[] = {aabb::Precision::Double, aabb::Precision::Mixed, aabb::Precision::Single};
+
+    printf("  %uD, %s, %u particles:", D, std::is_same<Layout, aabb::SoA>::value ? "SoA" : "AoS", nParticles);
+
+    for (unsigned int i=0;i<3;i++)
+    {
+        tree.setPrecision(precisions[i]);
+
+        // Take the fastest of the repeats.
+        double time = timeQueries(tree, nParticles);
+        for (unsigned int j=1;j<nRepeats;j++)
+            time = std::min(time, timeQueries(tree, nParticles));
+
+        // Count the true overlaps that are missed, and the extra candidates.
+        unsigned int nMissed = 0, nExtra = 0;
+        for (unsigned int j=0;j<nParticles;j++)
+        {
+            std::vector<unsigned int> particles = tree.query(j, tree.getAABB(j));
+            std::sort(particles.begin(), particles.end());
+
+            std::vector<unsigned int> missed;
+            std::set_difference(reference[j].begin(), reference[j].end(),
+                particles.begin(), particles.end(), std::back_inserter(missed));
+
+            nMissed += missed.size();
+            nExtra += particles.size() + missed.size() - reference[j].size();
+        }
+
+        printf(" %s %.3f s (%u missed, %u extra)%s", names[i], time, nMissed, nExtra, (i < 2) ? "," : "\n");
+    }
+
+    // The bytes of node bounds read for each node that is tested.
+    if (std::is_same<Layout, aabb::SoA>::value)
+    {
+        printf("  %uD, bounds per node: double %u bytes, float %u bytes\n",
+            D, unsigned(sizeof(aabb::BasicAABB<D>)), unsigned(2*D*sizeof(float)));
+    }
+}
+
+template <class TreeType, class SnapshotType>
+double timeSnapshotQueries(const TreeType& tree, const SnapshotType& snapshot,
+    unsigned int nParticles, unsigned long& nCandidates)
+{
+    nCandidates = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        snapshot.query(tree.getAABB(i), [&](unsigned int)
+        {
+            nCandidates++;
+            return true;
+        });
+    }
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Wrap a tree so that it is queried in the same way as its snapshots.
+template <unsigned int D>
+struct TreeQuery
+{
+    const aabb::BasicTree<D>& tree;
+
+    template <class Callback>
+    void query(const aabb::BasicAABB<D>& aabb, Callback&& callback) const
+    {
+        tree.query(aabb, callback);
+    }
+};
+
+template <unsigned int D>
+void benchmarkCompressed(unsigned int nParticles, unsigned int nRepeats)
+{
+    typedef typename aabb::BasicTree<D>::Vector Vector;
+
+    double baseLength = computeBaseLength<D>(nParticles);
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<Vector> lowerBounds(nParticles), upperBounds(nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        for (unsigned int j=0;j<D;j++)
+        {
+            double position = baseLength*rng();
+            lowerBounds[i][j] = position - 0.5*diameter;
+            upperBounds[i][j] = position + 0.5*diameter;
+        }
+    }
+
+    aabb::BasicTree<D> tree(D, maxDisp, lowerBounds, upperBounds);
+    aabb::BasicCompressedTree<D, std::uint16_t> snapshot16(tree);
+    aabb::BasicCompressedTree<D, std::uint8_t> snapshot8(tree);
+
+    TreeQuery<D> treeQuery{tree};
+
+    unsigned long nTree, n16, n8;
+    double timeTree = timeSnapshotQueries(tree, treeQuery, nParticles, nTree);
+    double time16 = timeSnapshotQueries(tree, snapshot16, nParticles, n16);
+    double time8 = timeSnapshotQueries(tree, snapshot8, nParticles, n8);
+
+    // Take the fastest of the repeats.
+    for (unsigned int i=1;i<nRepeats;i++)
+    {
+        timeTree = std::min(timeTree, timeSnapshotQueries(tree, treeQuery, nParticles, nTree));
+        time16 = std::min(time16, timeSnapshotQueries(tree, snapshot16, nParticles, n16));
+        time8 = std::min(time8, timeSnapshotQueries(tree, snapshot8, nParticles, n8));
+    }
+
+    // Make sure that the snapshots find every candidate that the tree does.
+    unsigned int nMissed = 0;
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        std::vector<unsigned int> particles = tree.query(tree.getAABB(i));
+        std::vector<unsigned int> particles16 = snapshot16.query(tree.getAABB(i));
+        std::vector<unsigned int> particles8 = snapshot8.query(tree.getAABB(i));
+        std::sort(particles.begin(), particles.end());
+        std::sort(particles16.begin(), particles16.end());
+        std::sort(particles8.begin(), particles8.end());
+
+        if (!std::includes(particles16.begin(), particles16.end(), particles.begin(), particles.end())
+         || !std::includes(particles8.begin(), particles8.end(), particles.begin(), particles.end()))
+            nMissed++;
+    }
+
+    double treeBytes = double(tree.getNodeCount())*sizeof(aabb::BasicNode<D>);
+
+    printf("  %uD, %u particles: tree nodes %.1f MB, 16-bit %.1f MB, 8-bit %.1f MB\n",
+        D, nParticles, treeBytes/1e6, snapshot16.getMemoryUsage()/1e6, snapshot8.getMemoryUsage()/1e6);
+    printf("  %uD, %u particles: tree %.3f s, 16-bit %.3f s (%.2f%% extra), 8-bit %.3f s (%.2f%% extra), %u queries missed candidates\n",
+        D, nParticles, timeTree, time16, 100.0*(n16 - nTree)/nTree, time8, 100.0*(n8 - nTree)/nTree, nMissed);
+}
+
+template <unsigned int D>
+void benchmarkWide(unsigned int nParticles, unsigned int nRepeats)
+{
+    typedef typename aabb::BasicTree<D>::Vector Vector;
+
+    double baseLength = computeBaseLength<D>(nParticles);
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<Vector> lowerBounds(nParticles), upperBounds(nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        for (unsigned int j=0;j<D;j++)
+        {
+            double position = baseLength*rng();
+            lowerBounds[i][j] = position - 0.5*diameter;
+            upperBounds[i][j] = position + 0.5*diameter;
+        }
+    }
+
+    aabb::BasicTree<D> tree(D, maxDisp, lowerBounds, upperBounds);
+    TreeQuery<D> treeQuery{tree};
+
+    // Time the collapse, taking the fastest of the repeats.
+    double buildTime4 = 0, buildTime8 = 0;
+    for (unsigned int i=0;i<nRepeats;i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        aabb::BasicWideTree<D, 4> snapshot4(tree);
+        auto middle = std::chrono::steady_clock::now();
+        aabb::BasicWideTree<D, 8> snapshot8(tree);
+        auto finish = std::chrono::steady_clock::now();
+
+        double time4 = std::chrono::duration<double>(middle - start).count();
+        double time8 = std::chrono::duration<double>(finish - middle).count();
+        buildTime4 = (i == 0) ? time4 : std::min(buildTime4, time4);
+        buildTime8 = (i == 0) ? time8 : std::min(buildTime8, time8);
+    }
+
+    aabb::BasicWideTree<D, 4> snapshot4(tree);
+    aabb::BasicWideTree<D, 8> snapshot8(tree);
+
+    unsigned long nTree, n4, n8;
+    double timeTree = timeSnapshotQueries(tree, treeQuery, nParticles, nTree);
+    double time4 = timeSnapshotQueries(tree, snapshot4, nParticles, n4);
+    double time8 = timeSnapshotQueries(tree, snapshot8, nParticles, n8);
+
+    for (unsigned int i=1;i<nRepeats;i++)
+    {
+        timeTree = std::min(timeTree, timeSnapshotQueries(tree, treeQuery, nParticles, nTree));
+        time4 = std::min(time4, timeSnapshotQueries(tree, snapshot4, nParticles, n4));
+        time8 = std::min(time8, timeSnapshotQueries(tree, snapshot8, nParticles, n8));
+    }
+
+    printf("  %uD, %u particles: height %u, 4-wide %u, 8-wide %u, build 4-wide %.3f s, 8-wide %.3f s\n",
+        D, nParticles, tree.getHeight(), snapshot4.getHeight(), snapshot8.getHeight(), buildTime4, buildTime8);
+    printf("  %uD, %u particles: tree %.3f s, 4-wide %.3f s (x%.2f), 8-wide %.3f s (x%.2f)%s\n",
+        D, nParticles, timeTree, time4, timeTree/time4, time8, timeTree/time8,
+        ((n4 == nTree) && (n8 == nTree)) ? "" : ", MISMATCH");
+}
+
+template <unsigned int D>
+bool scalarOverlaps(const aabb::BasicAABB<D>& aabb1, const aabb::BasicAABB<D>& aabb2, bool touchIsOverlap)
+{
+    for (unsigned int i=0;i<D;i++)
+    {
+        if (touchIsOverlap)
+        {
+            if (aabb2.upperBound[i] < aabb1.lowerBound[i] || aabb2.lowerBound[i] > aabb1.upperBound[i]) return false;
+        }
+        else
+        {
+            if (aabb2.upperBound[i] <= aabb1.lowerBound[i] || aabb2.lowerBound[i] >= aabb1.upperBound[i]) return false;
+        }
+    }
+
+    return true;
+}
+
+template <unsigned int D>
+bool scalarContains(const aabb::BasicAABB<D>& aabb1, const aabb::BasicAABB<D>& aabb2)
+{
+    for (unsigned int i=0;i<D;i++)
+    {
+        if (aabb2.lowerBound[i] < aabb1.lowerBound[i]) return false;
+        if (aabb2.upperBound[i] > aabb1.upperBound[i]) return false;
+    }
+
+    return true;
+}
+
+template <unsigned int D>
+void scalarMerge(aabb::BasicAABB<D>& aabb, const aabb::BasicAABB<D>& aabb1, const aabb::BasicAABB<D>& aabb2)
+{
+    for (unsigned int i=0;i<D;i++)
+    {
+        aabb.lowerBound[i] = std::min(aabb1.lowerBound[i], aabb2.lowerBound[i]);
+        aabb.upperBound[i] = std::max(aabb1.upperBound[i], aabb2.upperBound[i]);
+    }
+
+    // Sum of "area" of all the sides.
+    double sum = 0;
+
+    for (unsigned int d1=0;d1<D;d1++)
+    {
+        double product = 1;
+
+        for (unsigned int d2=0;d2<D;d2++)
+        {
+            if (d1 == d2) continue;
+            product *= aabb.upperBound[d2] - aabb.lowerBound[d2];
+        }
+
+        sum += product;
+    }
+
+    aabb.surfaceArea = 2.0 * sum;
+    aabb.centre = aabb.computeCentre();
+}
+
+template <class AABBType, class Kernel>
+double timeKernel(const std::vector<AABBType>& boxes, unsigned int nRepeats, Kernel&& kernel)
+{
+    unsigned int nBoxes = boxes.size();
+    double minTime = 0;
+
+    // Take the fastest of the repeats.
+    for (unsigned int i=0;i<nRepeats;i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned int j=0;j<nBoxes;j++) kernel(boxes[j], boxes[(7*j + i) % nBoxes]);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        minTime = (i == 0) ? elapsed : std::min(minTime, elapsed);
+    }
+
+    return 1e9*minTime/nBoxes;
+}
+
+template <unsigned int D>
+void benchmarkKernels(unsigned int nBoxes, unsigned int nRepeats)
+{
+    // Generate random boxes, so that about half of the pairs overlap.
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<aabb::BasicAABB<D> > boxes(nBoxes);
+
+    for (auto& box : boxes)
+    {
+        for (unsigned int i=0;i<D;i++)
+        {
+            double centre = 4*rng();
+            double halfWidth = rng();
+            box.lowerBound[i] = centre - halfWidth;
+            box.upperBound[i] = centre + halfWidth;
+        }
+    }
+
+    unsigned long nScalar = 0, nKernel = 0;
+    double sumScalar = 0, sumKernel = 0;
+    aabb::BasicAABB<D> merged;
+
+    double overlapsScalar = timeKernel(boxes, nRepeats, [&](const aabb::BasicAABB<D>& a, const aabb::BasicAABB<D>& b) { nScalar += scalarOverlaps(a, b, true); });
+    double overlapsKernel = timeKernel(boxes, nRepeats, [&](const aabb::BasicAABB<D>& a, const aabb::BasicAABB<D>& b) { nKernel += a.overlaps(b, true); });
+    double containsScalar = timeKernel(boxes, nRepeats, [&](const aabb::BasicAABB<D>& a, const aabb::BasicAABB<D>& b) { nScalar += scalarContains(a, b); });
+    double containsKernel = timeKernel(boxes, nRepeats, [&](const aabb::BasicAABB<D>& a, const aabb::BasicAABB<D>& b) { nKernel += a.contains(b); });
+    double mergeScalar = timeKernel(boxes, nRepeats, [&](const aabb::BasicAABB<D>& a, const aabb::BasicAABB<D>& b) { scalarMerge(merged, a, b); sumScalar += merged.surfaceArea; });
+    double mergeKernel = timeKernel(boxes, nRepeats, [&](const aabb::BasicAABB<D>& a, const aabb::BasicAABB<D>& b) { merged.merge(a, b); sumKernel += merged.surfaceArea; });
+
+    printf("  %uD: overlaps %.2f / %.2f ns, contains %.2f / %.2f ns, merge %.2f / %.2f ns%s\n",
+        D, overlapsScalar, overlapsKernel, containsScalar, containsKernel, mergeScalar, mergeKernel,
+        ((nScalar == nKernel) && (sumScalar == sumKernel)) ? "" : ", MISMATCH");
+}
+
+template <unsigned int D>
+void benchmarkCheckpoint(unsigned int nParticles, unsigned int nRepeats)
+{
+    typedef typename aabb::BasicTree<D>::Vector Vector;
+
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+    std::vector<bool> periodicity(D, true);
+    const char* fileName = "benchmark_checkpoint.bin";
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    std::vector<Vector> positions(nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+        for (unsigned int j=0;j<D;j++) positions[i][j] = boxSize[j]*rng();
+
+    double insertTime = 0, saveTime = 0, loadTime = 0;
+    bool isIdentical = true;
+
+    // Take the fastest of the repeats.
+    for (unsigned int i=0;i<nRepeats;i++)
+    {
+        aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned int j=0;j<nParticles;j++) tree.insertParticle(j, positions[j], 0.5*diameter);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        insertTime = (i == 0) ? elapsed : std::min(insertTime, elapsed);
+
+        start = std::chrono::steady_clock::now();
+        tree.save(fileName);
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        saveTime = (i == 0) ? elapsed : std::min(saveTime, elapsed);
+
+        aabb::BasicTree<D> reloaded(D);
+
+        start = std::chrono::steady_clock::now();
+        reloaded.load(fileName);
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        loadTime = (i == 0) ? elapsed : std::min(loadTime, elapsed);
+
+        // Check that the reloaded tree gives the same results.
+        for (unsigned int j=0;j<nParticles;j+=100)
+            isIdentical &= (tree.query(j) == reloaded.query(j));
+    }
+
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    double fileSize = double(file.tellg());
+    file.close();
+    std::remove(fileName);
+
+    printf("  %uD, %u particles: insert %.3f s, save %.3f s, load %.3f s (x%.1f), file %.1f MB%s\n",
+        D, nParticles, insertTime, saveTime, loadTime, insertTime/loadTime, fileSize/1e6,
+        isIdentical ? "" : ", MISMATCH");
+}
+
+template <unsigned int D>
+void benchmarkConcurrent(unsigned int nParticles, unsigned int nQueries)
+{
+    typedef typename aabb::BasicTree<D>::Vector Vector;
+    typedef std::vector<std::vector<unsigned int> > Results;
+
+    std::vector<bool> periodicity(D, true);
+    std::vector<double> boxSize(D, computeBaseLength<D>(nParticles));
+
+    // Generate random particle positions. (Overlaps don't matter here.)
+    MersenneTwister rng;
+    rng.setSeed(42);
+    aabb::BasicTree<D> tree(D, maxDisp, periodicity, boxSize, nParticles);
+
+    for (unsigned int i=0;i<nParticles;i++)
+    {
+        Vector position;
+        for (unsigned int j=0;j<D;j++) position[j] = boxSize[j]*rng();
+
+        tree.insertParticle(i, position, 0.5*diameter);
+    }
+
+    // Generate random query points and ray directions.
+    std::vector<Vector> points(nQueries);
+    std::vector<Vector> directions(nQueries);
+
+    for (unsigned int i=0;i<nQueries;i++)
+    {
+        double norm = 0;
+        for (unsigned int j=0;j<D;j++)
+        {
+            points[i][j] = boxSize[j]*rng();
+            directions[i][j] = 2.0*rng() - 1.0;
+            norm += directions[i][j]*directions[i][j];
+        }
+        for (unsigned int j=0;j<D;j++)
+            directions[i][j] /= std::sqrt(norm);
+    }
+
+    double maxT = 10*diameter;
+
+    // Run every kind of query at point i, appending the results to those of each kind.
+    auto runQueries = [&](unsigned int i, Results& results)
+    {
+        Vector lowerBound, upperBound;
+        for (unsigned int j=0;j<D;j++)
+        {
+            lowerBound[j] = points[i][j] - 1.5*diameter;
+            upperBound[j] = points[i][j] + 1.5*diameter;
+        }
+
+        results[0] = tree.query(aabb::BasicAABB<D>(lowerBound, upperBound));
+        results[1] = tree.queryRadius(points[i], 1.5*diameter);
+        results[2] = tree.nearest(points[i], 12);
+
+        results[3].clear();
+        tree.rayCast(points[i], directions[i], maxT, [&](unsigned int particle, double)
+        {
+            results[3].push_back(particle);
+            return maxT;
+        });
+    };
+
+    // The serial pass provides the reference results.
+    std::vector<Results> reference(nQueries, Results(4));
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i=0;i<nQueries;i++) runQueries(i, reference[i]);
+    double serialTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Every thread runs all of the queries, starting at a different point so
+    // that the threads work on different parts of the tree at any one time.
+    unsigned int nThreads = std::max(4u, std::thread::hardware_concurrency());
+    std::atomic<unsigned int> nMismatches(0);
+    std::vector<std::thread> threads;
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned int thread=0;thread<nThreads;thread++)
+    {
+        threads.emplace_back([&, thread]()
+        {
+            Results results(4);
+            unsigned int first = (thread*nQueries)/nThreads;
+
+            for (unsigned int i=0;i<nQueries;i++)
+            {
+                unsigned int query = (first + i) % nQueries;
+                runQueries(query, results);
+
+                if (results != reference[query]) nMismatches++;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    double concurrentTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("  %uD, %u particles, %u threads: serial %.3f s, concurrent %.3f s (x%.1f throughput)%s\n",
+        D, nParticles, nThreads, serialTime, concurrentTime, nThreads*serialTime/concurrentTime,
+        (nMismatches == 0) ? "" : ", MISMATCH");
+}
@@ -39,12 +39,6 @@
 
 // FUNCTION PROTOTYPES
 
-// Test whether two particles overlap.
-bool overlaps(std::vector<double>&, std::vector<double>&, const std::vector<bool>&, const std::vector<double>&, double);
-
-// Compute the minimum image separation vector.
-void minimumImage(std::vector<double>&, const std::vector<bool>&, const std::vector<double>&);
-
 // Apply periodic boundary conditions.
 void periodicBoundaries(std::vector<double>&, const std::vector<bool>&, const std::vector<double>&);
 
@@ -142,33 +136,8 @@ int main(int argc, char** argv)
                 position[0] = boxSize[0]*rng();
                 position[1] = boxSize[1]*rng();
 
-                // Compute lower and upper AABB bounds.
-                std::vector<double> lowerBound({position[0] - radiusLarge, position[1] - radiusLarge});
-                std::vector<double> upperBound({position[0] + radiusLarge, position[1] + radiusLarge});
-
-                // Generate the AABB.
-                aabb::AABB aabb(lowerBound, upperBound);
-
-                // Query AABB overlaps.
-                std::vector<unsigned int> particles = treeLarge.query(aabb);
-
-                // Flag as no overlap (yet).
-                isOverlap = false;
-
-                // Test overlap.
-                for (unsigned int j=0;j<particles.size();j++)
-                {
-                    // Cut-off distance.
-                    double cutOff = 2.0*radiusLarge;
-                    cutOff *= cutOff;
-
-                    // Particles overlap.
-                    if (overlaps(position, positionsLarge[particles[j]], periodicity, boxSize, cutOff))
-                    {
-                        isOverlap = true;
-                        break;
-                    }
-                }
+                // Test for overlap with the other large particles.
+                isOverlap = treeLarge.anyOverlap(position, radiusLarge);
             }
         }
 
@@ -198,59 +167,9 @@ int main(int argc, char** argv)
             position[0] = boxSize[0]*rng();
             position[1] = boxSize[1]*rng();
 
-            // Compute lower and upper AABB bounds.
-            std::vector<double> lowerBound({position[0] - radiusSmall, position[1] - radiusSmall});
-            std::vector<double> upperBound({position[0] + radiusSmall, position[1] + radiusSmall});
-
-            // Generate the AABB.
-            aabb::AABB aabb(lowerBound, upperBound);
-
-            // First query AABB overlaps with the large particles.
-            std::vector<unsigned int> particles = treeLarge.query(aabb);
-
-            // Flag as no overlap (yet).
-            isOverlap = false;
-
-            // Test overlap.
-            for (unsigned int j=0;j<particles.size();j++)
-            {
-                // Cut-off distance.
-                double cutOff = radiusSmall + radiusLarge;
-                cutOff *= cutOff;
-
-                // Particles overlap.
-                if (overlaps(position, positionsLarge[particles[j]], periodicity, boxSize, cutOff))
-                {
-                    isOverlap = true;
-                    break;
-                }
-            }
-
-            // Advance to next overlap test.
-            if (!isOverlap)
-            {
-                // No need to test the first particle.
-                if (i > 0)
-                {
-                    // Now query AABB overlaps with other small particles.
-                    particles = treeSmall.query(aabb);
-
-                    // Test overlap.
-                    for (unsigned int j=0;j<particles.size();j++)
-                    {
-                        // Cut-off distance.
-                        double cutOff = 2.0*radiusSmall;
-                        cutOff *= cutOff;
-
-                        // Particles overlap.
-                        if (overlaps(position, positionsSmall[particles[j]], periodicity, boxSize, cutOff))
-                        {
-                            isOverlap = true;
-                            break;
-                        }
-                    }
-                }
-            }
+            // Test for overlap with the large particles, then the other small particles.
+            isOverlap = treeLarge.anyOverlap(position, radiusSmall)
+                     || treeSmall.anyOverlap(position, radiusSmall);
         }
 
         // Insert particle into tree.
@@ -293,8 +212,6 @@ int main(int argc, char** argv)
             // Initialise vectors.
             std::vector<double> displacement(2);
             std::vector<double> position(2);
-            std::vector<double> lowerBound(2);
-            std::vector<double> upperBound(2);
 
             // Calculate the new particle position and displacement.
             if (particleType == 0)
@@ -315,79 +232,35 @@ int main(int argc, char** argv)
             // Apply periodic boundary conditions.
             periodicBoundaries(position, periodicity, boxSize);
 
-            // Compute lower and upper AABB bounds.
-            lowerBound[0] = position[0] - radius;
-            lowerBound[1] = position[1] - radius;
-            upperBound[0] = position[0] + radius;
-            upperBound[1] = position[1] + radius;
-
-            // Generate the AABB.
-            aabb::AABB aabb(lowerBound, upperBound);
-
-            // Query AABB overlaps with small particles.
-            std::vector<unsigned int> particles = treeSmall.query(aabb);
-
-            // Flag as not overlapping (yet).
-            bool isOverlap = false;
-
-            // Test overlap.
-            for (unsigned int k=0;k<particles.size();k++)
+            // Test for overlap with the small and large particles. The trees
+            // store the radius of each particle, so the exact disc overlap test
+            // is performed internally, stopping at the first overlap found.
+            // (Don't test self overlap.)
+            bool isOverlap;
+            if (particleType == 0)
             {
-                // Don't test self overlap.
-                if ((particleType == 1) || (particles[k] != particle))
-                {
-                    // Cut-off distance.
-                    double cutOff = radius + radiusSmall;
-                    cutOff *= cutOff;
-
-                    // Particles overlap.
-                    if (overlaps(position, positionsSmall[particles[k]], periodicity, boxSize, cutOff))
-                    {
-                        isOverlap = true;
-                        break;
-                    }
-                }
+                isOverlap = treeSmall.anyOverlap(particle, position, radius)
+                         || treeLarge.anyOverlap(position, radius);
+            }
+            else
+            {
+                isOverlap = treeSmall.anyOverlap(position, radius)
+                         || treeLarge.anyOverlap(particle, position, radius);
             }
 
-            // Advance to next overlap test.
+            // Accept the move.
             if (!isOverlap)
             {
-                // Now query AABB overlaps with large particles.
-                particles = treeLarge.query(aabb);
-
-                // Test overlap.
-                for (unsigned int k=0;k<particles.size();k++)
+                // Update the position and AABB tree.
+                if (particleType == 0)
                 {
-                    // Don't test self overlap.
-                    if ((particleType == 0) || (particles[k] != particle))
-                    {
-                        // Cut-off distance.
-                        double cutOff = radius + radiusLarge;
-                        cutOff *= cutOff;
-
-                        // Particles overlap.
-                        if (overlaps(position, positionsLarge[particles[k]], periodicity, boxSize, cutOff))
-                        {
-                            isOverlap = true;
-                            break;
-                        }
-                    }
+                    positionsSmall[particle] = position;
+                    treeSmall.updateParticle(particle, position, radius);
                 }
-
-                // Accept the move.
-                if (!isOverlap)
+                else
                 {
-                    // Update the position and AABB tree.
-                    if (particleType == 0)
-                    {
-                        positionsSmall[particle] = position;
-                        treeSmall.updateParticle(particle, lowerBound, upperBound);
-                    }
-                    else
-                    {
-                        positionsLarge[particle] = position;
-                        treeLarge.updateParticle(particle, lowerBound, upperBound);
-                    }
+                    positionsLarge[particle] = position;
+                    treeLarge.updateParticle(particle, position, radius);
                 }
             }
         }
@@ -416,42 +289,6 @@ int main(int argc, char** argv)
 
 // FUNCTION DEFINITIONS
 
-bool overlaps(std::vector<double>& position1, std::vector<double>& position2,
-    const std::vector<bool>& periodicity, const std::vector<double>& boxSize, double cutOff)
-{
-    // Calculate particle separation.
-    std::vector<double> separation;
-    separation.push_back(position1[0] - position2[0]);
-    separation.push_back(position1[1] - position2[1]);
-
-    // Calculate minimum image separation.
-    minimumImage(separation, periodicity, boxSize);
-
-    double rSqd = separation[0]*separation[0] + separation[1]*separation[1];
-
-    if (rSqd < cutOff) return true;
-    else return false;
-}
-
-void minimumImage(std::vector<double>& separation,
-    const std::vector<bool>& periodicity, const std::vector<double>& boxSize)
-{
-    for (unsigned int i=0;i<2;i++)
-    {
-        if (separation[i] < -0.5*boxSize[i])
-        {
-            separation[i] += periodicity[i]*boxSize[i];
-        }
-        else
-        {
-            if (separation[i] >= 0.5*boxSize[i])
-            {
-                separation[i] -= periodicity[i]*boxSize[i];
-            }
-        }
-    }
-}
-
 void periodicBoundaries(std::vector<double>& position,
     const std::vector<bool>& periodicity, const std::vector<double>& boxSize)
 {
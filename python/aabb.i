@@ -4,6 +4,7 @@
 #include "../src/AABB.h"
 %}
 
+%include "std_string.i"
 %include "std_vector.i"
 
 namespace std {
@@ -24,3 +25,7 @@ namespace std {
 }
 
 %include "../src/AABB.h"
+
+%template(AABB) aabb::BasicAABB<0>;
+%template(Node) aabb::BasicNode<0>;
+%template(Tree) aabb::BasicTree<0>;
@@ -8,7 +8,8 @@ from distutils.core import setup, Extension
 
 aabb_module = Extension('_aabb',
                          sources = ['aabb_wrap.cxx', '../src/AABB.cc'],
-                         extra_compile_args = ["-O3", "-std=c++11"], 
+                         extra_compile_args = ["-O3", "-std=c++11", "-pthread"],
+                         extra_link_args = ["-pthread"],
                         )
 
 setup (name = 'aabb',
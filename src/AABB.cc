@@ -28,265 +28,301 @@
 
 namespace aabb
 {
-    AABB::AABB()
+    template <unsigned int D>
+    BasicNode<D>::BasicNode()
     {
     }
 
-    AABB::AABB(unsigned int dimension)
+    template <unsigned int D>
+    bool BasicNode<D>::isLeaf() const
     {
-        assert(dimension >= 2);
-
-        lowerBound.resize(dimension);
-        upperBound.resize(dimension);
+        return (left == NULL_NODE);
     }
 
-    AABB::AABB(const std::vector<double>& lowerBound_, const std::vector<double>& upperBound_) :
-        lowerBound(lowerBound_), upperBound(upperBound_)
+    template <unsigned int D, class Layout>
+    BasicTree<D, Layout>::BasicTree(unsigned int dimension_,
+               double skinThickness_,
+               unsigned int nParticles,
+               bool touchIsOverlap_,
+               ParticleIndex particleIndex) :
+        dimension(dimension_), isPeriodic(false), skinThickness(skinThickness_),
+        particleMap(particleIndex), touchIsOverlap(touchIsOverlap_), balanceMethod(Balance::Height),
+        updateMethod(Update::Reinsert), refitThreshold(1.25), refitReference(0),
+        isAdaptiveSkin(false), targetAge(10), isGhosts(false), precision(Precision::Double)
     {
-        // Validate the dimensionality of the bounds vectors.
-        if (lowerBound.size() != upperBound.size())
+        // Validate the dimensionality.
+        if ((dimension < 2) || ((D != 0) && (dimension != D)))
         {
-            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+            throw std::invalid_argument("[ERROR]: Invalid dimensionality!");
         }
 
-        // Validate that the upper bounds exceed the lower bounds.
-        for (unsigned int i=0;i<lowerBound.size();i++)
+        // Initialise the periodicity vector.
+        periodicity.resize(dimension);
+        std::fill(periodicity.begin(), periodicity.end(), false);
+
+        // Initialise the tree.
+        root = NULL_NODE;
+        nodeCount = 0;
+        nodeCapacity = nParticles;
+        nodes.resize(nodeCapacity);
+
+        // Build a linked list for the list of free nodes.
+        for (unsigned int i=0;i<nodeCapacity-1;i++)
         {
-            // Validate the bound.
-            if (lowerBound[i] > upperBound[i])
-            {
-                throw std::invalid_argument("[ERROR]: AABB lower bound is greater than the upper bound!");
-            }
+            nodes.next(i) = i + 1;
+            nodes.height(i) = -1;
         }
+        nodes.next(nodeCapacity-1) = NULL_NODE;
+        nodes.height(nodeCapacity-1) = -1;
+
+        // Assign the index of the first free node.
+        freeList = 0;
+
+        // Make room for the particles in the map.
+        particleMap.reserve(nParticles);
 
-        surfaceArea = computeSurfaceArea();
-        centre = computeCentre();
+        // There is no simulation box.
+        setBoxSize(std::vector<double>(dimension, 0));
     }
 
-    double AABB::computeSurfaceArea() const
+    template <unsigned int D, class Layout>
+    BasicTree<D, Layout>::BasicTree(unsigned int dimension_,
+               double skinThickness_,
+               const std::vector<bool>& periodicity_,
+               const std::vector<double>& boxSize_,
+               unsigned int nParticles,
+               bool touchIsOverlap_,
+               ParticleIndex particleIndex) :
+        dimension(dimension_), skinThickness(skinThickness_),
+        periodicity(periodicity_), particleMap(particleIndex), touchIsOverlap(touchIsOverlap_), balanceMethod(Balance::Height),
+        updateMethod(Update::Reinsert), refitThreshold(1.25), refitReference(0),
+        isAdaptiveSkin(false), targetAge(10), isGhosts(false), precision(Precision::Double)
     {
-        // Sum of "area" of all the sides.
-        double sum = 0;
+        // Validate the dimensionality.
+        if ((dimension < 2) || ((D != 0) && (dimension != D)))
+        {
+            throw std::invalid_argument("[ERROR]: Invalid dimensionality!");
+        }
 
-        // General formula for one side: hold one dimension constant
-        // and multiply by all the other ones.
-        for (unsigned int d1 = 0; d1 < lowerBound.size(); d1++)
+        // Validate the dimensionality of the vectors.
+        if ((periodicity.size() != dimension) || (boxSize_.size() != dimension))
         {
-            // "Area" of current side.
-            double product = 1;
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+        }
 
-            for (unsigned int d2 = 0; d2 < lowerBound.size(); d2++)
-            {
-                if (d1 == d2)
-                    continue;
+        // Initialise the tree.
+        root = NULL_NODE;
+        nodeCount = 0;
+        nodeCapacity = nParticles;
+        nodes.resize(nodeCapacity);
 
-                double dx = upperBound[d2] - lowerBound[d2];
-                product *= dx;
-            }
+        // Build a linked list for the list of free nodes.
+        for (unsigned int i=0;i<nodeCapacity-1;i++)
+        {
+            nodes.next(i) = i + 1;
+            nodes.height(i) = -1;
+        }
+        nodes.next(nodeCapacity-1) = NULL_NODE;
+        nodes.height(nodeCapacity-1) = -1;
+
+        // Assign the index of the first free node.
+        freeList = 0;
+
+        // Make room for the particles in the map.
+        particleMap.reserve(nParticles);
 
-            // Update the sum.
-            sum += product;
+        // Check periodicity.
+        isPeriodic = false;
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            if (periodicity[i])
+                isPeriodic = true;
         }
 
-        return 2.0 * sum;
+        // Store the box size and minimum image positions.
+        setBoxSize(boxSize_);
     }
 
-    double AABB::getSurfaceArea() const
+    template <unsigned int D, class Layout>
+    BasicTree<D, Layout>::BasicTree(unsigned int dimension_,
+               double skinThickness_,
+               const std::vector<Vector>& lowerBounds,
+               const std::vector<Vector>& upperBounds,
+               bool touchIsOverlap_,
+               ParticleIndex particleIndex) :
+        BasicTree(dimension_, skinThickness_, std::max(1, 2*int(lowerBounds.size()) - 1),
+                  touchIsOverlap_, particleIndex)
     {
-        return surfaceArea;
+        bulkLoad(lowerBounds, upperBounds);
     }
 
-    void AABB::merge(const AABB& aabb1, const AABB& aabb2)
+    template <unsigned int D, class Layout>
+    BasicTree<D, Layout>::BasicTree(unsigned int dimension_,
+               double skinThickness_,
+               const std::vector<bool>& periodicity_,
+               const std::vector<double>& boxSize_,
+               const std::vector<Vector>& lowerBounds,
+               const std::vector<Vector>& upperBounds,
+               bool touchIsOverlap_,
+               ParticleIndex particleIndex) :
+        BasicTree(dimension_, skinThickness_, periodicity_, boxSize_,
+                  std::max(1, 2*int(lowerBounds.size()) - 1), touchIsOverlap_, particleIndex)
     {
-        assert(aabb1.lowerBound.size() == aabb2.lowerBound.size());
-        assert(aabb1.upperBound.size() == aabb2.upperBound.size());
-
-        lowerBound.resize(aabb1.lowerBound.size());
-        upperBound.resize(aabb1.lowerBound.size());
+        bulkLoad(lowerBounds, upperBounds);
+    }
 
-        for (unsigned int i=0;i<lowerBound.size();i++)
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::setPeriodicity(const std::vector<bool>& periodicity_)
+    {
+        // Validate the dimensionality of the periodicity vector.
+        if (periodicity_.size() != dimension)
         {
-            lowerBound[i] = std::min(aabb1.lowerBound[i], aabb2.lowerBound[i]);
-            upperBound[i] = std::max(aabb1.upperBound[i], aabb2.upperBound[i]);
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
         }
 
-        surfaceArea = computeSurfaceArea();
-        centre = computeCentre();
-    }
+        periodicity = periodicity_;
 
-    bool AABB::contains(const AABB& aabb) const
-    {
-        assert(aabb.lowerBound.size() == lowerBound.size());
+        isPeriodic = false;
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            if (periodicity[i])
+                isPeriodic = true;
+        }
 
-        for (unsigned int i=0;i<lowerBound.size();i++)
+        // Update the periods, once the box size is known.
+        if (periods.size() == dimension)
         {
-            if (aabb.lowerBound[i] < lowerBound[i]) return false;
-            if (aabb.upperBound[i] > upperBound[i]) return false;
+            for (unsigned int i=0;i<dimension;i++)
+                periods[i] = periodicity[i] ? boxSize[i] : 0;
         }
 
-        return true;
+        if (isGhosts) resetGhosts();
     }
 
-    bool AABB::overlaps(const AABB& aabb, bool touchIsOverlap) const
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::setBoxSize(const std::vector<double>& boxSize_)
     {
-        assert(aabb.lowerBound.size() == lowerBound.size());
-
-        bool rv = true;
-
-        if (touchIsOverlap)
+        // Validate the dimensionality of the box size vector.
+        if (boxSize_.size() != dimension)
         {
-            for (unsigned int i = 0; i < lowerBound.size(); ++i)
-            {
-                if (aabb.upperBound[i] < lowerBound[i] || aabb.lowerBound[i] > upperBound[i])
-                {
-                    rv = false;
-                    break;
-                }
-            }
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
         }
-        else
+
+        boxSize = VectorTraits<D>::create(dimension);
+        periods = VectorTraits<D>::create(dimension);
+        posMinImage = VectorTraits<D>::create(dimension);
+        negMinImage = VectorTraits<D>::create(dimension);
+        for (unsigned int i=0;i<dimension;i++)
         {
-            for (unsigned int i = 0; i < lowerBound.size(); ++i)
-            {
-                if (aabb.upperBound[i] <= lowerBound[i] || aabb.lowerBound[i] >= upperBound[i])
-                {
-                    rv = false;
-                    break;
-                }
-            }
+            boxSize[i] = boxSize_[i];
+            periods[i] = periodicity[i] ? boxSize[i] : 0;
+            posMinImage[i] =  0.5*boxSize[i];
+            negMinImage[i] = -0.5*boxSize[i];
         }
 
-        return rv;
+        if (isGhosts) resetGhosts();
     }
 
-    std::vector<double> AABB::computeCentre()
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::setBalance(Balance balance_)
     {
-        std::vector<double> position(lowerBound.size());
-
-        for (unsigned int i=0;i<position.size();i++)
-            position[i] = 0.5 * (lowerBound[i] + upperBound[i]);
-
-        return position;
+        balanceMethod = balance_;
     }
 
-    void AABB::setDimension(unsigned int dimension)
+    template <unsigned int D, class Layout>
+    Balance BasicTree<D, Layout>::getBalance() const
     {
-        assert(dimension >= 2);
-
-        lowerBound.resize(dimension);
-        upperBound.resize(dimension);
+        return balanceMethod;
     }
 
-    Node::Node()
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::setUpdate(Update update_)
     {
+        updateMethod = update_;
     }
 
-    bool Node::isLeaf() const
+    template <unsigned int D, class Layout>
+    Update BasicTree<D, Layout>::getUpdate() const
     {
-        return (left == NULL_NODE);
+        return updateMethod;
     }
 
-    Tree::Tree(unsigned int dimension_,
-               double skinThickness_,
-               unsigned int nParticles,
-               bool touchIsOverlap_) :
-        dimension(dimension_), isPeriodic(false), skinThickness(skinThickness_),
-        touchIsOverlap(touchIsOverlap_)
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::setRefitThreshold(double threshold)
     {
-        // Validate the dimensionality.
-        if ((dimension < 2))
+        // Validate the threshold.
+        if (threshold < 1)
         {
-            throw std::invalid_argument("[ERROR]: Invalid dimensionality!");
+            throw std::invalid_argument("[ERROR]: Refit threshold must be at least one!");
         }
 
-        // Initialise the periodicity vector.
-        periodicity.resize(dimension);
-        std::fill(periodicity.begin(), periodicity.end(), false);
+        refitThreshold = threshold;
+    }
 
-        // Initialise the tree.
-        root = NULL_NODE;
-        nodeCount = 0;
-        nodeCapacity = nParticles;
-        nodes.resize(nodeCapacity);
+    template <unsigned int D, class Layout>
+    double BasicTree<D, Layout>::getRefitThreshold() const
+    {
+        return refitThreshold;
+    }
 
-        // Build a linked list for the list of free nodes.
-        for (unsigned int i=0;i<nodeCapacity-1;i++)
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::setAdaptiveSkin(bool isAdaptive, unsigned int targetAge_)
+    {
+        // Validate the target age.
+        if (targetAge_ == 0)
         {
-            nodes[i].next = i + 1;
-            nodes[i].height = -1;
+            throw std::invalid_argument("[ERROR]: Target age must be positive!");
         }
-        nodes[nodeCapacity-1].next = NULL_NODE;
-        nodes[nodeCapacity-1].height = -1;
 
-        // Assign the index of the first free node.
-        freeList = 0;
+        isAdaptiveSkin = isAdaptive;
+        targetAge = targetAge_;
     }
 
-    Tree::Tree(unsigned int dimension_,
-               double skinThickness_,
-               const std::vector<bool>& periodicity_,
-               const std::vector<double>& boxSize_,
-               unsigned int nParticles,
-               bool touchIsOverlap_) :
-        dimension(dimension_), skinThickness(skinThickness_),
-        periodicity(periodicity_), boxSize(boxSize_),
-        touchIsOverlap(touchIsOverlap_)
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::getAdaptiveSkin() const
     {
-        // Validate the dimensionality.
-        if (dimension < 2)
-        {
-            throw std::invalid_argument("[ERROR]: Invalid dimensionality!");
-        }
+        return isAdaptiveSkin;
+    }
 
-        // Validate the dimensionality of the vectors.
-        if ((periodicity.size() != dimension) || (boxSize.size() != dimension))
-        {
-            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
-        }
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::setPeriodicGhosts(bool isGhosts_)
+    {
+        if (isGhosts_ == isGhosts) return;
 
-        // Initialise the tree.
-        root = NULL_NODE;
-        nodeCount = 0;
-        nodeCapacity = nParticles;
-        nodes.resize(nodeCapacity);
+        isGhosts = isGhosts_;
+        resetGhosts();
+    }
 
-        // Build a linked list for the list of free nodes.
-        for (unsigned int i=0;i<nodeCapacity-1;i++)
-        {
-            nodes[i].next = i + 1;
-            nodes[i].height = -1;
-        }
-        nodes[nodeCapacity-1].next = NULL_NODE;
-        nodes[nodeCapacity-1].height = -1;
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::getPeriodicGhosts() const
+    {
+        return isGhosts;
+    }
 
-        // Assign the index of the first free node.
-        freeList = 0;
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::setPrecision(Precision precision_)
+    {
+        precision = precision_;
 
-        // Check periodicity.
-        isPeriodic = false;
-        posMinImage.resize(dimension);
-        negMinImage.resize(dimension);
-        for (unsigned int i=0;i<dimension;i++)
+        // Release the single-precision bounds when they aren't used.
+        if (precision == Precision::Double)
         {
-            posMinImage[i] =  0.5*boxSize[i];
-            negMinImage[i] = -0.5*boxSize[i];
-
-            if (periodicity[i])
-                isPeriodic = true;
+            std::vector<float, AlignedAllocator<float> >().swap(floatBounds);
+            return;
         }
-    }
 
-    void Tree::setPeriodicity(const std::vector<bool>& periodicity_)
-    {
-        periodicity = periodicity_;
+        floatBounds.resize(std::size_t(2*dimension)*nodeCapacity);
+        syncFloatBounds();
     }
 
-    void Tree::setBoxSize(const std::vector<double>& boxSize_)
+    template <unsigned int D, class Layout>
+    Precision BasicTree<D, Layout>::getPrecision() const
     {
-        boxSize = boxSize_;
+        return precision;
     }
 
-    unsigned int Tree::allocateNode()
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::allocateNode()
     {
         // Exand the node pool as needed.
         if (freeList == NULL_NODE)
@@ -296,15 +332,16 @@ namespace aabb
             // The free list is empty. Rebuild a bigger pool.
             nodeCapacity *= 2;
             nodes.resize(nodeCapacity);
+            if (precision != Precision::Double) floatBounds.resize(std::size_t(2*dimension)*nodeCapacity);
 
             // Build a linked list for the list of free nodes.
             for (unsigned int i=nodeCount;i<nodeCapacity-1;i++)
             {
-                nodes[i].next = i + 1;
-                nodes[i].height = -1;
+                nodes.next(i) = i + 1;
+                nodes.height(i) = -1;
             }
-            nodes[nodeCapacity-1].next = NULL_NODE;
-            nodes[nodeCapacity-1].height = -1;
+            nodes.next(nodeCapacity-1) = NULL_NODE;
+            nodes.height(nodeCapacity-1) = -1;
 
             // Assign the index of the first free node.
             freeList = nodeCount;
@@ -312,32 +349,44 @@ namespace aabb
 
         // Peel a node off the free list.
         unsigned int node = freeList;
-        freeList = nodes[node].next;
-        nodes[node].parent = NULL_NODE;
-        nodes[node].left = NULL_NODE;
-        nodes[node].right = NULL_NODE;
-        nodes[node].height = 0;
-        nodes[node].aabb.setDimension(dimension);
+        freeList = nodes.next(node);
+        nodes.parent(node) = NULL_NODE;
+        nodes.left(node) = NULL_NODE;
+        nodes.right(node) = NULL_NODE;
+        nodes.height(node) = 0;
+        nodes.aabb(node).setDimension(dimension);
+        nodes.skin(node) = skinThickness;
+        nodes.age(node) = 0;
+        nodes.ghost(node) = NULL_NODE;
+        nodes.owner(node) = NULL_NODE;
         nodeCount++;
 
         return node;
     }
 
-    void Tree::freeNode(unsigned int node)
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::freeNode(unsigned int node)
     {
         assert(node < nodeCapacity);
         assert(0 < nodeCount);
 
-        nodes[node].next = freeList;
-        nodes[node].height = -1;
+        nodes.next(node) = freeList;
+        nodes.height(node) = -1;
         freeList = node;
         nodeCount--;
     }
 
-    void Tree::insertParticle(unsigned int particle, std::vector<double>& position, double radius)
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::insertParticle(unsigned int particle, const Vector& position, double radius)
     {
+        // NULL_NODE marks an empty slot in the particle map.
+        if (particle == NULL_NODE)
+        {
+            throw std::invalid_argument("[ERROR]: Particle index 0xffffffff is reserved!");
+        }
+
         // Make sure the particle doesn't already exist.
-        if (particleMap.count(particle) != 0)
+        if (particleMap.find(particle) != NULL_NODE)
         {
             throw std::invalid_argument("[ERROR]: Particle already exists in tree!");
         }
@@ -351,43 +400,47 @@ namespace aabb
         // Allocate a new node for the particle.
         unsigned int node = allocateNode();
 
-        // AABB size in each dimension.
-        std::vector<double> size(dimension);
-
         // Compute the AABB limits.
         for (unsigned int i=0;i<dimension;i++)
         {
-            nodes[node].aabb.lowerBound[i] = position[i] - radius;
-            nodes[node].aabb.upperBound[i] = position[i] + radius;
-            size[i] = nodes[node].aabb.upperBound[i] - nodes[node].aabb.lowerBound[i];
+            nodes.aabb(node).lowerBound[i] = position[i] - radius;
+            nodes.aabb(node).upperBound[i] = position[i] + radius;
         }
 
         // Fatten the AABB.
-        for (unsigned int i=0;i<dimension;i++)
-        {
-            nodes[node].aabb.lowerBound[i] -= skinThickness * size[i];
-            nodes[node].aabb.upperBound[i] += skinThickness * size[i];
-        }
-        nodes[node].aabb.surfaceArea = nodes[node].aabb.computeSurfaceArea();
-        nodes[node].aabb.centre = nodes[node].aabb.computeCentre();
+        fatten(nodes.aabb(node), nodes.skin(node), nullptr);
 
         // Zero the height.
-        nodes[node].height = 0;
+        nodes.height(node) = 0;
 
         // Insert a new leaf into the tree.
         insertLeaf(node);
 
         // Add the new particle to the map.
-        particleMap.insert(std::unordered_map<unsigned int, unsigned int>::value_type(particle, node));
+        particleMap.insert(particle, node);
 
         // Store the particle index.
-        nodes[node].particle = particle;
+        nodes.particle(node) = particle;
+
+        // Store the sphere for exact overlap tests.
+        nodes.position(node) = position;
+        nodes.radius(node) = radius;
+
+        // Mirror the leaf across the periodic boundaries.
+        addGhosts(node);
     }
 
-    void Tree::insertParticle(unsigned int particle, std::vector<double>& lowerBound, std::vector<double>& upperBound)
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::insertParticle(unsigned int particle, const Vector& lowerBound, const Vector& upperBound)
     {
+        // NULL_NODE marks an empty slot in the particle map.
+        if (particle == NULL_NODE)
+        {
+            throw std::invalid_argument("[ERROR]: Particle index 0xffffffff is reserved!");
+        }
+
         // Make sure the particle doesn't already exist.
-        if (particleMap.count(particle) != 0)
+        if (particleMap.find(particle) != NULL_NODE)
         {
             throw std::invalid_argument("[ERROR]: Particle already exists in tree!");
         }
@@ -401,9 +454,6 @@ namespace aabb
         // Allocate a new node for the particle.
         unsigned int node = allocateNode();
 
-        // AABB size in each dimension.
-        std::vector<double> size(dimension);
-
         // Compute the AABB limits.
         for (unsigned int i=0;i<dimension;i++)
         {
@@ -413,90 +463,81 @@ namespace aabb
                 throw std::invalid_argument("[ERROR]: AABB lower bound is greater than the upper bound!");
             }
 
-            nodes[node].aabb.lowerBound[i] = lowerBound[i];
-            nodes[node].aabb.upperBound[i] = upperBound[i];
-            size[i] = upperBound[i] - lowerBound[i];
+            nodes.aabb(node).lowerBound[i] = lowerBound[i];
+            nodes.aabb(node).upperBound[i] = upperBound[i];
         }
 
         // Fatten the AABB.
-        for (unsigned int i=0;i<dimension;i++)
-        {
-            nodes[node].aabb.lowerBound[i] -= skinThickness * size[i];
-            nodes[node].aabb.upperBound[i] += skinThickness * size[i];
-        }
-        nodes[node].aabb.surfaceArea = nodes[node].aabb.computeSurfaceArea();
-        nodes[node].aabb.centre = nodes[node].aabb.computeCentre();
+        fatten(nodes.aabb(node), nodes.skin(node), nullptr);
 
         // Zero the height.
-        nodes[node].height = 0;
+        nodes.height(node) = 0;
 
         // Insert a new leaf into the tree.
         insertLeaf(node);
 
         // Add the new particle to the map.
-        particleMap.insert(std::unordered_map<unsigned int, unsigned int>::value_type(particle, node));
+        particleMap.insert(particle, node);
 
         // Store the particle index.
-        nodes[node].particle = particle;
+        nodes.particle(node) = particle;
+
+        // The particle isn't described by a sphere.
+        nodes.radius(node) = -1;
+
+        // Mirror the leaf across the periodic boundaries.
+        addGhosts(node);
     }
 
-    unsigned int Tree::nParticles()
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::nParticles() const
     {
         return particleMap.size();
     }
 
-    void Tree::removeParticle(unsigned int particle)
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::removeParticle(unsigned int particle)
     {
-        // Map iterator.
-        std::unordered_map<unsigned int, unsigned int>::iterator it;
-
-        // Find the particle.
-        it = particleMap.find(particle);
+        // Find the particle's node.
+        unsigned int node = particleMap.find(particle);
 
         // The particle doesn't exist.
-        if (it == particleMap.end())
+        if (node == NULL_NODE)
         {
             throw std::invalid_argument("[ERROR]: Invalid particle index!");
         }
 
-        // Extract the node index.
-        unsigned int node = it->second;
-
         // Erase the particle from the map.
-        particleMap.erase(it);
+        particleMap.erase(particle);
 
         assert(node < nodeCapacity);
-        assert(nodes[node].isLeaf());
+        assert(nodes.isLeaf(node));
 
+        removeGhosts(node);
         removeLeaf(node);
         freeNode(node);
     }
 
-    void Tree::removeAll()
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::removeAll()
     {
-        // Iterator pointing to the start of the particle map.
-        std::unordered_map<unsigned int, unsigned int>::iterator it = particleMap.begin();
-
-        // Iterate over the map.
-        while (it != particleMap.end())
-        {
-            // Extract the node index.
-            unsigned int node = it->second;
-
-            assert(node < nodeCapacity);
-            assert(nodes[node].isLeaf());
+        // Free the internal nodes, then the leaves.
+        std::vector<unsigned int> leaves;
+        collectLeaves(leaves);
 
-            removeLeaf(node);
-            freeNode(node);
+        for (unsigned int i=0;i<leaves.size();i++)
+            freeNode(leaves[i]);
 
-            it++;
-        }
+        root = NULL_NODE;
 
         // Clear the particle map.
         particleMap.clear();
+
+        refitReference = 0;
     }
 
-    bool Tree::updateParticle(unsigned int particle, std::vector<double>& position, double radius,
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::updateParticle(unsigned int particle, const Vector& position, double radius,
                               bool alwaysReinsert)
     {
         // Validate the dimensionality of the position vector.
@@ -505,9 +546,18 @@ namespace aabb
             throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
         }
 
+        // Find the particle's node.
+        unsigned int node = particleMap.find(particle);
+
+        // The particle doesn't exist.
+        if (node == NULL_NODE)
+        {
+            throw std::invalid_argument("[ERROR]: Invalid particle index!");
+        }
+
         // AABB bounds vectors.
-        std::vector<double> lowerBound(dimension);
-        std::vector<double> upperBound(dimension);
+        Vector lowerBound = VectorTraits<D>::create(dimension);
+        Vector upperBound = VectorTraits<D>::create(dimension);
 
         // Compute the AABB limits.
         for (unsigned int i=0;i<dimension;i++)
@@ -516,12 +566,19 @@ namespace aabb
             upperBound[i] = position[i] + radius;
         }
 
-        // Update the particle.
-        return updateParticle(particle, lowerBound, upperBound, alwaysReinsert);
+        // Update the leaf.
+        bool isReinserted = updateLeaf(node, lowerBound, upperBound, nullptr, alwaysReinsert);
+
+        // Store the sphere for exact overlap tests.
+        nodes.position(node) = position;
+        nodes.radius(node) = radius;
+
+        return isReinserted;
     }
 
-    bool Tree::updateParticle(unsigned int particle, std::vector<double>& lowerBound,
-                              std::vector<double>& upperBound, bool alwaysReinsert)
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::updateParticle(unsigned int particle, const Vector& lowerBound,
+                              const Vector& upperBound, bool alwaysReinsert)
     {
         // Validate the dimensionality of the bounds vectors.
         if ((lowerBound.size() != dimension) && (upperBound.size() != dimension))
@@ -529,707 +586,2926 @@ namespace aabb
             throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
         }
 
-        // Map iterator.
-        std::unordered_map<unsigned int, unsigned int>::iterator it;
-
-        // Find the particle.
-        it = particleMap.find(particle);
+        // Find the particle's node.
+        unsigned int node = particleMap.find(particle);
 
         // The particle doesn't exist.
-        if (it == particleMap.end())
+        if (node == NULL_NODE)
         {
             throw std::invalid_argument("[ERROR]: Invalid particle index!");
         }
 
-        // Extract the node index.
-        unsigned int node = it->second;
+        // Update the leaf.
+        bool isReinserted = updateLeaf(node, lowerBound, upperBound, nullptr, alwaysReinsert);
 
-        assert(node < nodeCapacity);
-        assert(nodes[node].isLeaf());
+        // The particle is no longer described by a sphere.
+        nodes.radius(node) = -1;
 
-        // AABB size in each dimension.
-        std::vector<double> size(dimension);
+        return isReinserted;
+    }
 
-        // Compute the AABB limits.
-        for (unsigned int i=0;i<dimension;i++)
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::updateParticle(unsigned int particle, const Vector& position, double radius,
+                              const Vector& displacement, bool alwaysReinsert)
+    {
+        // Validate the dimensionality of the position and displacement vectors.
+        if ((position.size() != dimension) || (displacement.size() != dimension))
         {
-            // Validate the bound.
-            if (lowerBound[i] > upperBound[i])
-            {
-                throw std::invalid_argument("[ERROR]: AABB lower bound is greater than the upper bound!");
-            }
-
-            size[i] = upperBound[i] - lowerBound[i];
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
         }
 
-        // Create the new AABB.
-        AABB aabb(lowerBound, upperBound);
+        // Find the particle's node.
+        unsigned int node = particleMap.find(particle);
 
-        // No need to update if the particle is still within its fattened AABB.
-        if (!alwaysReinsert && nodes[node].aabb.contains(aabb)) return false;
+        // The particle doesn't exist.
+        if (node == NULL_NODE)
+        {
+            throw std::invalid_argument("[ERROR]: Invalid particle index!");
+        }
 
-        // Remove the current leaf.
-        removeLeaf(node);
+        // AABB bounds vectors.
+        Vector lowerBound = VectorTraits<D>::create(dimension);
+        Vector upperBound = VectorTraits<D>::create(dimension);
 
-        // Fatten the new AABB.
+        // Compute the AABB limits.
         for (unsigned int i=0;i<dimension;i++)
         {
-            aabb.lowerBound[i] -= skinThickness * size[i];
-            aabb.upperBound[i] += skinThickness * size[i];
+            lowerBound[i] = position[i] - radius;
+            upperBound[i] = position[i] + radius;
         }
 
-        // Assign the new AABB.
-        nodes[node].aabb = aabb;
-
-        // Update the surface area and centroid.
-        nodes[node].aabb.surfaceArea = nodes[node].aabb.computeSurfaceArea();
-        nodes[node].aabb.centre = nodes[node].aabb.computeCentre();
+        // Update the leaf.
+        bool isReinserted = updateLeaf(node, lowerBound, upperBound, &displacement, alwaysReinsert);
 
-        // Insert a new leaf node.
-        insertLeaf(node);
+        // Store the sphere for exact overlap tests.
+        nodes.position(node) = position;
+        nodes.radius(node) = radius;
 
-        return true;
+        return isReinserted;
     }
 
-    std::vector<unsigned int> Tree::query(unsigned int particle)
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::updateParticle(unsigned int particle, const Vector& lowerBound,
+                              const Vector& upperBound, const Vector& displacement, bool alwaysReinsert)
     {
-        // Make sure that this is a valid particle.
-        if (particleMap.count(particle) == 0)
+        // Validate the dimensionality of the bounds and displacement vectors.
+        if ((lowerBound.size() != dimension) || (upperBound.size() != dimension)
+            || (displacement.size() != dimension))
+        {
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+        }
+
+        // Find the particle's node.
+        unsigned int node = particleMap.find(particle);
+
+        // The particle doesn't exist.
+        if (node == NULL_NODE)
         {
             throw std::invalid_argument("[ERROR]: Invalid particle index!");
         }
 
-        // Test overlap of particle AABB against all other particles.
-        return query(particle, nodes[particleMap.find(particle)->second].aabb);
+        // Update the leaf.
+        bool isReinserted = updateLeaf(node, lowerBound, upperBound, &displacement, alwaysReinsert);
+
+        // The particle is no longer described by a sphere.
+        nodes.radius(node) = -1;
+
+        return isReinserted;
     }
 
-    std::vector<unsigned int> Tree::query(unsigned int particle, const AABB& aabb)
+    template <unsigned int D, class Layout>
+    std::vector<unsigned int> BasicTree<D, Layout>::updateParticles(const std::vector<unsigned int>& particles,
+        const double* lowerBounds, const double* upperBounds, unsigned int particleStride,
+        unsigned int axisStride, unsigned int nThreads)
     {
-        std::vector<unsigned int> stack;
-        stack.reserve(256);
-        stack.push_back(root);
-
-        std::vector<unsigned int> particles;
+        return updateLeaves(particles, lowerBounds, upperBounds, nullptr, particleStride, axisStride, nThreads);
+    }
 
-        while (stack.size() > 0)
+    template <unsigned int D, class Layout>
+    std::vector<unsigned int> BasicTree<D, Layout>::updateParticles(const std::vector<unsigned int>& particles,
+        const double* positions, const std::vector<double>& radii, unsigned int particleStride,
+        unsigned int axisStride, unsigned int nThreads)
+    {
+        if (radii.size() != particles.size())
         {
-            unsigned int node = stack.back();
-            stack.pop_back();
+            throw std::invalid_argument("[ERROR]: Mismatch in the number of particles and radii!");
+        }
 
-            // Copy the AABB.
-            AABB nodeAABB = nodes[node].aabb;
+        return updateLeaves(particles, positions, nullptr, radii.data(), particleStride, axisStride, nThreads);
+    }
 
-            if (node == NULL_NODE) continue;
+    template <unsigned int D, class Layout>
+    std::vector<unsigned int> BasicTree<D, Layout>::updateLeaves(const std::vector<unsigned int>& particles,
+        const double* first, const double* second, const double* radii, unsigned int particleStride,
+        unsigned int axisStride, unsigned int nThreads)
+    {
+        if (particleStride == 0) particleStride = dimension;
 
-            if (isPeriodic)
+        // Read the bounds of particle i along an axis at the given offset.
+        auto bounds = [first, second, radii](unsigned int i, std::size_t offset,
+                                             double& lowerBound, double& upperBound)
+        {
+            if (radii == nullptr)
             {
-                std::vector<double> separation(dimension);
-                std::vector<double> shift(dimension);
-                for (unsigned int i=0;i<dimension;i++)
-                    separation[i] = nodeAABB.centre[i] - aabb.centre[i];
+                lowerBound = first[offset];
+                upperBound = second[offset];
+            }
+            else
+            {
+                lowerBound = first[offset] - radii[i];
+                upperBound = first[offset] + radii[i];
+            }
+        };
 
-                bool isShifted = minimumImage(separation, shift);
+        if (nThreads == 0) nThreads = std::thread::hardware_concurrency();
+        nThreads = std::max(1u, std::min(nThreads, unsigned(particles.size() / 1024)));
 
-                // Shift the AABB.
-                if (isShifted)
+        unsigned int nParticles = particles.size();
+        unsigned int chunkSize = (nParticles + nThreads - 1) / nThreads;
+
+        // Look up the leaves and find the particles that have escaped their
+        // fattened AABBs. Errors are flagged and thrown once the workers are
+        // done, before the tree is modified.
+        std::vector<unsigned int> leaves(nParticles);
+        std::vector<char> isEscaped(nParticles);
+        std::atomic<bool> isInvalidParticle(false);
+        std::atomic<bool> isInvalidBound(false);
+
+        runParallel(nThreads, [&](unsigned int thread)
+        {
+            unsigned int end = std::min(nParticles, (thread + 1)*chunkSize);
+
+            for (unsigned int i=thread*chunkSize;i<end;i++)
+            {
+                leaves[i] = particleMap.find(particles[i]);
+
+                if (leaves[i] == NULL_NODE)
                 {
-                    for (unsigned int i=0;i<dimension;i++)
-                    {
-                        nodeAABB.lowerBound[i] += shift[i];
-                        nodeAABB.upperBound[i] += shift[i];
-                    }
+                    isInvalidParticle = true;
+                    return;
                 }
-            }
 
-            // Test for overlap between the AABBs.
-            if (aabb.overlaps(nodeAABB, touchIsOverlap))
-            {
-                // Check that we're at a leaf node.
-                if (nodes[node].isLeaf())
+                isEscaped[i] = false;
+
+                const AABBType& aabb = nodes.aabb(leaves[i]);
+                std::size_t offset = std::size_t(i)*particleStride;
+
+                for (unsigned int j=0;j<dimension;j++)
                 {
-                    // Can't interact with itself.
-                    if (nodes[node].particle != particle)
+                    double lowerBound, upperBound;
+                    bounds(i, offset + j*axisStride, lowerBound, upperBound);
+
+                    if (lowerBound > upperBound)
                     {
-                        particles.push_back(nodes[node].particle);
+                        isInvalidBound = true;
+                        return;
                     }
-                }
-                else
-                {
-                    stack.push_back(nodes[node].left);
-                    stack.push_back(nodes[node].right);
+
+                    if ((lowerBound < aabb.lowerBound[j]) || (upperBound > aabb.upperBound[j]))
+                        isEscaped[i] = true;
                 }
             }
+        });
+
+        if (isInvalidParticle)
+        {
+            throw std::invalid_argument("[ERROR]: Invalid particle index!");
+        }
+        if (isInvalidBound)
+        {
+            throw std::invalid_argument("[ERROR]: AABB lower bound is greater than the upper bound!");
         }
 
-        return particles;
+        // Make sure that no particle is updated twice.
+        std::vector<char> isUpdated(nodeCapacity, false);
+        for (unsigned int i=0;i<nParticles;i++)
+        {
+            if (isUpdated[leaves[i]])
+            {
+                throw std::invalid_argument("[ERROR]: Duplicate particle index!");
+            }
+            isUpdated[leaves[i]] = true;
+        }
+
+        // Measure the quality of the tree before refitting degrades it.
+        if ((updateMethod == Update::Refit) && (refitReference == 0))
+            refitReference = computeSurfaceAreaRatio();
+
+        std::vector<unsigned int> escaped;
+        std::vector<unsigned int> escapedLeaves;
+        for (unsigned int i=0;i<nParticles;i++)
+        {
+            unsigned int leaf = leaves[i];
+            std::size_t offset = std::size_t(i)*particleStride;
+
+            // Store the spheres for exact overlap tests, if there are any.
+            if (radii == nullptr) nodes.radius(leaf) = -1;
+            else
+            {
+                Vector& position = nodes.position(leaf);
+                VectorTraits<D>::resize(position, dimension);
+
+                for (unsigned int j=0;j<dimension;j++)
+                    position[j] = first[offset + j*axisStride];
+
+                nodes.radius(leaf) = radii[i];
+            }
+
+            // Particles that are too slow for their adaptive skin are reinserted too.
+            nodes.age(leaf)++;
+            if (isAdaptiveSkin && (nodes.age(leaf) >= 4*targetAge)) isEscaped[i] = true;
+
+            if (!isEscaped[i]) continue;
+
+            // The ghosts are recreated once the tree has been updated.
+            removeGhosts(leaf);
+
+            // Assign the new fattened AABB.
+            AABBType& aabb = nodes.aabb(leaf);
+
+            for (unsigned int j=0;j<dimension;j++)
+                bounds(i, offset + j*axisStride, aabb.lowerBound[j], aabb.upperBound[j]);
+            adaptSkin(leaf);
+            fatten(aabb, nodes.skin(leaf), nullptr);
+
+            escaped.push_back(particles[i]);
+            escapedLeaves.push_back(leaf);
+        }
+
+        if (escaped.empty()) return escaped;
+
+        if (updateMethod == Update::Reinsert) reinsertLeaves(escapedLeaves);
+        else
+        {
+            // Refit in place, falling back to reinserting the escaped
+            // particles, then a full rebuild, if the tree has degraded.
+            // Reinsertion is skipped when most of the tree has moved.
+            if (refitAll() > refitThreshold*refitReference)
+            {
+                if (4*escapedLeaves.size() < particleMap.size())
+                    reinsertLeaves(escapedLeaves);
+
+                if (computeSurfaceAreaRatio() > refitThreshold*refitReference)
+                    rebuild(nThreads);
+            }
+        }
+
+        for (unsigned int i=0;i<escapedLeaves.size();i++)
+            addGhosts(escapedLeaves[i]);
+
+        validate();
+
+        return escaped;
     }
 
-    std::vector<unsigned int> Tree::query(const AABB& aabb)
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::updateLeaf(unsigned int node, const Vector& lowerBound,
+                              const Vector& upperBound, const Vector* displacement, bool alwaysReinsert)
     {
-        // Make sure the tree isn't empty.
-        if (particleMap.size() == 0)
+        assert(node < nodeCapacity);
+        assert(nodes.isLeaf(node));
+
+        // Validate the bounds.
+        for (unsigned int i=0;i<dimension;i++)
         {
-            return std::vector<unsigned int>();
+            if (lowerBound[i] > upperBound[i])
+            {
+                throw std::invalid_argument("[ERROR]: AABB lower bound is greater than the upper bound!");
+            }
         }
 
-        // Test overlap of AABB against all particles.
-        return query(std::numeric_limits<unsigned int>::max(), aabb);
+        // Create the new AABB.
+        AABBType aabb(lowerBound, upperBound);
+
+        nodes.age(node)++;
+
+        // No need to update if the particle is still within its fattened AABB,
+        // unless that has become much larger than needed.
+        if (!alwaysReinsert && nodes.aabb(node).contains(aabb))
+        {
+            // The particle is too slow for its adaptive skin.
+            bool isOversized = isAdaptiveSkin && (nodes.age(node) >= 4*targetAge);
+
+            // The fattened AABB reaches well beyond the one predicted from
+            // the displacement, e.g. the particle has slowed or turned.
+            if (!isOversized && (displacement != nullptr))
+            {
+                AABBType hugeAABB(aabb);
+                fatten(hugeAABB, 5*nodes.skin(node), displacement);
+                isOversized = !hugeAABB.contains(nodes.aabb(node));
+            }
+
+            if (!isOversized) return false;
+        }
+
+        // Remove the current leaf.
+        removeGhosts(node);
+        removeLeaf(node);
+
+        // Assign the new fattened AABB.
+        adaptSkin(node);
+        fatten(aabb, nodes.skin(node), displacement);
+        nodes.aabb(node) = aabb;
+
+        // Insert a new leaf node.
+        insertLeaf(node);
+        addGhosts(node);
+
+        return true;
     }
 
-    const AABB& Tree::getAABB(unsigned int particle)
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::fatten(AABBType& aabb, double skin, const Vector* displacement) const
     {
-        return nodes[particleMap[particle]].aabb;
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            double size = aabb.upperBound[i] - aabb.lowerBound[i];
+
+            aabb.lowerBound[i] -= skin * size;
+            aabb.upperBound[i] += skin * size;
+
+            // Stretch the AABB along the direction of motion.
+            if (displacement != nullptr)
+            {
+                double stretch = DISPLACEMENT_MULTIPLIER * (*displacement)[i];
+
+                if (stretch < 0) aabb.lowerBound[i] += stretch;
+                else             aabb.upperBound[i] += stretch;
+            }
+        }
+
+        // Update the surface area and centroid.
+        aabb.surfaceArea = aabb.computeSurfaceArea();
+        aabb.centre = aabb.computeCentre();
     }
 
-    void Tree::insertLeaf(unsigned int leaf)
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::adaptSkin(unsigned int leaf)
     {
-        if (root == NULL_NODE)
+        if (isAdaptiveSkin)
         {
-            root = leaf;
-            nodes[root].parent = NULL_NODE;
-            return;
+            // A diffusing particle travels a distance that grows with the square
+            // root of time, so this scaling gives a lifetime close to the target.
+            double scale = std::sqrt(double(targetAge) / std::max(1u, nodes.age(leaf)));
+            double skin = nodes.skin(leaf) * std::max(0.5, std::min(2.0, scale));
+
+            nodes.skin(leaf) = std::max(skinThickness/SKIN_RANGE, std::min(SKIN_RANGE*skinThickness, skin));
         }
 
-        // Find the best sibling for the node.
+        nodes.age(leaf) = 0;
+    }
 
-        AABB leafAABB = nodes[leaf].aabb;
-        unsigned int index = root;
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::isGhostQuery(const AABBType& aabb, bool& isOutside) const
+    {
+        isOutside = false;
 
-        while (!nodes[index].isLeaf())
+        for (unsigned int i=0;i<dimension;i++)
         {
-            // Extract the children of the node.
-            unsigned int left  = nodes[index].left;
-            unsigned int right = nodes[index].right;
+            if (periods[i] == 0) continue;
 
-            double surfaceArea = nodes[index].aabb.getSurfaceArea();
+            // The ghosts only cover queries up to the ghost width, and an image
+            // could be found twice if the query and leaf span half the box.
+            double halfExtent = 0.5*(aabb.upperBound[i] - aabb.lowerBound[i]);
+            if ((halfExtent > ghostWidth[i]) || (halfExtent + ghostWidth[i] >= posMinImage[i]))
+                return false;
 
-            AABB combinedAABB;
-            combinedAABB.merge(nodes[index].aabb, leafAABB);
-            double combinedSurfaceArea = combinedAABB.getSurfaceArea();
+            double centre = 0.5*(aabb.lowerBound[i] + aabb.upperBound[i]);
+            if ((centre < 0) || (centre >= periods[i])) isOutside = true;
+        }
 
-            // Cost of creating a new parent for this node and the new leaf.
-            double cost = 2.0 * combinedSurfaceArea;
+        return true;
+    }
 
-            // Minimum cost of pushing the leaf further down the tree.
-            double inheritanceCost = 2.0 * (combinedSurfaceArea - surfaceArea);
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::wrapQuery(AABBType& aabb) const
+    {
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            if (periods[i] == 0) continue;
 
-            // Cost of descending to the left.
-            double costLeft;
-            if (nodes[left].isLeaf())
+            double centre = 0.5*(aabb.lowerBound[i] + aabb.upperBound[i]);
+            double shift = -std::floor(centre / periods[i]) * periods[i];
+
+            aabb.lowerBound[i] += shift;
+            aabb.upperBound[i] += shift;
+            aabb.centre[i] = centre + shift;
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::addGhosts(unsigned int leaf)
+    {
+        if (!isGhosts || !isPeriodic) return;
+
+        // The leaf was mirrored when the ghosts were last reset.
+        if (nodes.ghost(leaf) != NULL_NODE) return;
+
+        // Widen the ghosts of all leaves if this one is larger than the ghost width.
+        const AABBType& aabb = nodes.aabb(leaf);
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            if ((periods[i] != 0) && (0.5*(aabb.upperBound[i] - aabb.lowerBound[i]) > ghostWidth[i]))
             {
-                AABB aabb;
-                aabb.merge(leafAABB, nodes[left].aabb);
-                costLeft = aabb.getSurfaceArea() + inheritanceCost;
+                resetGhosts();
+                return;
+            }
+        }
+
+        createGhosts(leaf);
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::createGhosts(unsigned int leaf)
+    {
+        // Copy the AABB, since allocating nodes can resize the pool.
+        AABBType aabb = nodes.aabb(leaf);
+
+        // Work out the range of images that lie within the ghost width of the box.
+        Vector minImage = VectorTraits<D>::create(dimension);
+        Vector maxImage = VectorTraits<D>::create(dimension);
+        Vector image = VectorTraits<D>::create(dimension);
+
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            if (periods[i] != 0)
+            {
+                minImage[i] = std::ceil((-ghostWidth[i] - aabb.upperBound[i]) / periods[i]);
+                maxImage[i] = std::floor((periods[i] + ghostWidth[i] - aabb.lowerBound[i]) / periods[i]);
             }
             else
             {
-                AABB aabb;
-                aabb.merge(leafAABB, nodes[left].aabb);
-                double oldArea = nodes[left].aabb.getSurfaceArea();
-                double newArea = aabb.getSurfaceArea();
-                costLeft = (newArea - oldArea) + inheritanceCost;
+                minImage[i] = 0;
+                maxImage[i] = 0;
             }
+            image[i] = minImage[i];
+        }
 
-            // Cost of descending to the right.
-            double costRight;
-            if (nodes[right].isLeaf())
+        // Insert a ghost for every image other than the leaf itself.
+        while (true)
+        {
+            bool isShifted = false;
+            for (unsigned int i=0;i<dimension;i++)
             {
-                AABB aabb;
-                aabb.merge(leafAABB, nodes[right].aabb);
-                costRight = aabb.getSurfaceArea() + inheritanceCost;
+                if (image[i] != 0) isShifted = true;
             }
-            else
+
+            if (isShifted)
             {
-                AABB aabb;
-                aabb.merge(leafAABB, nodes[right].aabb);
-                double oldArea = nodes[right].aabb.getSurfaceArea();
-                double newArea = aabb.getSurfaceArea();
-                costRight = (newArea - oldArea) + inheritanceCost;
+                unsigned int ghost = allocateNode();
+                AABBType& ghostAABB = nodes.aabb(ghost);
+
+                for (unsigned int i=0;i<dimension;i++)
+                {
+                    double shift = image[i] * periods[i];
+
+                    ghostAABB.lowerBound[i] = aabb.lowerBound[i] + shift;
+                    ghostAABB.upperBound[i] = aabb.upperBound[i] + shift;
+                }
+                ghostAABB.surfaceArea = aabb.surfaceArea;
+                ghostAABB.centre = ghostAABB.computeCentre();
+
+                // Ghosts report the particle index of the leaf that they mirror.
+                nodes.particle(ghost) = nodes.particle(leaf);
+                nodes.radius(ghost) = -1;
+                nodes.owner(ghost) = leaf;
+
+                // Push the ghost onto the chain of the leaf.
+                nodes.ghost(ghost) = nodes.ghost(leaf);
+                nodes.ghost(leaf) = ghost;
+
+                insertLeaf(ghost);
             }
 
-            // Descend according to the minimum cost.
-            if ((cost < costLeft) && (cost < costRight)) break;
+            // Advance to the next image.
+            unsigned int i = 0;
+            while ((i < dimension) && (image[i] >= maxImage[i]))
+            {
+                image[i] = minImage[i];
+                i++;
+            }
 
-            // Descend.
-            if (costLeft < costRight) index = left;
-            else                      index = right;
+            if (i == dimension) break;
+
+            image[i]++;
         }
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::removeGhosts(unsigned int leaf)
+    {
+        unsigned int ghost = nodes.ghost(leaf);
 
-        unsigned int sibling = index;
+        while (ghost != NULL_NODE)
+        {
+            unsigned int next = nodes.ghost(ghost);
 
-        // Create a new parent.
-        unsigned int oldParent = nodes[sibling].parent;
-        unsigned int newParent = allocateNode();
-        nodes[newParent].parent = oldParent;
-        nodes[newParent].aabb.merge(leafAABB, nodes[sibling].aabb);
-        nodes[newParent].height = nodes[sibling].height + 1;
+            removeLeaf(ghost);
+            freeNode(ghost);
 
-        // The sibling was not the root.
-        if (oldParent != NULL_NODE)
+            ghost = next;
+        }
+
+        nodes.ghost(leaf) = NULL_NODE;
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::resetGhosts()
+    {
+        // Find the leaves that aren't ghosts.
+        std::vector<unsigned int> leaves;
+        leaves.reserve(particleMap.size());
+
+        for (unsigned int i=0;i<nodeCapacity;i++)
         {
-            if (nodes[oldParent].left == sibling) nodes[oldParent].left = newParent;
-            else                                  nodes[oldParent].right = newParent;
+            if ((nodes.height(i) == 0) && (nodes.owner(i) == NULL_NODE))
+                leaves.push_back(i);
+        }
+
+        for (unsigned int i=0;i<leaves.size();i++)
+            removeGhosts(leaves[i]);
+
+        if (!isGhosts || !isPeriodic) return;
 
-            nodes[newParent].left = sibling;
-            nodes[newParent].right = leaf;
-            nodes[sibling].parent = newParent;
-            nodes[leaf].parent = newParent;
+        // Size the ghost width to the largest leaf, leaving room to grow.
+        ghostWidth = VectorTraits<D>::create(dimension);
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            ghostWidth[i] = 0;
+            for (unsigned int j=0;j<leaves.size();j++)
+            {
+                const AABBType& aabb = nodes.aabb(leaves[j]);
+                ghostWidth[i] = std::max(ghostWidth[i], 0.5*(aabb.upperBound[i] - aabb.lowerBound[i]));
+            }
+            ghostWidth[i] *= GHOST_MARGIN;
         }
-        // The sibling was the root.
-        else
+
+        for (unsigned int i=0;i<leaves.size();i++)
+            createGhosts(leaves[i]);
+    }
+
+    template <unsigned int D, class Layout>
+    std::vector<unsigned int> BasicTree<D, Layout>::query(unsigned int particle) const
+    {
+        unsigned int node = particleMap.find(particle);
+
+        // Make sure that this is a valid particle.
+        if (node == NULL_NODE)
         {
-            nodes[newParent].left = sibling;
-            nodes[newParent].right = leaf;
-            nodes[sibling].parent = newParent;
-            nodes[leaf].parent = newParent;
-            root = newParent;
+            throw std::invalid_argument("[ERROR]: Invalid particle index!");
         }
 
-        // Walk back up the tree fixing heights and AABBs.
-        index = nodes[leaf].parent;
-        while (index != NULL_NODE)
+        // Test overlap of particle AABB against all other particles.
+        return query(particle, nodes.aabb(node));
+    }
+
+    template <unsigned int D, class Layout>
+    std::vector<unsigned int> BasicTree<D, Layout>::query(unsigned int particle, const AABBType& aabb) const
+    {
+        std::vector<unsigned int> particles;
+
+        query(particle, aabb, [&particles](unsigned int index)
+        {
+            particles.push_back(index);
+            return true;
+        });
+
+        return particles;
+    }
+
+    template <unsigned int D, class Layout>
+    std::vector<unsigned int> BasicTree<D, Layout>::query(const AABBType& aabb) const
+    {
+        // Make sure the tree isn't empty.
+        if (particleMap.size() == 0)
         {
-            index = balance(index);
+            return std::vector<unsigned int>();
+        }
 
-            unsigned int left = nodes[index].left;
-            unsigned int right = nodes[index].right;
+        // Test overlap of AABB against all particles.
+        return query(std::numeric_limits<unsigned int>::max(), aabb);
+    }
 
-            assert(left != NULL_NODE);
-            assert(right != NULL_NODE);
+    template <unsigned int D, class Layout>
+    std::vector<unsigned int> BasicTree<D, Layout>::queryRadius(const Vector& position, double radius) const
+    {
+        std::vector<unsigned int> particles;
+
+        queryRadius(position, radius, [&](unsigned int particle)
+        {
+            particles.push_back(particle);
+            return true;
+        });
+
+        return particles;
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::queryBatch(const std::vector<AABBType>& aabbs, std::vector<unsigned int>& offsets,
+                                          std::vector<unsigned int>& indices, unsigned int nThreads) const
+    {
+        runBatch(aabbs.size(), [&](unsigned int i, std::vector<unsigned int>& buffer)
+        {
+            traverse(aabbs[i], [&](unsigned int leaf)
+            {
+                buffer.push_back(nodes.particle(leaf));
+                return true;
+            });
+        }, offsets, indices, nThreads);
+    }
 
-            nodes[index].height = 1 + std::max(nodes[left].height, nodes[right].height);
-            nodes[index].aabb.merge(nodes[left].aabb, nodes[right].aabb);
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::queryBatch(const std::vector<unsigned int>& particles, std::vector<unsigned int>& offsets,
+                                          std::vector<unsigned int>& indices, unsigned int nThreads) const
+    {
+        // Map the particles to their leaf nodes, validating them before any
+        // work is handed to the worker threads.
+        std::vector<unsigned int> leaves(particles.size());
+        for (unsigned int i=0;i<particles.size();i++)
+        {
+            leaves[i] = particleMap.find(particles[i]);
 
-            index = nodes[index].parent;
+            if (leaves[i] == NULL_NODE)
+            {
+                throw std::invalid_argument("[ERROR]: Invalid particle index!");
+            }
         }
+
+        runBatch(particles.size(), [&](unsigned int i, std::vector<unsigned int>& buffer)
+        {
+            traverse(nodes.aabb(leaves[i]), [&](unsigned int leaf)
+            {
+                // Can't interact with itself.
+                if (leaf != leaves[i]) buffer.push_back(nodes.particle(leaf));
+                return true;
+            });
+        }, offsets, indices, nThreads);
     }
 
-    void Tree::removeLeaf(unsigned int leaf)
+    template <unsigned int D, class Layout>
+    std::vector<unsigned int> BasicTree<D, Layout>::nearest(const Vector& point, unsigned int k) const
     {
-        if (leaf == root)
+        // Validate the dimensionality of the point.
+        if (point.size() != dimension)
         {
-            root = NULL_NODE;
-            return;
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
         }
 
-        unsigned int parent = nodes[leaf].parent;
-        unsigned int grandParent = nodes[parent].parent;
-        unsigned int sibling;
+        std::vector<std::pair<double, unsigned int> > neighbours;
+        findNearest(point, k, std::numeric_limits<unsigned int>::max(), [&](unsigned int leaf)
+        {
+            return computeDistanceSqd(leaf, point);
+        }, neighbours);
 
-        if (nodes[parent].left == leaf) sibling = nodes[parent].right;
-        else                            sibling = nodes[parent].left;
+        std::vector<unsigned int> particles(neighbours.size());
+        for (unsigned int i=0;i<neighbours.size();i++)
+            particles[i] = neighbours[i].second;
 
-        // Destroy the parent and connect the sibling to the grandparent.
-        if (grandParent != NULL_NODE)
+        return particles;
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::nearestBatch(const std::vector<unsigned int>& particles, unsigned int k,
+        std::vector<unsigned int>& offsets, std::vector<unsigned int>& indices, unsigned int nThreads) const
+    {
+        // Map the particles to their leaf nodes, validating them before any
+        // work is handed to the worker threads.
+        std::vector<unsigned int> leaves(particles.size());
+        for (unsigned int i=0;i<particles.size();i++)
         {
-            if (nodes[grandParent].left == parent) nodes[grandParent].left = sibling;
-            else                                   nodes[grandParent].right = sibling;
+            leaves[i] = particleMap.find(particles[i]);
 
-            nodes[sibling].parent = grandParent;
-            freeNode(parent);
+            if (leaves[i] == NULL_NODE)
+            {
+                throw std::invalid_argument("[ERROR]: Invalid particle index!");
+            }
+        }
+
+        runBatch(particles.size(), [&](unsigned int i, std::vector<unsigned int>& buffer)
+        {
+            const Vector& point = getCentre(leaves[i]);
+
+            std::vector<std::pair<double, unsigned int> > neighbours;
+            findNearest(point, k, particles[i], [&](unsigned int leaf)
+            {
+                return computeDistanceSqd(leaf, point);
+            }, neighbours);
+
+            for (unsigned int j=0;j<neighbours.size();j++)
+                buffer.push_back(neighbours[j].second);
+        }, offsets, indices, nThreads);
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Query>
+    void BasicTree<D, Layout>::runBatch(unsigned int nQueries, const Query& query, std::vector<unsigned int>& offsets,
+                                        std::vector<unsigned int>& indices, unsigned int nThreads) const
+    {
+        offsets.resize(nQueries + 1);
+        offsets[0] = 0;
+
+        // Queries are handed out to threads in chunks to balance the load.
+        const unsigned int chunkSize = 64;
+        unsigned int nChunks = (nQueries + chunkSize - 1) / chunkSize;
+
+        if (nThreads == 0) nThreads = std::thread::hardware_concurrency();
+        nThreads = std::max(1u, std::min(nThreads, nChunks));
+
+        // Each thread appends its results to its own buffer. Record where the
+        // results of each chunk start so that they can be gathered in order.
+        std::vector<std::vector<unsigned int> > buffers(nThreads);
+        std::vector<unsigned int> chunkThread(nChunks);
+        std::vector<std::size_t> chunkStart(nChunks);
+        std::atomic<unsigned int> nextChunk(0);
+
+        auto worker = [&](unsigned int thread)
+        {
+            std::vector<unsigned int>& buffer = buffers[thread];
+            unsigned int chunk;
+
+            while ((chunk = nextChunk++) < nChunks)
+            {
+                chunkThread[chunk] = thread;
+                chunkStart[chunk] = buffer.size();
+
+                unsigned int end = std::min(nQueries, (chunk + 1)*chunkSize);
+                for (unsigned int i=chunk*chunkSize;i<end;i++)
+                {
+                    std::size_t size = buffer.size();
+                    query(i, buffer);
+                    offsets[i+1] = buffer.size() - size;
+                }
+            }
+        };
+
+        runParallel(nThreads, worker);
+
+        // Convert the counts into offsets.
+        for (unsigned int i=0;i<nQueries;i++)
+            offsets[i+1] += offsets[i];
+
+        // Gather the results.
+        indices.resize(offsets[nQueries]);
+        for (unsigned int i=0;i<nChunks;i++)
+        {
+            unsigned int begin = i*chunkSize;
+            unsigned int end = std::min(nQueries, (i + 1)*chunkSize);
+            const unsigned int* source = buffers[chunkThread[i]].data() + chunkStart[i];
+
+            std::copy(source, source + (offsets[end] - offsets[begin]), indices.begin() + offsets[begin]);
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::anyOverlap(const Vector& position, double radius) const
+    {
+        return anyOverlap(std::numeric_limits<unsigned int>::max(), position, radius);
+    }
+
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::anyOverlap(unsigned int particle, const Vector& position, double radius) const
+    {
+        // Validate the dimensionality of the position vector.
+        if (position.size() != dimension)
+        {
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+        }
+
+        // Compute the AABB of the sphere.
+        AABBType aabb(dimension);
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            aabb.lowerBound[i] = position[i] - radius;
+            aabb.upperBound[i] = position[i] + radius;
+        }
+        aabb.centre = position;
+
+        bool isOverlap = false;
+
+        traverse(aabb, [&](unsigned int leaf)
+        {
+            // Can't interact with itself.
+            if (nodes.particle(leaf) == particle) return true;
+
+            // Stop at the first true overlap.
+            isOverlap = overlapsSphere(leaf, position, radius);
+            return !isOverlap;
+        });
+
+        return isOverlap;
+    }
+
+    template <unsigned int D, class Layout>
+    const typename BasicTree<D, Layout>::AABBType& BasicTree<D, Layout>::getAABB(unsigned int particle) const
+    {
+        unsigned int node = particleMap.find(particle);
+
+        // Make sure that this is a valid particle.
+        if (node == NULL_NODE)
+        {
+            throw std::invalid_argument("[ERROR]: Invalid particle index!");
+        }
+
+        return nodes.aabb(node);
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::insertLeaf(unsigned int leaf)
+    {
+        // Rotations can move the leaf away from the nodes that are refit.
+        syncFloatBounds(leaf);
+
+        if (root == NULL_NODE)
+        {
+            root = leaf;
+            nodes.parent(root) = NULL_NODE;
+            return;
+        }
+
+        // Find the best sibling for the node.
+        unsigned int sibling = findSibling(nodes.aabb(leaf));
+
+        // Attach the leaf alongside it.
+        attachLeaf(leaf, sibling);
+
+        // Walk back up the tree fixing heights and AABBs.
+        unsigned int index = nodes.parent(leaf);
+        while (index != NULL_NODE)
+        {
+            if (balanceMethod == Balance::Height) index = balance(index);
+            else                                  index = rotate(index);
+
+            unsigned int left = nodes.left(index);
+            unsigned int right = nodes.right(index);
+
+            assert(left != NULL_NODE);
+            assert(right != NULL_NODE);
+
+            nodes.height(index) = 1 + std::max(nodes.height(left), nodes.height(right));
+            nodes.aabb(index).merge(nodes.aabb(left), nodes.aabb(right));
+            syncFloatBounds(index);
+
+            index = nodes.parent(index);
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::findSibling(const AABBType& leafAABB) const
+    {
+        unsigned int index = root;
+
+        while (!nodes.isLeaf(index))
+        {
+            // Extract the children of the node.
+            unsigned int left  = nodes.left(index);
+            unsigned int right = nodes.right(index);
+
+            double surfaceArea = nodes.aabb(index).getSurfaceArea();
+
+            AABBType combinedAABB;
+            combinedAABB.merge(nodes.aabb(index), leafAABB);
+            double combinedSurfaceArea = combinedAABB.getSurfaceArea();
+
+            // Cost of creating a new parent for this node and the new leaf.
+            double cost = 2.0 * combinedSurfaceArea;
+
+            // Minimum cost of pushing the leaf further down the tree.
+            double inheritanceCost = 2.0 * (combinedSurfaceArea - surfaceArea);
+
+            // Cost of descending to the left.
+            double costLeft;
+            if (nodes.isLeaf(left))
+            {
+                AABBType aabb;
+                aabb.merge(leafAABB, nodes.aabb(left));
+                costLeft = aabb.getSurfaceArea() + inheritanceCost;
+            }
+            else
+            {
+                AABBType aabb;
+                aabb.merge(leafAABB, nodes.aabb(left));
+                double oldArea = nodes.aabb(left).getSurfaceArea();
+                double newArea = aabb.getSurfaceArea();
+                costLeft = (newArea - oldArea) + inheritanceCost;
+            }
+
+            // Cost of descending to the right.
+            double costRight;
+            if (nodes.isLeaf(right))
+            {
+                AABBType aabb;
+                aabb.merge(leafAABB, nodes.aabb(right));
+                costRight = aabb.getSurfaceArea() + inheritanceCost;
+            }
+            else
+            {
+                AABBType aabb;
+                aabb.merge(leafAABB, nodes.aabb(right));
+                double oldArea = nodes.aabb(right).getSurfaceArea();
+                double newArea = aabb.getSurfaceArea();
+                costRight = (newArea - oldArea) + inheritanceCost;
+            }
+
+            // Descend according to the minimum cost.
+            if ((cost < costLeft) && (cost < costRight)) break;
+
+            // Descend.
+            if (costLeft < costRight) index = left;
+            else                      index = right;
+        }
+
+        return index;
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::attachLeaf(unsigned int leaf, unsigned int sibling)
+    {
+        // Create a new parent.
+        unsigned int oldParent = nodes.parent(sibling);
+        unsigned int newParent = allocateNode();
+        nodes.parent(newParent) = oldParent;
+        nodes.aabb(newParent).merge(nodes.aabb(leaf), nodes.aabb(sibling));
+        nodes.height(newParent) = nodes.height(sibling) + 1;
+
+        // The sibling was not the root.
+        if (oldParent != NULL_NODE)
+        {
+            if (nodes.left(oldParent) == sibling) nodes.left(oldParent) = newParent;
+            else                                  nodes.right(oldParent) = newParent;
+
+            nodes.left(newParent) = sibling;
+            nodes.right(newParent) = leaf;
+            nodes.parent(sibling) = newParent;
+            nodes.parent(leaf) = newParent;
+        }
+        // The sibling was the root.
+        else
+        {
+            nodes.left(newParent) = sibling;
+            nodes.right(newParent) = leaf;
+            nodes.parent(sibling) = newParent;
+            nodes.parent(leaf) = newParent;
+            root = newParent;
+        }
+
+        return newParent;
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::detachLeaf(unsigned int leaf)
+    {
+        if (leaf == root)
+        {
+            root = NULL_NODE;
+            return NULL_NODE;
+        }
+
+        unsigned int parent = nodes.parent(leaf);
+        unsigned int grandParent = nodes.parent(parent);
+        unsigned int sibling;
+
+        if (nodes.left(parent) == leaf) sibling = nodes.right(parent);
+        else                            sibling = nodes.left(parent);
+
+        // Destroy the parent and connect the sibling to the grandparent.
+        if (grandParent != NULL_NODE)
+        {
+            if (nodes.left(grandParent) == parent) nodes.left(grandParent) = sibling;
+            else                                   nodes.right(grandParent) = sibling;
+        }
+        else root = sibling;
+
+        nodes.parent(sibling) = grandParent;
+        freeNode(parent);
+
+        return grandParent;
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::removeLeaf(unsigned int leaf)
+    {
+        if (leaf == root)
+        {
+            root = NULL_NODE;
+            return;
+        }
+
+        unsigned int parent = nodes.parent(leaf);
+        unsigned int grandParent = nodes.parent(parent);
+        unsigned int sibling;
+
+        if (nodes.left(parent) == leaf) sibling = nodes.right(parent);
+        else                            sibling = nodes.left(parent);
+
+        // Destroy the parent and connect the sibling to the grandparent.
+        if (grandParent != NULL_NODE)
+        {
+            if (nodes.left(grandParent) == parent) nodes.left(grandParent) = sibling;
+            else                                   nodes.right(grandParent) = sibling;
+
+            nodes.parent(sibling) = grandParent;
+            freeNode(parent);
 
             // Adjust ancestor bounds.
             unsigned int index = grandParent;
             while (index != NULL_NODE)
             {
-                index = balance(index);
+                if (balanceMethod == Balance::Height) index = balance(index);
+                else                                  index = rotate(index);
+
+                unsigned int left = nodes.left(index);
+                unsigned int right = nodes.right(index);
+
+                nodes.aabb(index).merge(nodes.aabb(left), nodes.aabb(right));
+                nodes.height(index) = 1 + std::max(nodes.height(left), nodes.height(right));
+                syncFloatBounds(index);
+
+                index = nodes.parent(index);
+            }
+        }
+        else
+        {
+            root = sibling;
+            nodes.parent(sibling) = NULL_NODE;
+            freeNode(parent);
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::reinsertLeaves(const std::vector<unsigned int>& leaves)
+    {
+        // Flag nodes whose bounds need to be refit. All ancestors of a flagged
+        // node are also flagged, so marking can stop at the first flagged node.
+        std::vector<char> isDirty(nodeCapacity, false);
+        auto markDirty = [&](unsigned int node)
+        {
+            if (isDirty.size() < nodeCapacity) isDirty.resize(nodeCapacity, false);
+
+            while ((node != NULL_NODE) && !isDirty[node])
+            {
+                isDirty[node] = true;
+                node = nodes.parent(node);
+            }
+        };
+
+        // Remove the leaves.
+        for (unsigned int i=0;i<leaves.size();i++)
+        {
+            unsigned int parent = nodes.parent(leaves[i]);
+            markDirty(detachLeaf(leaves[i]));
+
+            // The parent has been freed, so may be reused.
+            if (parent != NULL_NODE) isDirty[parent] = false;
+        }
+
+        // Reinsert them.
+        for (unsigned int i=0;i<leaves.size();i++)
+        {
+            if (root == NULL_NODE)
+            {
+                root = leaves[i];
+                nodes.parent(root) = NULL_NODE;
+            }
+            else markDirty(attachLeaf(leaves[i], findSibling(nodes.aabb(leaves[i]))));
+        }
+
+        // Refit (and rebalance) the flagged nodes once, children first.
+        if ((root == NULL_NODE) || !isDirty[root])
+        {
+            syncFloatBounds();
+            return;
+        }
+
+        std::vector<std::pair<unsigned int, bool> > stack;
+        stack.push_back(std::make_pair(root, false));
+
+        while (!stack.empty())
+        {
+            unsigned int node = stack.back().first;
+            bool isVisited = stack.back().second;
+            stack.pop_back();
+
+            unsigned int left = nodes.left(node);
+            unsigned int right = nodes.right(node);
+
+            if (isVisited)
+            {
+                // Restructure the subtree, as when walking up from an insertion.
+                if (balanceMethod == Balance::Height) node = balance(node);
+                else                                  node = rotate(node);
+
+                left = nodes.left(node);
+                right = nodes.right(node);
+
+                nodes.aabb(node).merge(nodes.aabb(left), nodes.aabb(right));
+                nodes.height(node) = 1 + std::max(nodes.height(left), nodes.height(right));
+            }
+            else
+            {
+                stack.push_back(std::make_pair(node, true));
+                if (isDirty[left]) stack.push_back(std::make_pair(left, false));
+                if (isDirty[right]) stack.push_back(std::make_pair(right, false));
+            }
+        }
+
+        syncFloatBounds();
+    }
+
+    template <unsigned int D, class Layout>
+    double BasicTree<D, Layout>::refitAll()
+    {
+        if (root == NULL_NODE) return 0.0;
+
+        // A lone leaf has nothing to refit.
+        if (nodes.isLeaf(root)) return 1.0;
+
+        // Order the internal nodes breadth first, so that every parent
+        // precedes its children.
+        std::vector<unsigned int> order;
+        order.reserve(nodeCount/2 + 1);
+        order.push_back(root);
+
+        double totalArea = 0.0;
+
+        for (unsigned int i=0;i<order.size();i++)
+        {
+            unsigned int left = nodes.left(order[i]);
+            unsigned int right = nodes.right(order[i]);
+
+            if (nodes.isLeaf(left)) totalArea += nodes.aabb(left).surfaceArea;
+            else                    order.push_back(left);
+
+            if (nodes.isLeaf(right)) totalArea += nodes.aabb(right).surfaceArea;
+            else                     order.push_back(right);
+        }
+
+        // Merge in reverse order, so children are refit before their parents.
+        for (unsigned int i=order.size();i-->0;)
+        {
+            unsigned int node = order[i];
+
+            nodes.aabb(node).merge(nodes.aabb(nodes.left(node)), nodes.aabb(nodes.right(node)));
+            totalArea += nodes.aabb(node).surfaceArea;
+        }
+
+        // The leaves have moved too.
+        syncFloatBounds();
+
+        return totalArea / nodes.aabb(root).surfaceArea;
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::storeFloatBounds(unsigned int node)
+    {
+        const AABBType& aabb = nodes.aabb(node);
+        float* lowerBound = &floatBounds[std::size_t(2*dimension)*node];
+        float* upperBound = lowerBound + dimension;
+
+        // Round to nearest, then step outward if that moved the bound inward.
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            lowerBound[i] = float(aabb.lowerBound[i]);
+            upperBound[i] = float(aabb.upperBound[i]);
+
+            if (lowerBound[i] > aabb.lowerBound[i])
+                lowerBound[i] = std::nextafter(lowerBound[i], -std::numeric_limits<float>::infinity());
+            if (upperBound[i] < aabb.upperBound[i])
+                upperBound[i] = std::nextafter(upperBound[i], std::numeric_limits<float>::infinity());
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::syncFloatBounds(unsigned int node)
+    {
+        if (precision == Precision::Double) return;
+
+        storeFloatBounds(node);
+
+        if (!nodes.isLeaf(node))
+        {
+            storeFloatBounds(nodes.left(node));
+            storeFloatBounds(nodes.right(node));
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::syncFloatBounds()
+    {
+        if (precision == Precision::Double) return;
+
+        for (unsigned int i=0;i<nodeCapacity;i++)
+        {
+            if (nodes.height(i) >= 0) storeFloatBounds(i);
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::balance(unsigned int node)
+    {
+        assert(node != NULL_NODE);
+
+        if (nodes.isLeaf(node) || (nodes.height(node) < 2))
+            return node;
+
+        unsigned int left = nodes.left(node);
+        unsigned int right = nodes.right(node);
+
+        assert(left < nodeCapacity);
+        assert(right < nodeCapacity);
+
+        int currentBalance = nodes.height(right) - nodes.height(left);
+
+        // Rotate right branch up.
+        if (currentBalance > 1)
+        {
+            unsigned int rightLeft = nodes.left(right);
+            unsigned int rightRight = nodes.right(right);
+
+            assert(rightLeft < nodeCapacity);
+            assert(rightRight < nodeCapacity);
+
+            // Swap node and its right-hand child.
+            nodes.left(right) = node;
+            nodes.parent(right) = nodes.parent(node);
+            nodes.parent(node) = right;
+
+            // The node's old parent should now point to its right-hand child.
+            if (nodes.parent(right) != NULL_NODE)
+            {
+                if (nodes.left(nodes.parent(right)) == node) nodes.left(nodes.parent(right)) = right;
+                else
+                {
+                    assert(nodes.right(nodes.parent(right)) == node);
+                    nodes.right(nodes.parent(right)) = right;
+                }
+            }
+            else root = right;
+
+            // Rotate.
+            if (nodes.height(rightLeft) > nodes.height(rightRight))
+            {
+                nodes.right(right) = rightLeft;
+                nodes.right(node) = rightRight;
+                nodes.parent(rightRight) = node;
+                nodes.aabb(node).merge(nodes.aabb(left), nodes.aabb(rightRight));
+                nodes.aabb(right).merge(nodes.aabb(node), nodes.aabb(rightLeft));
+
+                nodes.height(node) = 1 + std::max(nodes.height(left), nodes.height(rightRight));
+                nodes.height(right) = 1 + std::max(nodes.height(node), nodes.height(rightLeft));
+            }
+            else
+            {
+                nodes.right(right) = rightRight;
+                nodes.right(node) = rightLeft;
+                nodes.parent(rightLeft) = node;
+                nodes.aabb(node).merge(nodes.aabb(left), nodes.aabb(rightLeft));
+                nodes.aabb(right).merge(nodes.aabb(node), nodes.aabb(rightRight));
+
+                nodes.height(node) = 1 + std::max(nodes.height(left), nodes.height(rightLeft));
+                nodes.height(right) = 1 + std::max(nodes.height(node), nodes.height(rightRight));
+            }
+
+            return right;
+        }
+
+        // Rotate left branch up.
+        if (currentBalance < -1)
+        {
+            unsigned int leftLeft = nodes.left(left);
+            unsigned int leftRight = nodes.right(left);
+
+            assert(leftLeft < nodeCapacity);
+            assert(leftRight < nodeCapacity);
+
+            // Swap node and its left-hand child.
+            nodes.left(left) = node;
+            nodes.parent(left) = nodes.parent(node);
+            nodes.parent(node) = left;
+
+            // The node's old parent should now point to its left-hand child.
+            if (nodes.parent(left) != NULL_NODE)
+            {
+                if (nodes.left(nodes.parent(left)) == node) nodes.left(nodes.parent(left)) = left;
+                else
+                {
+                    assert(nodes.right(nodes.parent(left)) == node);
+                    nodes.right(nodes.parent(left)) = left;
+                }
+            }
+            else root = left;
+
+            // Rotate.
+            if (nodes.height(leftLeft) > nodes.height(leftRight))
+            {
+                nodes.right(left) = leftLeft;
+                nodes.left(node) = leftRight;
+                nodes.parent(leftRight) = node;
+                nodes.aabb(node).merge(nodes.aabb(right), nodes.aabb(leftRight));
+                nodes.aabb(left).merge(nodes.aabb(node), nodes.aabb(leftLeft));
+
+                nodes.height(node) = 1 + std::max(nodes.height(right), nodes.height(leftRight));
+                nodes.height(left) = 1 + std::max(nodes.height(node), nodes.height(leftLeft));
+            }
+            else
+            {
+                nodes.right(left) = leftRight;
+                nodes.left(node) = leftLeft;
+                nodes.parent(leftLeft) = node;
+                nodes.aabb(node).merge(nodes.aabb(right), nodes.aabb(leftLeft));
+                nodes.aabb(left).merge(nodes.aabb(node), nodes.aabb(leftRight));
+
+                nodes.height(node) = 1 + std::max(nodes.height(right), nodes.height(leftLeft));
+                nodes.height(left) = 1 + std::max(nodes.height(node), nodes.height(leftRight));
+            }
+
+            return left;
+        }
+
+        return node;
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::rotate(unsigned int node)
+    {
+        assert(node != NULL_NODE);
+
+        if (nodes.isLeaf(node)) return node;
+
+        unsigned int left = nodes.left(node);
+        unsigned int right = nodes.right(node);
+
+        // Find the rotation that most reduces the surface area. A rotation
+        // swaps a child of the node with one of its nephews, i.e. a child
+        // of its sibling, so only the bounds of the sibling change.
+        double maxReduction = 0;
+        unsigned int child = NULL_NODE;
+        unsigned int nephew = NULL_NODE;
+        AABBType aabb;
+
+        for (unsigned int i=0;i<2;i++)
+        {
+            unsigned int swapped = (i == 0) ? left : right;
+            unsigned int sibling = (i == 0) ? right : left;
+
+            if (nodes.isLeaf(sibling)) continue;
+
+            for (unsigned int j=0;j<2;j++)
+            {
+                unsigned int moved = (j == 0) ? nodes.left(sibling) : nodes.right(sibling);
+                unsigned int kept = (j == 0) ? nodes.right(sibling) : nodes.left(sibling);
+
+                // The sibling would enclose the swapped child and the nephew it keeps.
+                aabb.merge(nodes.aabb(swapped), nodes.aabb(kept));
+                double reduction = nodes.aabb(sibling).getSurfaceArea() - aabb.getSurfaceArea();
+
+                if (reduction > maxReduction)
+                {
+                    maxReduction = reduction;
+                    child = swapped;
+                    nephew = moved;
+                }
+            }
+        }
+
+        // No rotation reduces the surface area.
+        if (child == NULL_NODE) return node;
+
+        unsigned int sibling = nodes.parent(nephew);
+
+        // Swap the child and the nephew.
+        if (nodes.left(node) == child) nodes.left(node) = nephew;
+        else                           nodes.right(node) = nephew;
+
+        if (nodes.left(sibling) == nephew) nodes.left(sibling) = child;
+        else                               nodes.right(sibling) = child;
+
+        nodes.parent(nephew) = node;
+        nodes.parent(child) = sibling;
+
+        // Refit the sibling. The node itself is refit by the caller.
+        unsigned int siblingLeft = nodes.left(sibling);
+        unsigned int siblingRight = nodes.right(sibling);
+        nodes.aabb(sibling).merge(nodes.aabb(siblingLeft), nodes.aabb(siblingRight));
+        nodes.height(sibling) = 1 + std::max(nodes.height(siblingLeft), nodes.height(siblingRight));
+
+        return node;
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::computeHeight() const
+    {
+        return computeHeight(root);
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::computeHeight(unsigned int node) const
+    {
+        assert(node < nodeCapacity);
+
+        if (nodes.isLeaf(node)) return 0;
+
+        unsigned int height1 = computeHeight(nodes.left(node));
+        unsigned int height2 = computeHeight(nodes.right(node));
+
+        return 1 + std::max(height1, height2);
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::getHeight() const
+    {
+        if (root == NULL_NODE) return 0;
+        return nodes.height(root);
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::getNodeCount() const
+    {
+        return nodeCount;
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::computeMaximumBalance() const
+    {
+        unsigned int maxBalance = 0;
+        for (unsigned int i=0; i<nodeCapacity; i++)
+        {
+            if (nodes.height(i) <= 1)
+                continue;
+
+            assert(nodes.isLeaf(i) == false);
+
+            unsigned int balance = std::abs(nodes.height(nodes.left(i)) - nodes.height(nodes.right(i)));
+            maxBalance = std::max(maxBalance, balance);
+        }
+
+        return maxBalance;
+    }
+
+    template <unsigned int D, class Layout>
+    double BasicTree<D, Layout>::computeSurfaceAreaRatio() const
+    {
+        if (root == NULL_NODE) return 0.0;
+
+        double rootArea = nodes.aabb(root).computeSurfaceArea();
+        double totalArea = 0.0;
+
+        for (unsigned int i=0; i<nodeCapacity;i++)
+        {
+            if (nodes.height(i) < 0) continue;
+
+            totalArea += nodes.aabb(i).computeSurfaceArea();
+        }
+
+        return totalArea / rootArea;
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::validate() const
+    {
+#ifndef NDEBUG
+        validateStructure(root);
+        validateMetrics(root);
+
+        unsigned int freeCount = 0;
+        unsigned int freeIndex = freeList;
+
+        while (freeIndex != NULL_NODE)
+        {
+            assert(freeIndex < nodeCapacity);
+            freeIndex = nodes.next(freeIndex);
+            freeCount++;
+        }
+
+        assert(getHeight() == computeHeight());
+        assert((nodeCount + freeCount) == nodeCapacity);
+#endif
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::rebuild(unsigned int nThreads)
+    {
+        std::vector<unsigned int> leaves;
+        collectLeaves(leaves);
+
+        buildTree(leaves, nThreads);
+
+        validate();
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::rebuildLinear(unsigned int nThreads)
+    {
+        std::vector<unsigned int> leaves;
+        collectLeaves(leaves);
+
+        root = NULL_NODE;
+        refitReference = 0;
+
+        if (leaves.empty()) return;
+
+        if (nThreads == 0) nThreads = std::thread::hardware_concurrency();
+        nThreads = std::max(1u, nThreads);
+
+        // Work out the quantisation grid. Periodic axes span the box, others
+        // the extent of the leaf centres.
+        Vector lowerBound = nodes.aabb(leaves[0]).centre;
+        Vector upperBound = nodes.aabb(leaves[0]).centre;
+
+        for (unsigned int i=1;i<leaves.size();i++)
+        {
+            const Vector& centre = nodes.aabb(leaves[i]).centre;
+
+            for (unsigned int j=0;j<dimension;j++)
+            {
+                lowerBound[j] = std::min(lowerBound[j], centre[j]);
+                upperBound[j] = std::max(upperBound[j], centre[j]);
+            }
+        }
+
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            if (periodicity[i])
+            {
+                lowerBound[i] = 0;
+                upperBound[i] = boxSize[i];
+            }
+        }
+
+        // Interleave as many bits per axis as fit in a 63-bit code.
+        unsigned int nBits = std::max(1u, 63 / dimension);
+        double maxCell = double((uint64_t(1) << nBits) - 1);
+
+        Vector scale = VectorTraits<D>::create(dimension);
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            double extent = upperBound[i] - lowerBound[i];
+            scale[i] = (extent > 0) ? (maxCell / extent) : 0;
+        }
+
+        // Compute the Morton codes.
+        std::vector<MortonLeaf> mortonLeaves(leaves.size());
+        unsigned int chunkSize = (leaves.size() + nThreads - 1) / nThreads;
+
+        runParallel(nThreads, [&](unsigned int thread)
+        {
+            std::vector<uint64_t> cell(dimension);
+            unsigned int end = std::min(unsigned(leaves.size()), (thread + 1)*chunkSize);
+
+            for (unsigned int i=thread*chunkSize;i<end;i++)
+            {
+                const Vector& centre = nodes.aabb(leaves[i]).centre;
+
+                // Quantise the centre, clamping to the grid.
+                for (unsigned int j=0;j<dimension;j++)
+                {
+                    double x = scale[j]*(centre[j] - lowerBound[j]);
+                    cell[j] = uint64_t(std::max(0.0, std::min(maxCell, x)));
+                }
+
+                // Interleave the bits, most significant first.
+                uint64_t code = 0;
+                for (unsigned int j=nBits;j-->0;)
+                {
+                    for (unsigned int k=0;k<dimension;k++)
+                        code = (code << 1) | ((cell[k] >> j) & 1);
+                }
+
+                mortonLeaves[i].code = code;
+                mortonLeaves[i].node = leaves[i];
+            }
+        });
+
+        sortMorton(mortonLeaves, nThreads);
+
+        // Reserve the internal nodes, then emit the hierarchy.
+        std::vector<unsigned int> slots(leaves.size() - 1);
+        for (unsigned int i=0;i<slots.size();i++)
+            slots[i] = allocateNode();
+
+        root = buildMorton(mortonLeaves.data(), mortonLeaves.size(), slots.data(), NULL_NODE, nThreads);
+        syncFloatBounds();
+
+        validate();
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::collectLeaves(std::vector<unsigned int>& leaves)
+    {
+        leaves.clear();
+        leaves.reserve(particleMap.size());
+
+        for (unsigned int i=0;i<nodeCapacity;i++)
+        {
+            // Free node.
+            if (nodes.height(i) < 0) continue;
+
+            if (nodes.isLeaf(i)) leaves.push_back(i);
+            else freeNode(i);
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::sortMorton(std::vector<MortonLeaf>& leaves, unsigned int nThreads) const
+    {
+        const unsigned int nBuckets = 256;
+
+        unsigned int nLeaves = leaves.size();
+        nThreads = std::max(1u, std::min(nThreads, nLeaves / 65536));
+        unsigned int chunkSize = (nLeaves + nThreads - 1) / nThreads;
+
+        std::vector<MortonLeaf> buffer(nLeaves);
+        std::vector<unsigned int> offsets(nThreads*nBuckets);
+
+        // Sort eight bits at a time, least significant first.
+        for (unsigned int shift=0;shift<64;shift+=8)
+        {
+            // Count the keys in each bucket, per thread.
+            std::fill(offsets.begin(), offsets.end(), 0);
+            runParallel(nThreads, [&](unsigned int thread)
+            {
+                unsigned int* count = &offsets[thread*nBuckets];
+                unsigned int end = std::min(nLeaves, (thread + 1)*chunkSize);
+
+                for (unsigned int i=thread*chunkSize;i<end;i++)
+                    count[(leaves[i].code >> shift) & (nBuckets - 1)]++;
+            });
+
+            // Skip the pass if all keys share this digit.
+            bool isSorted = false;
+            for (unsigned int i=0;i<nBuckets;i++)
+            {
+                unsigned int total = 0;
+                for (unsigned int j=0;j<nThreads;j++)
+                    total += offsets[j*nBuckets + i];
+
+                if (total == nLeaves) isSorted = true;
+                if (total != 0) break;
+            }
+            if (isSorted) continue;
+
+            // Convert the counts into output offsets. Buckets are ordered by
+            // digit, then by thread, so that the sort is stable.
+            unsigned int offset = 0;
+            for (unsigned int i=0;i<nBuckets;i++)
+            {
+                for (unsigned int j=0;j<nThreads;j++)
+                {
+                    unsigned int count = offsets[j*nBuckets + i];
+                    offsets[j*nBuckets + i] = offset;
+                    offset += count;
+                }
+            }
+
+            // Scatter the keys.
+            runParallel(nThreads, [&](unsigned int thread)
+            {
+                unsigned int* threadOffsets = &offsets[thread*nBuckets];
+                unsigned int end = std::min(nLeaves, (thread + 1)*chunkSize);
+
+                for (unsigned int i=thread*chunkSize;i<end;i++)
+                    buffer[threadOffsets[(leaves[i].code >> shift) & (nBuckets - 1)]++] = leaves[i];
+            });
+
+            leaves.swap(buffer);
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::buildMorton(const MortonLeaf* leaves, unsigned int nLeaves,
+        const unsigned int* slots, unsigned int parent, unsigned int nThreads)
+    {
+        if (nLeaves == 1)
+        {
+            nodes.parent(leaves[0].node) = parent;
+            return leaves[0].node;
+        }
+
+        unsigned int node = slots[0];
+        nodes.parent(node) = parent;
+
+        // Split the range where the highest bit that differs between the
+        // first and last codes changes. Duplicate codes are split in half.
+        unsigned int nLeft = nLeaves/2;
+        uint64_t difference = leaves[0].code ^ leaves[nLeaves-1].code;
+
+        if (difference != 0)
+        {
+            uint64_t bit = 1;
+            while (difference >>= 1) bit <<= 1;
+
+            nLeft = std::partition_point(leaves, leaves + nLeaves, [bit](const MortonLeaf& leaf)
+            {
+                return (leaf.code & bit) == 0;
+            }) - leaves;
+        }
+
+        // The left subtree uses the next nLeft - 1 slots, the right the remainder.
+        const MortonLeaf* rightLeaves = leaves + nLeft;
+        const unsigned int* leftSlots = slots + 1;
+        const unsigned int* rightSlots = slots + nLeft;
+
+        if ((nThreads > 1) && (nLeaves >= PARALLEL_BUILD_SIZE))
+        {
+            std::thread thread([&]()
+            {
+                nodes.left(node) = buildMorton(leaves, nLeft, leftSlots, node, nThreads/2);
+            });
+            nodes.right(node) = buildMorton(rightLeaves, nLeaves - nLeft, rightSlots, node, nThreads - nThreads/2);
+            thread.join();
+        }
+        else
+        {
+            nodes.left(node) = buildMorton(leaves, nLeft, leftSlots, node, 1);
+            nodes.right(node) = buildMorton(rightLeaves, nLeaves - nLeft, rightSlots, node, 1);
+        }
+
+        // Refit on the way back up.
+        unsigned int left = nodes.left(node);
+        unsigned int right = nodes.right(node);
+        nodes.aabb(node).merge(nodes.aabb(left), nodes.aabb(right));
+        nodes.height(node) = 1 + std::max(nodes.height(left), nodes.height(right));
+
+        return node;
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::bulkLoad(const std::vector<Vector>& lowerBounds,
+                                        const std::vector<Vector>& upperBounds)
+    {
+        // Validate the number of bounds.
+        if (lowerBounds.size() != upperBounds.size())
+        {
+            throw std::invalid_argument("[ERROR]: Mismatch in the number of lower and upper bounds!");
+        }
+
+        std::vector<unsigned int> leaves(lowerBounds.size());
+
+        for (unsigned int particle=0;particle<lowerBounds.size();particle++)
+        {
+            const Vector& lowerBound = lowerBounds[particle];
+            const Vector& upperBound = upperBounds[particle];
+
+            // Validate the dimensionality of the bounds vectors.
+            if ((lowerBound.size() != dimension) || (upperBound.size() != dimension))
+            {
+                throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+            }
+
+            // Allocate a new node for the particle.
+            unsigned int node = allocateNode();
+            AABBType& aabb = nodes.aabb(node);
+
+            // Compute the AABB limits.
+            for (unsigned int i=0;i<dimension;i++)
+            {
+                // Validate the bound.
+                if (lowerBound[i] > upperBound[i])
+                {
+                    throw std::invalid_argument("[ERROR]: AABB lower bound is greater than the upper bound!");
+                }
+
+                aabb.lowerBound[i] = lowerBound[i];
+                aabb.upperBound[i] = upperBound[i];
+            }
+
+            // Fatten the AABB.
+            fatten(aabb, nodes.skin(node), nullptr);
+
+            // Add the new particle to the map.
+            particleMap.insert(particle, node);
+
+            // Store the particle index.
+            nodes.particle(node) = particle;
+
+            // The particle isn't described by a sphere.
+            nodes.radius(node) = -1;
+
+            leaves[particle] = node;
+        }
+
+        buildTree(leaves, 0);
+
+        validate();
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::buildTree(const std::vector<unsigned int>& leaves, unsigned int nThreads)
+    {
+        root = NULL_NODE;
+        refitReference = 0;
+
+        if (leaves.empty()) return;
+
+        // Copy the leaf AABBs into a contiguous array, which is partitioned
+        // in place as the tree is built. This avoids scattered reads from
+        // the node pool when binning.
+        std::vector<BuildLeaf> buildLeaves(leaves.size());
+        for (unsigned int i=0;i<leaves.size();i++)
+        {
+            buildLeaves[i].aabb = nodes.aabb(leaves[i]);
+            buildLeaves[i].node = leaves[i];
+        }
+
+        // Reserve all of the internal nodes up front, since the node pool
+        // can't be grown while subtrees are being built concurrently.
+        std::vector<unsigned int> slots(leaves.size() - 1);
+        for (unsigned int i=0;i<slots.size();i++)
+            slots[i] = allocateNode();
+
+        if (nThreads == 0) nThreads = std::thread::hardware_concurrency();
+        nThreads = std::max(1u, nThreads);
+
+        std::vector<AABBType> bins(SAH_BINS + 3);
+        for (unsigned int i=0;i<bins.size();i++) bins[i].setDimension(dimension);
+        root = buildRange(buildLeaves.data(), buildLeaves.size(), slots.data(), NULL_NODE, nThreads, bins);
+
+        // Parents are always stored in earlier slots than their children, so
+        // a reverse sweep visits children first when computing the heights.
+        for (unsigned int i=slots.size();i-->0;)
+        {
+            unsigned int node = slots[i];
+            nodes.height(node) = 1 + std::max(nodes.height(nodes.left(node)), nodes.height(nodes.right(node)));
+        }
+
+        syncFloatBounds();
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::buildRange(BuildLeaf* leaves, unsigned int nLeaves,
+        const unsigned int* slots, unsigned int parent, unsigned int nThreads, std::vector<AABBType>& bins)
+    {
+        if (nLeaves == 1)
+        {
+            nodes.parent(leaves[0].node) = parent;
+            return leaves[0].node;
+        }
+
+        unsigned int node = slots[0];
+        nodes.parent(node) = parent;
+
+        unsigned int nLeft = splitRange(leaves, nLeaves, node, bins);
+
+        // The left subtree uses the next nLeft - 1 slots, the right the remainder.
+        BuildLeaf* leftLeaves = leaves;
+        BuildLeaf* rightLeaves = leaves + nLeft;
+        const unsigned int* leftSlots = slots + 1;
+        const unsigned int* rightSlots = slots + nLeft;
+
+        if ((nThreads > 1) && (nLeaves >= PARALLEL_BUILD_SIZE))
+        {
+            std::thread thread([&]()
+            {
+                std::vector<AABBType> threadBins(SAH_BINS + 3);
+                for (unsigned int i=0;i<threadBins.size();i++) threadBins[i].setDimension(dimension);
+                nodes.left(node) = buildRange(leftLeaves, nLeft, leftSlots, node, nThreads/2, threadBins);
+            });
+            nodes.right(node) = buildRange(rightLeaves, nLeaves - nLeft, rightSlots, node, nThreads - nThreads/2, bins);
+            thread.join();
+        }
+        else
+        {
+            nodes.left(node) = buildRange(leftLeaves, nLeft, leftSlots, node, 1, bins);
+            nodes.right(node) = buildRange(rightLeaves, nLeaves - nLeft, rightSlots, node, 1, bins);
+        }
+
+        return node;
+    }
+
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::splitRange(BuildLeaf* leaves, unsigned int nLeaves,
+        unsigned int node, std::vector<AABBType>& bins)
+    {
+        // Compute the bounds of the leaves, and of their centres. The bins
+        // beyond SAH_BINS are scratch storage for the centre bounds and the
+        // accumulated bounds used by the cost sweeps.
+        AABBType& aabb = nodes.aabb(node);
+        AABBType& centres = bins[SAH_BINS];
+
+        // Use the compile-time dimensionality, when known, so that the
+        // loops over dimensions can be unrolled.
+        const unsigned int dim = (D == 0) ? dimension : D;
+
+        aabb.lowerBound = leaves[0].aabb.lowerBound;
+        aabb.upperBound = leaves[0].aabb.upperBound;
+        centres.lowerBound = leaves[0].aabb.centre;
+        centres.upperBound = leaves[0].aabb.centre;
+
+        for (unsigned int i=1;i<nLeaves;i++)
+        {
+            const AABBType& leafAABB = leaves[i].aabb;
+
+            for (unsigned int j=0;j<dim;j++)
+            {
+                aabb.lowerBound[j] = std::min(aabb.lowerBound[j], leafAABB.lowerBound[j]);
+                aabb.upperBound[j] = std::max(aabb.upperBound[j], leafAABB.upperBound[j]);
+                centres.lowerBound[j] = std::min(centres.lowerBound[j], leafAABB.centre[j]);
+                centres.upperBound[j] = std::max(centres.upperBound[j], leafAABB.centre[j]);
+            }
+        }
+        aabb.surfaceArea = aabb.computeSurfaceArea();
+        aabb.centre = aabb.computeCentre();
+
+        // A pair of leaves can only be split one way.
+        if (nLeaves == 2) return 1;
+
+        // Bin along the axis with the largest spread of centres.
+        unsigned int axis = 0;
+        for (unsigned int i=1;i<dim;i++)
+        {
+            if ((centres.upperBound[i] - centres.lowerBound[i]) >
+                (centres.upperBound[axis] - centres.lowerBound[axis])) axis = i;
+        }
+
+        double minCentre = centres.lowerBound[axis];
+        double extent = centres.upperBound[axis] - minCentre;
+
+        // All of the centres coincide, so split the range in half.
+        if (extent <= 0) return nLeaves/2;
+
+        double scale = SAH_BINS / extent;
+
+        // Bin the leaves by the position of their centre.
+        unsigned int counts[SAH_BINS];
+        for (unsigned int i=0;i<SAH_BINS;i++)
+        {
+            counts[i] = 0;
+            for (unsigned int j=0;j<dim;j++)
+            {
+                bins[i].lowerBound[j] = std::numeric_limits<double>::max();
+                bins[i].upperBound[j] = -std::numeric_limits<double>::max();
+            }
+        }
+
+        for (unsigned int i=0;i<nLeaves;i++)
+        {
+            const AABBType& leafAABB = leaves[i].aabb;
+            unsigned int bin = std::min(SAH_BINS - 1, (unsigned int)(scale*(leafAABB.centre[axis] - minCentre)));
+
+            counts[bin]++;
+            for (unsigned int j=0;j<dim;j++)
+            {
+                bins[bin].lowerBound[j] = std::min(bins[bin].lowerBound[j], leafAABB.lowerBound[j]);
+                bins[bin].upperBound[j] = std::max(bins[bin].upperBound[j], leafAABB.upperBound[j]);
+            }
+        }
+
+        // Sweep from the right, accumulating the cost of bins i onwards.
+        // Empty bins have inverted bounds, so they don't affect the merge,
+        // and don't change the cost.
+        double rightCost[SAH_BINS];
+        AABBType& right = bins[SAH_BINS + 1];
+        unsigned int count = 0;
+
+        for (unsigned int i=SAH_BINS-1;i>0;i--)
+        {
+            if (counts[i] == 0)
+            {
+                rightCost[i] = (i < SAH_BINS - 1) ? rightCost[i+1] : 0;
+                continue;
+            }
+
+            if (count == 0) right = bins[i];
+            else
+            {
+                for (unsigned int j=0;j<dim;j++)
+                {
+                    right.lowerBound[j] = std::min(right.lowerBound[j], bins[i].lowerBound[j]);
+                    right.upperBound[j] = std::max(right.upperBound[j], bins[i].upperBound[j]);
+                }
+            }
+            count += counts[i];
+
+            rightCost[i] = count*right.computeSurfaceArea();
+        }
+
+        // Sweep from the left, evaluating the cost of splitting before bin i.
+        // The cost only changes after a non-empty bin.
+        double minCost = std::numeric_limits<double>::max();
+        unsigned int splitBin = 0;
+        AABBType& left = bins[SAH_BINS + 2];
+        count = 0;
+
+        for (unsigned int i=1;i<SAH_BINS;i++)
+        {
+            if (counts[i-1] == 0) continue;
+
+            if (count == 0) left = bins[i-1];
+            else
+            {
+                for (unsigned int j=0;j<dim;j++)
+                {
+                    left.lowerBound[j] = std::min(left.lowerBound[j], bins[i-1].lowerBound[j]);
+                    left.upperBound[j] = std::max(left.upperBound[j], bins[i-1].upperBound[j]);
+                }
+            }
+            count += counts[i-1];
+
+            if (count < nLeaves)
+            {
+                double cost = count*left.computeSurfaceArea() + rightCost[i];
+
+                if (cost < minCost)
+                {
+                    minCost = cost;
+                    splitBin = i;
+                }
+            }
+        }
+
+        // No split separates the leaves, e.g. the centres span a tiny range.
+        if (splitBin == 0) return nLeaves/2;
+
+        BuildLeaf* middle = std::partition(leaves, leaves + nLeaves, [&](const BuildLeaf& leaf)
+        {
+            unsigned int bin = std::min(SAH_BINS - 1, (unsigned int)(scale*(leaf.aabb.centre[axis] - minCentre)));
+            return bin < splitBin;
+        });
+
+        return middle - leaves;
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::validateStructure(unsigned int node) const
+    {
+        if (node == NULL_NODE) return;
+
+        if (node == root) assert(nodes.parent(node) == NULL_NODE);
+
+        unsigned int left = nodes.left(node);
+        unsigned int right = nodes.right(node);
+
+        if (nodes.isLeaf(node))
+        {
+            assert(left == NULL_NODE);
+            assert(right == NULL_NODE);
+            assert(nodes.height(node) == 0);
+            return;
+        }
+
+        assert(left < nodeCapacity);
+        assert(right < nodeCapacity);
+
+        assert(nodes.parent(left) == node);
+        assert(nodes.parent(right) == node);
+
+        validateStructure(left);
+        validateStructure(right);
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::validateMetrics(unsigned int node) const
+    {
+        if (node == NULL_NODE) return;
+
+        // The single-precision bounds must contain the node AABB.
+        if (precision != Precision::Double)
+        {
+            const float* lowerBound = &floatBounds[std::size_t(2*dimension)*node];
+            (void)lowerBound; // Unused variable in Release build
+
+            for (unsigned int i=0;i<dimension;i++)
+            {
+                assert(lowerBound[i] <= nodes.aabb(node).lowerBound[i]);
+                assert(lowerBound[dimension + i] >= nodes.aabb(node).upperBound[i]);
+            }
+        }
+
+        unsigned int left = nodes.left(node);
+        unsigned int right = nodes.right(node);
+
+        if (nodes.isLeaf(node))
+        {
+            assert(left == NULL_NODE);
+            assert(right == NULL_NODE);
+            assert(nodes.height(node) == 0);
+            return;
+        }
+
+        assert(left < nodeCapacity);
+        assert(right < nodeCapacity);
+
+        int height1 = nodes.height(left);
+        int height2 = nodes.height(right);
+        int height = 1 + std::max(height1, height2);
+        (void)height; // Unused variable in Release build
+        assert(nodes.height(node) == height);
+
+        AABBType aabb;
+        aabb.merge(nodes.aabb(left), nodes.aabb(right));
+
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            assert(aabb.lowerBound[i] == nodes.aabb(node).lowerBound[i]);
+            assert(aabb.upperBound[i] == nodes.aabb(node).upperBound[i]);
+        }
+
+        validateMetrics(left);
+        validateMetrics(right);
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::periodicBoundaries(Vector& position) const
+    {
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            if (position[i] < 0)
+            {
+                position[i] += boxSize[i];
+            }
+            else
+            {
+                if (position[i] >= boxSize[i])
+                {
+                    position[i] -= boxSize[i];
+                }
+            }
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    bool BasicTree<D, Layout>::minimumImage(Vector& separation, Vector& shift) const
+    {
+        bool isShifted = false;
+
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            if (separation[i] < negMinImage[i])
+            {
+                separation[i] += periods[i];
+                shift[i] = periods[i];
+                isShifted = true;
+            }
+            else
+            {
+                if (separation[i] >= posMinImage[i])
+                {
+                    separation[i] -= periods[i];
+                    shift[i] = -periods[i];
+                    isShifted = true;
+                }
+            }
+        }
+
+        return isShifted;
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::save(const std::string& fileName) const
+    {
+        // Serialise the tree into a buffer, then write it in one go.
+        std::vector<char> buffer;
+        buffer.reserve(64 + std::size_t(nodeCapacity)*(8*(3*dimension + 2) + 4*9));
+
+        auto write = [&buffer](const void* data, std::size_t size)
+        {
+            const char* bytes = static_cast<const char*>(data);
+            buffer.insert(buffer.end(), bytes, bytes + size);
+        };
+        auto writeUnsigned = [&write](std::uint32_t value) { write(&value, sizeof(value)); };
+        auto writeDouble = [&write](double value) { write(&value, sizeof(value)); };
+
+        // The header: a magic string, the format version, and a marker that
+        // reveals the byte order.
+        write("AABBTREE", 8);
+        writeUnsigned(FILE_VERSION);
+        writeUnsigned(0x01020304);
+
+        // The settings.
+        writeUnsigned(dimension);
+        for (unsigned int i=0;i<dimension;i++) writeUnsigned(periodicity[i]);
+        for (unsigned int i=0;i<dimension;i++) writeDouble(boxSize[i]);
+        writeDouble(skinThickness);
+        writeUnsigned(touchIsOverlap);
+        writeUnsigned(unsigned(balanceMethod));
+        writeUnsigned(unsigned(updateMethod));
+        writeDouble(refitThreshold);
+        writeDouble(refitReference);
+        writeUnsigned(isAdaptiveSkin);
+        writeUnsigned(targetAge);
+        writeUnsigned(isGhosts);
+        for (unsigned int i=0;i<dimension;i++) writeDouble(isGhosts ? ghostWidth[i] : 0);
+        writeUnsigned(unsigned(precision));
+        writeUnsigned(unsigned(particleMap.getIndex()));
+
+        // The pool.
+        writeUnsigned(root);
+        writeUnsigned(nodeCount);
+        writeUnsigned(nodeCapacity);
+        writeUnsigned(freeList);
+
+        // The nodes. Free nodes only need their free-list link, so their
+        // other fields are written as defaults.
+        for (unsigned int i=0;i<nodeCapacity;i++)
+        {
+            bool isFree = (nodes.height(i) < 0);
+            bool isSphere = !isFree && nodes.isLeaf(i) && (nodes.radius(i) >= 0);
+
+            for (unsigned int j=0;j<dimension;j++) writeDouble(isFree ? 0 : nodes.aabb(i).lowerBound[j]);
+            for (unsigned int j=0;j<dimension;j++) writeDouble(isFree ? 0 : nodes.aabb(i).upperBound[j]);
+
+            writeUnsigned(isFree ? NULL_NODE : nodes.parent(i));
+            writeUnsigned(nodes.next(i));
+            writeUnsigned(isFree ? NULL_NODE : nodes.left(i));
+            writeUnsigned(isFree ? NULL_NODE : nodes.right(i));
+            writeUnsigned(nodes.height(i));
+            writeUnsigned(isFree ? NULL_NODE : nodes.particle(i));
+
+            for (unsigned int j=0;j<dimension;j++) writeDouble(isSphere ? nodes.position(i)[j] : 0);
+
+            writeDouble(isSphere ? nodes.radius(i) : -1);
+            writeDouble(isFree ? 0 : nodes.skin(i));
+            writeUnsigned(isFree ? 0 : nodes.age(i));
+            writeUnsigned(isFree ? NULL_NODE : nodes.ghost(i));
+            writeUnsigned(isFree ? NULL_NODE : nodes.owner(i));
+        }
+
+        std::ofstream file(fileName, std::ios::binary);
+        file.write(buffer.data(), buffer.size());
+
+        if (!file)
+        {
+            throw std::invalid_argument("[ERROR]: Unable to write the tree file!");
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    void BasicTree<D, Layout>::load(const std::string& fileName)
+    {
+        // Read the whole file in one go.
+        std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+
+        if (!file)
+        {
+            throw std::invalid_argument("[ERROR]: Unable to open the tree file!");
+        }
+
+        std::vector<char> buffer(std::size_t(file.tellg()));
+        file.seekg(0);
+        file.read(buffer.data(), buffer.size());
+
+        if (!file)
+        {
+            throw std::invalid_argument("[ERROR]: Unable to read the tree file!");
+        }
+
+        std::size_t position = 0;
+
+        auto read = [&buffer, &position](void* data, std::size_t size)
+        {
+            if (buffer.size() - position < size)
+            {
+                throw std::invalid_argument("[ERROR]: The tree file is truncated!");
+            }
+
+            std::copy(buffer.begin() + position, buffer.begin() + position + size, static_cast<char*>(data));
+            position += size;
+        };
+        auto readUnsigned = [&read]() { std::uint32_t value; read(&value, sizeof(value)); return value; };
+        auto readDouble = [&read]() { double value; read(&value, sizeof(value)); return value; };
+
+        // Check the header.
+        char magic[8];
+        read(magic, 8);
+
+        if (!std::equal(magic, magic + 8, "AABBTREE"))
+        {
+            throw std::invalid_argument("[ERROR]: Not a tree file!");
+        }
+
+        if (readUnsigned() != FILE_VERSION)
+        {
+            throw std::invalid_argument("[ERROR]: Unsupported tree file version!");
+        }
+
+        if (readUnsigned() != 0x01020304)
+        {
+            throw std::invalid_argument("[ERROR]: The tree file was written with a different byte order!");
+        }
+
+        // Read the settings.
+        unsigned int dimension_ = readUnsigned();
+
+        if ((dimension_ < 2) || ((D != 0) && (dimension_ != D)))
+        {
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+        }
 
-                unsigned int left = nodes[index].left;
-                unsigned int right = nodes[index].right;
+        std::vector<bool> periodicity_(dimension_);
+        std::vector<double> boxSize_(dimension_);
+        for (unsigned int i=0;i<dimension_;i++) periodicity_[i] = readUnsigned();
+        for (unsigned int i=0;i<dimension_;i++) boxSize_[i] = readDouble();
+
+        double skinThickness_ = readDouble();
+        bool touchIsOverlap_ = readUnsigned();
+        Balance balanceMethod_ = Balance(readUnsigned());
+        Update updateMethod_ = Update(readUnsigned());
+        double refitThreshold_ = readDouble();
+        double refitReference_ = readDouble();
+        bool isAdaptiveSkin_ = readUnsigned();
+        unsigned int targetAge_ = readUnsigned();
+        bool isGhosts_ = readUnsigned();
+        Vector ghostWidth_ = VectorTraits<D>::create(dimension_);
+        for (unsigned int i=0;i<dimension_;i++) ghostWidth_[i] = readDouble();
+        Precision precision_ = Precision(readUnsigned());
+        ParticleIndex particleIndex = ParticleIndex(readUnsigned());
+
+        if ((unsigned(balanceMethod_) > unsigned(Balance::SurfaceArea))
+         || (unsigned(updateMethod_) > unsigned(Update::Refit))
+         || (unsigned(precision_) > unsigned(Precision::Single))
+         || (unsigned(particleIndex) > unsigned(ParticleIndex::Sparse)))
+        {
+            throw std::invalid_argument("[ERROR]: The tree file is corrupt!");
+        }
 
-                nodes[index].aabb.merge(nodes[left].aabb, nodes[right].aabb);
-                nodes[index].height = 1 + std::max(nodes[left].height, nodes[right].height);
+        unsigned int root_ = readUnsigned();
+        unsigned int nodeCount_ = readUnsigned();
+        unsigned int nodeCapacity_ = readUnsigned();
+        unsigned int freeList_ = readUnsigned();
 
-                index = nodes[index].parent;
-            }
-        }
-        else
+        // Each node takes 3*dimension + 2 doubles and 9 unsigned integers.
+        std::size_t nodeSize = 8*(3*dimension_ + 2) + 4*9;
+
+        if ((nodeCapacity_ == 0) || (nodeCount_ > nodeCapacity_)
+         || ((root_ != NULL_NODE) && (root_ >= nodeCapacity_))
+         || ((freeList_ != NULL_NODE) && (freeList_ >= nodeCapacity_))
+         || (buffer.size() - position != nodeSize*nodeCapacity_))
         {
-            root = sibling;
-            nodes[sibling].parent = NULL_NODE;
-            freeNode(parent);
+            throw std::invalid_argument("[ERROR]: The tree file is corrupt!");
         }
-    }
 
-    unsigned int Tree::balance(unsigned int node)
-    {
-        assert(node != NULL_NODE);
+        // Read the nodes, checking that every link stays within the pool.
+        NodePool<D, Layout> pool;
+        pool.resize(nodeCapacity_);
+        bool isCorrupt = false;
 
-        if (nodes[node].isLeaf() || (nodes[node].height < 2))
+        auto readLink = [&readUnsigned, &isCorrupt, nodeCapacity_]()
+        {
+            unsigned int node = readUnsigned();
+            isCorrupt |= (node != NULL_NODE) && (node >= nodeCapacity_);
             return node;
+        };
 
-        unsigned int left = nodes[node].left;
-        unsigned int right = nodes[node].right;
+        for (unsigned int i=0;i<nodeCapacity_;i++)
+        {
+            AABBType& aabb = pool.aabb(i);
+            aabb.setDimension(dimension_);
+            for (unsigned int j=0;j<dimension_;j++) aabb.lowerBound[j] = readDouble();
+            for (unsigned int j=0;j<dimension_;j++) aabb.upperBound[j] = readDouble();
+            aabb.surfaceArea = aabb.computeSurfaceArea();
+            aabb.centre = aabb.computeCentre();
+
+            pool.parent(i) = readLink();
+            pool.next(i) = readLink();
+            pool.left(i) = readLink();
+            pool.right(i) = readLink();
+            pool.height(i) = int(readUnsigned());
+            pool.particle(i) = readUnsigned();
+
+            pool.position(i) = VectorTraits<D>::create(dimension_);
+            for (unsigned int j=0;j<dimension_;j++) pool.position(i)[j] = readDouble();
+
+            pool.radius(i) = readDouble();
+            pool.skin(i) = readDouble();
+            pool.age(i) = readUnsigned();
+            pool.ghost(i) = readLink();
+            pool.owner(i) = readLink();
+        }
 
-        assert(left < nodeCapacity);
-        assert(right < nodeCapacity);
+        if (isCorrupt || ((root_ != NULL_NODE) && (pool.parent(root_) != NULL_NODE))
+         || ((root_ == NULL_NODE) && (nodeCount_ != 0)))
+        {
+            throw std::invalid_argument("[ERROR]: The tree file is corrupt!");
+        }
 
-        int currentBalance = nodes[right].height - nodes[left].height;
+        // Walk the tree from the root. Every node must be reached exactly
+        // once, children must point back to their parent, and the heights
+        // must agree. Non-ghost leaves are mapped to their particles.
+        ParticleMap map(particleIndex);
+        map.reserve(nodeCount_/2 + 1);
 
-        // Rotate right branch up.
-        if (currentBalance > 1)
-        {
-            unsigned int rightLeft = nodes[right].left;
-            unsigned int rightRight = nodes[right].right;
+        std::vector<char> isLive(nodeCapacity_, false);
+        std::vector<unsigned int> stack;
+        unsigned int nLive = 0;
 
-            assert(rightLeft < nodeCapacity);
-            assert(rightRight < nodeCapacity);
+        if (root_ != NULL_NODE) stack.push_back(root_);
 
-            // Swap node and its right-hand child.
-            nodes[right].left = node;
-            nodes[right].parent = nodes[node].parent;
-            nodes[node].parent = right;
+        while (!stack.empty() && !isCorrupt)
+        {
+            unsigned int node = stack.back();
+            stack.pop_back();
 
-            // The node's old parent should now point to its right-hand child.
-            if (nodes[right].parent != NULL_NODE)
+            if (isLive[node] || (++nLive > nodeCount_) || (pool.height(node) < 0))
             {
-                if (nodes[nodes[right].parent].left == node) nodes[nodes[right].parent].left = right;
-                else
-                {
-                    assert(nodes[nodes[right].parent].right == node);
-                    nodes[nodes[right].parent].right = right;
-                }
+                isCorrupt = true;
+                break;
             }
-            else root = right;
 
-            // Rotate.
-            if (nodes[rightLeft].height > nodes[rightRight].height)
+            isLive[node] = true;
+
+            unsigned int left = pool.left(node);
+            unsigned int right = pool.right(node);
+
+            if (left == NULL_NODE)
             {
-                nodes[right].right = rightLeft;
-                nodes[node].right = rightRight;
-                nodes[rightRight].parent = node;
-                nodes[node].aabb.merge(nodes[left].aabb, nodes[rightRight].aabb);
-                nodes[right].aabb.merge(nodes[node].aabb, nodes[rightLeft].aabb);
+                unsigned int particle = pool.particle(node);
 
-                nodes[node].height = 1 + std::max(nodes[left].height, nodes[rightRight].height);
-                nodes[right].height = 1 + std::max(nodes[node].height, nodes[rightLeft].height);
+                isCorrupt = (right != NULL_NODE) || (pool.height(node) != 0)
+                         || ((pool.owner(node) == NULL_NODE)
+                          && ((particle == NULL_NODE) || !map.insert(particle, node)
+                           || (map.find(particle) != node)));
             }
             else
             {
-                nodes[right].right = rightRight;
-                nodes[node].right = rightLeft;
-                nodes[rightLeft].parent = node;
-                nodes[node].aabb.merge(nodes[left].aabb, nodes[rightLeft].aabb);
-                nodes[right].aabb.merge(nodes[node].aabb, nodes[rightRight].aabb);
+                isCorrupt = (right == NULL_NODE)
+                         || (pool.parent(left) != node) || (pool.parent(right) != node)
+                         || (pool.height(node) != 1 + std::max(pool.height(left), pool.height(right)));
 
-                nodes[node].height = 1 + std::max(nodes[left].height, nodes[rightLeft].height);
-                nodes[right].height = 1 + std::max(nodes[node].height, nodes[rightRight].height);
+                stack.push_back(left);
+                stack.push_back(right);
             }
-
-            return right;
         }
 
-        // Rotate left branch up.
-        if (currentBalance < -1)
-        {
-            unsigned int leftLeft = nodes[left].left;
-            unsigned int leftRight = nodes[left].right;
+        isCorrupt |= (nLive != nodeCount_);
 
-            assert(leftLeft < nodeCapacity);
-            assert(leftRight < nodeCapacity);
+        // Each ghost must appear once on the chain of the live leaf that it
+        // mirrors.
+        std::vector<char> isChained(nodeCapacity_, false);
 
-            // Swap node and its left-hand child.
-            nodes[left].left = node;
-            nodes[left].parent = nodes[node].parent;
-            nodes[node].parent = left;
+        for (unsigned int i=0;(i<nodeCapacity_) && !isCorrupt;i++)
+        {
+            if (!isLive[i] || (pool.height(i) != 0) || (pool.owner(i) != NULL_NODE)) continue;
 
-            // The node's old parent should now point to its left-hand child.
-            if (nodes[left].parent != NULL_NODE)
+            for (unsigned int ghost = pool.ghost(i);ghost != NULL_NODE;ghost = pool.ghost(ghost))
             {
-                if (nodes[nodes[left].parent].left == node) nodes[nodes[left].parent].left = left;
-                else
+                if (!isLive[ghost] || isChained[ghost] || (pool.height(ghost) != 0)
+                 || (pool.owner(ghost) != i) || (pool.particle(ghost) != pool.particle(i)))
                 {
-                    assert(nodes[nodes[left].parent].right == node);
-                    nodes[nodes[left].parent].right = left;
+                    isCorrupt = true;
+                    break;
                 }
+
+                isChained[ghost] = true;
             }
-            else root = left;
+        }
 
-            // Rotate.
-            if (nodes[leftLeft].height > nodes[leftRight].height)
-            {
-                nodes[left].right = leftLeft;
-                nodes[node].left = leftRight;
-                nodes[leftRight].parent = node;
-                nodes[node].aabb.merge(nodes[right].aabb, nodes[leftRight].aabb);
-                nodes[left].aabb.merge(nodes[node].aabb, nodes[leftLeft].aabb);
+        for (unsigned int i=0;(i<nodeCapacity_) && !isCorrupt;i++)
+        {
+            isCorrupt = isLive[i] && (pool.height(i) == 0)
+                     && (pool.owner(i) != NULL_NODE) && !isChained[i];
+        }
 
-                nodes[node].height = 1 + std::max(nodes[right].height, nodes[leftRight].height);
-                nodes[left].height = 1 + std::max(nodes[node].height, nodes[leftLeft].height);
-            }
-            else
-            {
-                nodes[left].right = leftRight;
-                nodes[node].left = leftLeft;
-                nodes[leftLeft].parent = node;
-                nodes[node].aabb.merge(nodes[right].aabb, nodes[leftLeft].aabb);
-                nodes[left].aabb.merge(nodes[node].aabb, nodes[leftRight].aabb);
+        // The remaining nodes must form an acyclic free list.
+        unsigned int nFree = 0;
 
-                nodes[node].height = 1 + std::max(nodes[right].height, nodes[leftLeft].height);
-                nodes[left].height = 1 + std::max(nodes[node].height, nodes[leftRight].height);
+        for (unsigned int node = freeList_;(node != NULL_NODE) && !isCorrupt;node = pool.next(node))
+        {
+            if (isLive[node] || (pool.height(node) != -1) || (++nFree > nodeCapacity_ - nodeCount_))
+            {
+                isCorrupt = true;
+                break;
             }
 
-            return left;
+            // Mark the node so that a cycle is caught.
+            isLive[node] = true;
         }
 
-        return node;
-    }
+        isCorrupt |= (nFree != nodeCapacity_ - nodeCount_);
 
-    unsigned int Tree::computeHeight() const
-    {
-        return computeHeight(root);
+        if (isCorrupt)
+        {
+            throw std::invalid_argument("[ERROR]: The tree file is corrupt!");
+        }
+
+        // Everything has been read, so replace the tree.
+        dimension = dimension_;
+        periodicity = periodicity_;
+        isPeriodic = std::find(periodicity.begin(), periodicity.end(), true) != periodicity.end();
+        isGhosts = false;
+        setBoxSize(boxSize_);
+
+        skinThickness = skinThickness_;
+        touchIsOverlap = touchIsOverlap_;
+        balanceMethod = balanceMethod_;
+        updateMethod = updateMethod_;
+        refitThreshold = refitThreshold_;
+        refitReference = refitReference_;
+        isAdaptiveSkin = isAdaptiveSkin_;
+        targetAge = targetAge_;
+        isGhosts = isGhosts_;
+        ghostWidth = ghostWidth_;
+
+        root = root_;
+        nodeCount = nodeCount_;
+        nodeCapacity = nodeCapacity_;
+        freeList = freeList_;
+        std::swap(nodes, pool);
+        std::swap(particleMap, map);
+
+        // Rebuild the single-precision bounds.
+        precision = Precision::Double;
+        floatBounds.clear();
+        setPrecision(precision_);
+
+        if (root != NULL_NODE) validate();
     }
 
-    unsigned int Tree::computeHeight(unsigned int node) const
+    template <unsigned int D, class Layout>
+    unsigned int BasicTree<D, Layout>::exportNodes(std::vector<BasicSnapshotNode<D> >& snapshotNodes) const
     {
-        assert(node < nodeCapacity);
+        snapshotNodes.clear();
 
-        if (nodes[node].isLeaf()) return 0;
+        if (root == NULL_NODE) return NULL_NODE;
 
-        unsigned int height1 = computeHeight(nodes[node].left);
-        unsigned int height2 = computeHeight(nodes[node].right);
+        snapshotNodes.reserve(nodeCount);
 
-        return 1 + std::max(height1, height2);
-    }
+        std::vector<std::pair<unsigned int, bool> > stack(1, std::make_pair(root, false));
+        std::vector<unsigned int> built;
 
-    unsigned int Tree::getHeight() const
-    {
-        if (root == NULL_NODE) return 0;
-        return nodes[root].height;
-    }
+        while (!stack.empty())
+        {
+            unsigned int node = stack.back().first;
+            bool isVisited = stack.back().second;
+            stack.pop_back();
 
-    unsigned int Tree::getNodeCount() const
-    {
-        return nodeCount;
-    }
+            if (nodes.isLeaf(node))
+            {
+                if (isGhosts && (nodes.owner(node) != NULL_NODE))
+                {
+                    built.push_back(NULL_NODE);
+                    continue;
+                }
 
-    unsigned int Tree::computeMaximumBalance() const
-    {
-        unsigned int maxBalance = 0;
-        for (unsigned int i=0; i<nodeCapacity; i++)
-        {
-            if (nodes[i].height <= 1)
-                continue;
+                BasicSnapshotNode<D> leaf;
+                leaf.aabb = nodes.aabb(node);
+                leaf.left = NULL_NODE;
+                leaf.right = NULL_NODE;
+                leaf.particle = nodes.particle(node);
 
-            assert(nodes[i].isLeaf() == false);
+                built.push_back(snapshotNodes.size());
+                snapshotNodes.push_back(leaf);
+            }
+            else if (!isVisited)
+            {
+                stack.push_back(std::make_pair(node, true));
+                stack.push_back(std::make_pair(nodes.left(node), false));
+                stack.push_back(std::make_pair(nodes.right(node), false));
+            }
+            else
+            {
+                unsigned int left = built.back();
+                built.pop_back();
+                unsigned int right = built.back();
+                built.pop_back();
 
-            unsigned int balance = std::abs(nodes[nodes[i].left].height - nodes[nodes[i].right].height);
-            maxBalance = std::max(maxBalance, balance);
+                if      (left == NULL_NODE)  built.push_back(right);
+                else if (right == NULL_NODE) built.push_back(left);
+                else
+                {
+                    BasicSnapshotNode<D> parent;
+                    parent.aabb.merge(snapshotNodes[left].aabb, snapshotNodes[right].aabb);
+                    parent.left = left;
+                    parent.right = right;
+                    parent.particle = NULL_NODE;
+
+                    built.push_back(snapshotNodes.size());
+                    snapshotNodes.push_back(parent);
+                }
+            }
         }
 
-        return maxBalance;
+        return built.back();
     }
 
-    double Tree::computeSurfaceAreaRatio() const
+    template <unsigned int D, class Offset>
+    void BasicCompressedTree<D, Offset>::compress(const std::vector<BuildNode>& buildNodes, unsigned int buildRoot)
     {
-        if (root == NULL_NODE) return 0.0;
+        root = NULL_NODE;
+        nLeaves = 0;
+        height = 0;
+        rootBounds.assign(2*dimension, 0);
+        children.clear();
+        offsets.clear();
 
-        double rootArea = nodes[root].aabb.computeSurfaceArea();
-        double totalArea = 0.0;
+        if (buildRoot == NULL_NODE) return;
 
-        for (unsigned int i=0; i<nodeCapacity;i++)
+        // The top bit flags a particle, and the largest flagged value is NULL_NODE.
+        for (unsigned int i=0;i<buildNodes.size();i++)
         {
-            if (nodes[i].height < 0) continue;
+            if (buildNodes[i].left != NULL_NODE) continue;
 
-            totalArea += nodes[i].aabb.computeSurfaceArea();
+            if (buildNodes[i].particle >= ~LEAF)
+            {
+                throw std::invalid_argument("[ERROR]: Particle index is too large to compress!");
+            }
+            nLeaves++;
         }
 
-        return totalArea / rootArea;
-    }
-
-    void Tree::validate() const
-    {
-#ifndef NDEBUG
-        validateStructure(root);
-        validateMetrics(root);
-
-        unsigned int freeCount = 0;
-        unsigned int freeIndex = freeList;
-
-        while (freeIndex != NULL_NODE)
+        const AABBType& rootAABB = buildNodes[buildRoot].aabb;
+        for (unsigned int i=0;i<dimension;i++)
         {
-            assert(freeIndex < nodeCapacity);
-            freeIndex = nodes[freeIndex].next;
-            freeCount++;
+            rootBounds[i] = rootAABB.lowerBound[i];
+            rootBounds[dimension + i] = rootAABB.upperBound[i];
         }
 
-        assert(getHeight() == computeHeight());
-        assert((nodeCount + freeCount) == nodeCapacity);
-#endif
-    }
-
-    void Tree::rebuild()
-    {
-        std::vector<unsigned int> nodeIndices(nodeCount);
-        unsigned int count = 0;
-
-        for (unsigned int i=0;i<nodeCapacity;i++)
+        if (buildNodes[buildRoot].left == NULL_NODE)
         {
-            // Free node.
-            if (nodes[i].height < 0) continue;
-
-            if (nodes[i].isLeaf())
-            {
-                nodes[i].parent = NULL_NODE;
-                nodeIndices[count] = i;
-                count++;
-            }
-            else freeNode(i);
+            root = buildNodes[buildRoot].particle | LEAF;
+            return;
         }
 
-        while (count > 1)
+        // Allocate all of the nodes, which are numbered in depth-first order.
+        unsigned int stride = 2*dimension;
+        unsigned int nNodes = 1;
+        children.resize(2*(nLeaves - 1));
+        offsets.resize(std::size_t(2*stride)*(nLeaves - 1));
+        root = 0;
+
+        // Each entry on the stack holds a node of the uncompressed tree, the
+        // compressed node, its depth, and its decoded bounds.
+        struct Entry
+        {
+            unsigned int buildNode;
+            unsigned int node;
+            unsigned int depth;
+        };
+
+        std::vector<Entry> stack(1, Entry{buildRoot, 0, 0});
+        std::vector<double> stackBounds(rootBounds);
+        std::vector<double> parent(stride);
+        std::vector<double> child(stride);
+        double maxOffset = std::numeric_limits<Offset>::max();
+
+        while (!stack.empty())
         {
-            double minCost = std::numeric_limits<double>::max();
-            int iMin = -1, jMin = -1;
+            Entry entry = stack.back();
+            stack.pop_back();
+
+            std::copy(stackBounds.end() - stride, stackBounds.end(), parent.begin());
+            stackBounds.resize(stackBounds.size() - stride);
 
-            for (unsigned int i=0;i<count;i++)
+            for (unsigned int i=0;i<2;i++)
             {
-                AABB aabbi = nodes[nodeIndices[i]].aabb;
+                unsigned int buildChild = (i == 0) ? buildNodes[entry.buildNode].left : buildNodes[entry.buildNode].right;
+                const AABBType& aabb = buildNodes[buildChild].aabb;
+                std::size_t offset = std::size_t(2*stride)*entry.node + i*stride;
 
-                for (unsigned int j=i+1;j<count;j++)
+                for (unsigned int j=0;j<dimension;j++)
                 {
-                    AABB aabbj = nodes[nodeIndices[j]].aabb;
-                    AABB aabb;
-                    aabb.merge(aabbi, aabbj);
-                    double cost = aabb.getSurfaceArea();
+                    double lowerBound = parent[j];
+                    double upperBound = parent[dimension + j];
+                    double step = computeStep(lowerBound, upperBound);
 
-                    if (cost < minCost)
+                    // Round each offset toward the parent's face until the
+                    // decoded bound contains the child.
+                    unsigned int lowerOffset = 0;
+                    unsigned int upperOffset = 0;
+
+                    if (step > 0)
                     {
-                        iMin = i;
-                        jMin = j;
-                        minCost = cost;
-                    }
-                }
-            }
+                        lowerOffset = unsigned(std::min(maxOffset, std::max(0.0, std::floor((aabb.lowerBound[j] - lowerBound) / step))));
+                        upperOffset = unsigned(std::min(maxOffset, std::max(0.0, std::floor((upperBound - aabb.upperBound[j]) / step))));
 
-            unsigned int index1 = nodeIndices[iMin];
-            unsigned int index2 = nodeIndices[jMin];
+                        while ((lowerOffset > 0) && (lowerBound + lowerOffset*step > aabb.lowerBound[j])) lowerOffset--;
+                        while ((upperOffset > 0) && (upperBound - upperOffset*step < aabb.upperBound[j])) upperOffset--;
+                    }
 
-            unsigned int parent = allocateNode();
-            nodes[parent].left = index1;
-            nodes[parent].right = index2;
-            nodes[parent].height = 1 + std::max(nodes[index1].height, nodes[index2].height);
-            nodes[parent].aabb.merge(nodes[index1].aabb, nodes[index2].aabb);
-            nodes[parent].parent = NULL_NODE;
+                    offsets[offset + j] = Offset(lowerOffset);
+                    offsets[offset + dimension + j] = Offset(upperOffset);
 
-            nodes[index1].parent = parent;
-            nodes[index2].parent = parent;
+                    // Decode the child's bounds, as a query would.
+                    child[j] = lowerBound + offsets[offset + j]*step;
+                    child[dimension + j] = upperBound - offsets[offset + dimension + j]*step;
+                }
 
-            nodeIndices[jMin] = nodeIndices[count-1];
-            nodeIndices[iMin] = parent;
-            count--;
+                if (buildNodes[buildChild].left == NULL_NODE)
+                {
+                    children[2*entry.node + i] = buildNodes[buildChild].particle | LEAF;
+                    height = std::max(height, entry.depth + 1);
+                }
+                else
+                {
+                    children[2*entry.node + i] = nNodes;
+                    stack.push_back(Entry{buildChild, nNodes, entry.depth + 1});
+                    stackBounds.insert(stackBounds.end(), child.begin(), child.end());
+                    nNodes++;
+                }
+            }
         }
-
-        root = nodeIndices[0];
-
-        validate();
     }
 
-    void Tree::validateStructure(unsigned int node) const
+    template <unsigned int D, class Offset>
+    std::vector<unsigned int> BasicCompressedTree<D, Offset>::query(const AABBType& aabb) const
     {
-        if (node == NULL_NODE) return;
-
-        if (node == root) assert(nodes[node].parent == NULL_NODE);
-
-        unsigned int left = nodes[node].left;
-        unsigned int right = nodes[node].right;
+        std::vector<unsigned int> particles;
 
-        if (nodes[node].isLeaf())
+        query(aabb, [&particles](unsigned int particle)
         {
-            assert(left == NULL_NODE);
-            assert(right == NULL_NODE);
-            assert(nodes[node].height == 0);
-            return;
-        }
+            particles.push_back(particle);
+            return true;
+        });
 
-        assert(left < nodeCapacity);
-        assert(right < nodeCapacity);
+        return particles;
+    }
+
+    template <unsigned int D, class Offset>
+    unsigned int BasicCompressedTree<D, Offset>::nParticles() const
+    {
+        return nLeaves;
+    }
 
-        assert(nodes[left].parent == node);
-        assert(nodes[right].parent == node);
+    template <unsigned int D, class Offset>
+    unsigned int BasicCompressedTree<D, Offset>::getNodeCount() const
+    {
+        return children.size() / 2;
+    }
 
-        validateStructure(left);
-        validateStructure(right);
+    template <unsigned int D, class Offset>
+    unsigned int BasicCompressedTree<D, Offset>::getHeight() const
+    {
+        return height;
     }
 
-    void Tree::validateMetrics(unsigned int node) const
+    template <unsigned int D, class Offset>
+    std::size_t BasicCompressedTree<D, Offset>::getMemoryUsage() const
     {
-        if (node == NULL_NODE) return;
+        return children.size()*sizeof(std::uint32_t) + offsets.size()*sizeof(Offset)
+             + rootBounds.size()*sizeof(double);
+    }
+    template <unsigned int D, unsigned int Width>
+    void BasicWideTree<D, Width>::build(const std::vector<BuildNode>& buildNodes, unsigned int buildRoot)
+    {
+        nLeaves = 0;
+        height = 0;
+        children.clear();
+        bounds.clear();
 
-        unsigned int left = nodes[node].left;
-        unsigned int right = nodes[node].right;
+        if (buildRoot == NULL_NODE) return;
 
-        if (nodes[node].isLeaf())
+        // The top bit flags a particle, and the largest flagged value is NULL_NODE.
+        for (unsigned int i=0;i<buildNodes.size();i++)
         {
-            assert(left == NULL_NODE);
-            assert(right == NULL_NODE);
-            assert(nodes[node].height == 0);
-            return;
+            if (buildNodes[i].left != NULL_NODE) continue;
+
+            if (buildNodes[i].particle >= ~LEAF)
+            {
+                throw std::invalid_argument("[ERROR]: Particle index is too large for a wide tree!");
+            }
+            nLeaves++;
         }
 
-        assert(left < nodeCapacity);
-        assert(right < nodeCapacity);
+        // Each internal node of the wide tree absorbs at least one internal
+        // node of the binary tree, so there are at most nLeaves - 1 of them.
+        std::size_t stride = std::size_t(2*Width)*dimension;
+        children.reserve(std::size_t(Width)*std::max(1u, nLeaves - 1));
+        bounds.reserve(stride*std::max(1u, nLeaves - 1));
 
-        int height1 = nodes[left].height;
-        int height2 = nodes[right].height;
-        int height = 1 + std::max(height1, height2);
-        (void)height; // Unused variable in Release build
-        assert(nodes[node].height == height);
+        // Each entry on the stack holds a node of the binary tree, the wide
+        // node that it becomes, and the depth of the wide node.
+        struct Entry
+        {
+            unsigned int buildNode;
+            unsigned int node;
+            unsigned int depth;
+        };
 
-        AABB aabb;
-        aabb.merge(nodes[left].aabb, nodes[right].aabb);
+        std::vector<Entry> stack(1, Entry{buildRoot, 0, 1});
+        std::vector<unsigned int> slots;
+        unsigned int nNodes = 1;
 
+        // Empty slots hold an inverted box, which never overlaps a query.
+        children.resize(Width, NULL_NODE);
         for (unsigned int i=0;i<dimension;i++)
         {
-            assert(aabb.lowerBound[i] == nodes[node].aabb.lowerBound[i]);
-            assert(aabb.upperBound[i] == nodes[node].aabb.upperBound[i]);
+            bounds.insert(bounds.end(), Width, std::numeric_limits<double>::infinity());
+            bounds.insert(bounds.end(), Width, -std::numeric_limits<double>::infinity());
         }
 
-        validateMetrics(left);
-        validateMetrics(right);
-    }
-
-    void Tree::periodicBoundaries(std::vector<double>& position)
-    {
-        for (unsigned int i=0;i<dimension;i++)
+        while (!stack.empty())
         {
-            if (position[i] < 0)
+            Entry entry = stack.back();
+            stack.pop_back();
+
+            // Open the internal node with the largest surface area until the
+            // wide node is full, or only leaves are left.
+            slots.assign(1, entry.buildNode);
+
+            while (slots.size() < Width)
             {
-                position[i] += boxSize[i];
+                unsigned int largest = NULL_NODE;
+
+                for (unsigned int i=0;i<slots.size();i++)
+                {
+                    if (buildNodes[slots[i]].left == NULL_NODE) continue;
+
+                    if ((largest == NULL_NODE)
+                     || (buildNodes[slots[i]].aabb.surfaceArea > buildNodes[slots[largest]].aabb.surfaceArea))
+                        largest = i;
+                }
+
+                if (largest == NULL_NODE) break;
+
+                unsigned int buildNode = slots[largest];
+                slots[largest] = buildNodes[buildNode].left;
+                slots.push_back(buildNodes[buildNode].right);
             }
-            else
+
+            for (unsigned int i=0;i<slots.size();i++)
             {
-                if (position[i] >= boxSize[i])
+                const BuildNode& buildNode = buildNodes[slots[i]];
+                double* nodeBounds = &bounds[stride*entry.node];
+
+                for (unsigned int j=0;j<dimension;j++)
                 {
-                    position[i] -= boxSize[i];
+                    nodeBounds[2*Width*j + i] = buildNode.aabb.lowerBound[j];
+                    nodeBounds[2*Width*j + Width + i] = buildNode.aabb.upperBound[j];
+                }
+
+                if (buildNode.left == NULL_NODE)
+                {
+                    children[Width*entry.node + i] = buildNode.particle | LEAF;
+                    height = std::max(height, entry.depth);
+                }
+                else
+                {
+                    children[Width*entry.node + i] = nNodes;
+                    stack.push_back(Entry{slots[i], nNodes, entry.depth + 1});
+                    nNodes++;
+
+                    children.resize(std::size_t(Width)*nNodes, NULL_NODE);
+                    for (unsigned int j=0;j<dimension;j++)
+                    {
+                        bounds.insert(bounds.end(), Width, std::numeric_limits<double>::infinity());
+                        bounds.insert(bounds.end(), Width, -std::numeric_limits<double>::infinity());
+                    }
                 }
             }
         }
     }
 
-    bool Tree::minimumImage(std::vector<double>& separation, std::vector<double>& shift)
+    template <unsigned int D, unsigned int Width>
+    std::vector<unsigned int> BasicWideTree<D, Width>::query(const AABBType& aabb) const
     {
-        bool isShifted = false;
+        std::vector<unsigned int> particles;
 
-        for (unsigned int i=0;i<dimension;i++)
+        query(aabb, [&particles](unsigned int particle)
         {
-            if (separation[i] < negMinImage[i])
-            {
-                separation[i] += periodicity[i]*boxSize[i];
-                shift[i] = periodicity[i]*boxSize[i];
-                isShifted = true;
-            }
-            else
-            {
-                if (separation[i] >= posMinImage[i])
-                {
-                    separation[i] -= periodicity[i]*boxSize[i];
-                    shift[i] = -periodicity[i]*boxSize[i];
-                    isShifted = true;
-                }
-            }
-        }
+            particles.push_back(particle);
+            return true;
+        });
 
-        return isShifted;
+        return particles;
+    }
+
+    template <unsigned int D, unsigned int Width>
+    unsigned int BasicWideTree<D, Width>::nParticles() const
+    {
+        return nLeaves;
     }
+
+    template <unsigned int D, unsigned int Width>
+    unsigned int BasicWideTree<D, Width>::getNodeCount() const
+    {
+        return children.size() / Width;
+    }
+
+    template <unsigned int D, unsigned int Width>
+    unsigned int BasicWideTree<D, Width>::getHeight() const
+    {
+        return height;
+    }
+
+    template <unsigned int D, unsigned int Width>
+    std::size_t BasicWideTree<D, Width>::getMemoryUsage() const
+    {
+        return children.size()*sizeof(std::uint32_t) + bounds.size()*sizeof(double);
+    }
+
+    // Explicit instantiations for run-time dimensionality, and for the
+    // fixed two- and three-dimensional cases.
+    template struct BasicNode<0>;
+    template struct BasicNode<2>;
+    template struct BasicNode<3>;
+
+    template class BasicTree<0>;
+    template class BasicTree<2>;
+    template class BasicTree<3>;
+
+    template class BasicTree<2, SoA>;
+    template class BasicTree<3, SoA>;
+
+    template class BasicCompressedTree<0, std::uint8_t>;
+    template class BasicCompressedTree<2, std::uint8_t>;
+    template class BasicCompressedTree<3, std::uint8_t>;
+
+    template class BasicCompressedTree<0, std::uint16_t>;
+    template class BasicCompressedTree<2, std::uint16_t>;
+    template class BasicCompressedTree<3, std::uint16_t>;
+
+    template class BasicWideTree<0, 4>;
+    template class BasicWideTree<2, 4>;
+    template class BasicWideTree<3, 4>;
+
+    template class BasicWideTree<0, 8>;
+    template class BasicWideTree<2, 8>;
+    template class BasicWideTree<3, 8>;
 }
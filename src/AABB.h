@@ -28,19 +28,320 @@
 #define _AABB_H
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <limits>
 #include <stdexcept>
-#include <unordered_map>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 /// Null node flag.
 const unsigned int NULL_NODE = 0xffffffff;
 
 namespace aabb
 {
+    /*! \brief Storage traits for position vectors and AABB bounds.
+
+        For a fixed dimensionality, D > 0, vectors are stored in a std::array
+        so that AABBs require no heap allocation and loops over dimensions
+        have a compile-time trip count. A dimensionality of zero selects
+        the run-time dimensionality, with vectors stored in a std::vector.
+     */
+    template <unsigned int D>
+    struct VectorTraits
+    {
+        /// The vector type.
+        typedef std::array<double, D> Vector;
+
+        //! Create a zeroed vector.
+        /*! \param dimension
+                The dimensionality of the system.
+
+            \return
+                The vector.
+         */
+        static Vector create(unsigned int dimension)
+        {
+            (void)dimension;
+            assert(dimension == D);
+
+            Vector vector;
+            vector.fill(0);
+
+            return vector;
+        }
+
+        //! Resize a vector (a no-op for fixed dimensionality).
+        /*! \param vector
+                The vector.
+
+            \param dimension
+                The dimensionality of the system.
+         */
+        static void resize(Vector&, unsigned int dimension)
+        {
+            (void)dimension;
+            assert(dimension == D);
+        }
+    };
+
+    /// Storage traits for run-time dimensionality.
+    template <>
+    struct VectorTraits<0>
+    {
+        /// The vector type.
+        typedef std::vector<double> Vector;
+
+        //! Create a zeroed vector.
+        /*! \param dimension
+                The dimensionality of the system.
+
+            \return
+                The vector.
+         */
+        static Vector create(unsigned int dimension)
+        {
+            return Vector(dimension);
+        }
+
+        //! Resize a vector.
+        /*! \param vector
+                The vector.
+
+            \param dimension
+                The dimensionality of the system.
+         */
+        static void resize(Vector& vector, unsigned int dimension)
+        {
+            vector.resize(dimension);
+        }
+    };
+
+    /*! \brief Comparison and merge kernels for the bounds of an AABB.
+
+        The generic kernels loop over every axis without an early exit, so
+        for a fixed dimensionality they compile to straight-line, branch-free
+        code. For two, three and four dimensions, SSE2 kernels (AVX for four
+        dimensions) are selected at compile time when the target supports
+        them, e.g. when building with OPTFLAGS=-march=native. The kernels are
+        not dispatched at run time, since calling them through a pointer
+        would stop them from being inlined into tree traversals.
+     */
+    template <unsigned int D>
+    struct AABBKernels
+    {
+        //! Find the axes along which a pair of values lies outside a pair of limits.
+        /*! \param below
+                The values tested against the lower limits.
+
+            \param lowerLimit
+                The lower limits.
+
+            \param above
+                The values tested against the upper limits.
+
+            \param upperLimit
+                The upper limits.
+
+            \param dimension
+                The dimensionality of the system.
+
+            \param isInclusive
+                Whether values equal to a limit lie outside it.
+
+            \return
+                A mask with bit i set if below[i] < lowerLimit[i] or
+                above[i] > upperLimit[i], or <= and >= if inclusive.
+         */
+        static unsigned int compare(const double* below, const double* lowerLimit,
+            const double* above, const double* upperLimit, unsigned int dimension, bool isInclusive)
+        {
+            unsigned int mask = 0;
+
+            if (isInclusive)
+            {
+                for (unsigned int i=0;i<dimension;i++)
+                    mask |= unsigned((below[i] <= lowerLimit[i]) | (above[i] >= upperLimit[i])) << i;
+            }
+            else
+            {
+                for (unsigned int i=0;i<dimension;i++)
+                    mask |= unsigned((below[i] < lowerLimit[i]) | (above[i] > upperLimit[i])) << i;
+            }
+
+            return mask;
+        }
+
+        //! Merge two pairs of bounds.
+        /*! \param lowerBound1
+                The lower bound of the first box.
+
+            \param upperBound1
+                The upper bound of the first box.
+
+            \param lowerBound2
+                The lower bound of the second box.
+
+            \param upperBound2
+                The upper bound of the second box.
+
+            \param lowerBound
+                The merged lower bound.
+
+            \param upperBound
+                The merged upper bound.
+
+            \param dimension
+                The dimensionality of the system.
+         */
+        static void merge(const double* lowerBound1, const double* upperBound1,
+            const double* lowerBound2, const double* upperBound2,
+            double* lowerBound, double* upperBound, unsigned int dimension)
+        {
+            for (unsigned int i=0;i<dimension;i++)
+            {
+                lowerBound[i] = std::min(lowerBound1[i], lowerBound2[i]);
+                upperBound[i] = std::max(upperBound1[i], upperBound2[i]);
+            }
+        }
+    };
+
+#if defined(__SSE2__)
+    /*! \brief SSE2 helpers for the AABB kernels.
+
+        Minima and maxima take their arguments in the same order as std::min
+        and std::max, so the results are identical to the generic kernels.
+     */
+    struct SSE2Kernels
+    {
+        /// Compare two values against two limits, as AABBKernels::compare.
+        static __m128d compare(__m128d below, __m128d lowerLimit,
+            __m128d above, __m128d upperLimit, bool isInclusive)
+        {
+            if (isInclusive)
+                return _mm_or_pd(_mm_cmple_pd(below, lowerLimit), _mm_cmpge_pd(above, upperLimit));
+            else
+                return _mm_or_pd(_mm_cmplt_pd(below, lowerLimit), _mm_cmpgt_pd(above, upperLimit));
+        }
+
+        /// Compare the first two axes, as AABBKernels::compare.
+        static unsigned int compare2(const double* below, const double* lowerLimit,
+            const double* above, const double* upperLimit, bool isInclusive)
+        {
+            return _mm_movemask_pd(compare(_mm_loadu_pd(below), _mm_loadu_pd(lowerLimit),
+                _mm_loadu_pd(above), _mm_loadu_pd(upperLimit), isInclusive));
+        }
+
+        /// Merge the first two axes, as AABBKernels::merge.
+        static void merge2(const double* lowerBound1, const double* upperBound1,
+            const double* lowerBound2, const double* upperBound2,
+            double* lowerBound, double* upperBound)
+        {
+            _mm_storeu_pd(lowerBound, _mm_min_pd(_mm_loadu_pd(lowerBound2), _mm_loadu_pd(lowerBound1)));
+            _mm_storeu_pd(upperBound, _mm_max_pd(_mm_loadu_pd(upperBound2), _mm_loadu_pd(upperBound1)));
+        }
+    };
+
+    /// SSE2 kernels for two dimensions.
+    template <>
+    struct AABBKernels<2>
+    {
+        static unsigned int compare(const double* below, const double* lowerLimit,
+            const double* above, const double* upperLimit, unsigned int, bool isInclusive)
+        {
+            return SSE2Kernels::compare2(below, lowerLimit, above, upperLimit, isInclusive);
+        }
+
+        static void merge(const double* lowerBound1, const double* upperBound1,
+            const double* lowerBound2, const double* upperBound2,
+            double* lowerBound, double* upperBound, unsigned int)
+        {
+            SSE2Kernels::merge2(lowerBound1, upperBound1, lowerBound2, upperBound2, lowerBound, upperBound);
+        }
+    };
+
+    /// SSE2 kernels for three dimensions: two axes packed, plus a scalar axis.
+    template <>
+    struct AABBKernels<3>
+    {
+        static unsigned int compare(const double* below, const double* lowerLimit,
+            const double* above, const double* upperLimit, unsigned int, bool isInclusive)
+        {
+            __m128d mask = SSE2Kernels::compare(_mm_load_sd(below + 2), _mm_load_sd(lowerLimit + 2),
+                _mm_load_sd(above + 2), _mm_load_sd(upperLimit + 2), isInclusive);
+
+            return SSE2Kernels::compare2(below, lowerLimit, above, upperLimit, isInclusive)
+                 | ((_mm_movemask_pd(mask) & 1) << 2);
+        }
+
+        static void merge(const double* lowerBound1, const double* upperBound1,
+            const double* lowerBound2, const double* upperBound2,
+            double* lowerBound, double* upperBound, unsigned int)
+        {
+            SSE2Kernels::merge2(lowerBound1, upperBound1, lowerBound2, upperBound2, lowerBound, upperBound);
+            lowerBound[2] = std::min(lowerBound1[2], lowerBound2[2]);
+            upperBound[2] = std::max(upperBound1[2], upperBound2[2]);
+        }
+    };
+
+    /// SSE2 (or AVX) kernels for four dimensions.
+    template <>
+    struct AABBKernels<4>
+    {
+        static unsigned int compare(const double* below, const double* lowerLimit,
+            const double* above, const double* upperLimit, unsigned int, bool isInclusive)
+        {
+#if defined(__AVX__)
+            __m256d lower = _mm256_loadu_pd(below);
+            __m256d upper = _mm256_loadu_pd(above);
+            __m256d mask;
+
+            if (isInclusive)
+            {
+                mask = _mm256_or_pd(_mm256_cmp_pd(lower, _mm256_loadu_pd(lowerLimit), _CMP_LE_OQ),
+                                    _mm256_cmp_pd(upper, _mm256_loadu_pd(upperLimit), _CMP_GE_OQ));
+            }
+            else
+            {
+                mask = _mm256_or_pd(_mm256_cmp_pd(lower, _mm256_loadu_pd(lowerLimit), _CMP_LT_OQ),
+                                    _mm256_cmp_pd(upper, _mm256_loadu_pd(upperLimit), _CMP_GT_OQ));
+            }
+
+            return _mm256_movemask_pd(mask);
+#else
+            return SSE2Kernels::compare2(below, lowerLimit, above, upperLimit, isInclusive)
+                 | (SSE2Kernels::compare2(below + 2, lowerLimit + 2, above + 2, upperLimit + 2, isInclusive) << 2);
+#endif
+        }
+
+        static void merge(const double* lowerBound1, const double* upperBound1,
+            const double* lowerBound2, const double* upperBound2,
+            double* lowerBound, double* upperBound, unsigned int)
+        {
+#if defined(__AVX__)
+            _mm256_storeu_pd(lowerBound, _mm256_min_pd(_mm256_loadu_pd(lowerBound2), _mm256_loadu_pd(lowerBound1)));
+            _mm256_storeu_pd(upperBound, _mm256_max_pd(_mm256_loadu_pd(upperBound2), _mm256_loadu_pd(upperBound1)));
+#else
+            SSE2Kernels::merge2(lowerBound1, upperBound1, lowerBound2, upperBound2, lowerBound, upperBound);
+            SSE2Kernels::merge2(lowerBound1 + 2, upperBound1 + 2, lowerBound2 + 2, upperBound2 + 2,
+                lowerBound + 2, upperBound + 2);
+#endif
+        }
+    };
+#endif
+
     /*! \brief The axis-aligned bounding box object.
 
         Axis-aligned bounding boxes (AABBs) store information for the minimum
@@ -50,18 +351,26 @@ namespace aabb
 
         Class member functions provide functionality for merging AABB objects
         and testing overlap with other AABBs.
+
+        The template parameter sets the dimensionality of the box. For D > 0
+        the bounds are stored inline in fixed-size arrays. D = 0 selects the
+        run-time dimensionality, which is available through the AABB typedef.
      */
-    class AABB
+    template <unsigned int D>
+    class BasicAABB
     {
     public:
+        /// The position vector type.
+        typedef typename VectorTraits<D>::Vector Vector;
+
         /// Constructor.
-        AABB();
+        BasicAABB();
 
         //! Constructor.
         /*! \param dimension
                 The dimensionality of the system.
          */
-        AABB(unsigned int);
+        explicit BasicAABB(unsigned int);
 
         //! Constructor.
         /*! \param lowerBound_
@@ -70,7 +379,7 @@ namespace aabb
             \param upperBound_
                 The upper bound in each dimension.
          */
-        AABB(const std::vector<double>&, const std::vector<double>&);
+        BasicAABB(const Vector&, const Vector&);
 
         /// Compute the surface area of the box.
         double computeSurfaceArea() const;
@@ -85,7 +394,7 @@ namespace aabb
             \param aabb2
                 A reference to the second AABB.
          */
-        void merge(const AABB&, const AABB&);
+        void merge(const BasicAABB&, const BasicAABB&);
 
         //! Test whether the AABB is contained within this one.
         /*! \param aabb
@@ -94,7 +403,7 @@ namespace aabb
             \return
                 Whether the AABB is fully contained.
          */
-        bool contains(const AABB&) const;
+        bool contains(const BasicAABB&) const;
 
         //! Test whether the AABB overlaps this one.
         /*! \param aabb
@@ -106,13 +415,26 @@ namespace aabb
             \return
                 Whether the AABB overlaps.
          */
-        bool overlaps(const AABB&, bool touchIsOverlap) const;
+        bool overlaps(const BasicAABB&, bool touchIsOverlap) const;
+
+        //! Test, axis by axis, whether the AABB overlaps this one.
+        /*! \param aabb
+                A reference to the AABB.
+
+            \param touchIsOverlap
+                Does touching constitute an overlap?
+
+            \return
+                A mask with bit i set if the AABBs overlap along axis i. The
+                AABBs overlap if the bits of all axes are set.
+         */
+        unsigned int overlapMask(const BasicAABB&, bool touchIsOverlap) const;
 
         //! Compute the centre of the AABB.
         /*! \returns
                 The position vector of the AABB centre.
          */
-        std::vector<double> computeCentre();
+        Vector computeCentre() const;
 
         //! Set the dimensionality of the AABB.
         /*! \param dimension
@@ -121,13 +443,13 @@ namespace aabb
         void setDimension(unsigned int);
 
         /// Lower bound of AABB in each dimension.
-        std::vector<double> lowerBound;
+        Vector lowerBound;
 
         /// Upper bound of AABB in each dimension.
-        std::vector<double> upperBound;
+        Vector upperBound;
 
         /// The position of the AABB centre.
-        std::vector<double> centre;
+        Vector centre;
 
         /// The AABB's surface area.
         double surfaceArea;
@@ -145,13 +467,14 @@ namespace aabb
         function allows the tree to query whether the node is a leaf, i.e. to
         determine whether it holds a single particle.
      */
-    struct Node
+    template <unsigned int D>
+    struct BasicNode
     {
         /// Constructor.
-        Node();
+        BasicNode();
 
         /// The fattened axis-aligned bounding box.
-        AABB aabb;
+        BasicAABB<D> aabb;
 
         /// Index of the parent node.
         unsigned int parent;
@@ -178,324 +501,3967 @@ namespace aabb
         bool isLeaf() const;
     };
 
-    /*! \brief The dynamic AABB tree.
+    /// Tag selecting array-of-structures node storage.
+    struct AoS {};
 
-        The dynamic AABB tree is a hierarchical data structure that can be used
-        to efficiently query overlaps between objects of arbitrary shape and
-        size that lie inside of a simulation box. Support is provided for
-        periodic and non-periodic boxes, as well as boxes with partial
-        periodicity, e.g. periodic along specific axes.
-     */
-    class Tree
+    /// Tag selecting structure-of-arrays node storage.
+    struct SoA {};
+
+    /// Methods for restructuring the tree as leaves are inserted and removed.
+    enum class Balance
     {
-    public:
-        //! Constructor (non-periodic).
-        /*! \param dimension_
-                The dimensionality of the system.
+        /// AVL-style rotations that bound the height difference of siblings.
+        Height,
 
-            \param skinThickness_
-                The skin thickness for fattened AABBs, as a fraction
-                of the AABB base length.
+        /// Rotations that reduce the surface area of the tree (Kensler, 2008).
+        SurfaceArea
+    };
 
-            \param nParticles
-                The number of particles (for fixed particle number systems).
+    /// Methods for updating the tree when particles move outside their fattened AABBs.
+    enum class Update
+    {
+        /// Remove and reinsert each particle that has moved.
+        Reinsert,
 
-            \param touchIsOverlap
-                Does touching count as overlapping in query operations?
-         */
-        Tree(unsigned int dimension_= 3, double skinThickness_ = 0.05,
-            unsigned int nParticles = 16, bool touchIsOverlap=true);
+        /// Grow or shrink the leaves in place and refit the tree, keeping its topology.
+        Refit
+    };
 
-        //! Constructor (custom periodicity).
-        /*! \param dimension_
-                The dimensionality of the system.
+    /// Methods for mapping particle indices to leaf nodes.
+    enum class ParticleIndex
+    {
+        /// A vector indexed by the particle, for indices in the range 0 to N-1.
+        Dense,
 
-            \param skinThickness_
-                The skin thickness for fattened AABBs, as a fraction
-                of the AABB base length.
+        /// An open-addressing hash table, for arbitrary indices.
+        Sparse
+    };
 
-            \param periodicity_
-                Whether the system is periodic in each dimension.
+    /// Precision of the node bounds that are used to cull traversals.
+    enum class Precision
+    {
+        /// Test nodes against their double-precision bounds.
+        Double,
 
-            \param boxSize_
-                The size of the simulation box in each dimension.
+        /// Cull with single-precision bounds, rounded outward, then test leaves exactly.
+        Mixed,
 
-            \param nParticles
-                The number of particles (for fixed particle number systems).
+        /// Test all nodes, including leaves, against single-precision bounds.
+        Single
+    };
 
-            \param touchIsOverlap
-                Does touching count as overlapping in query operations?
-         */
-        Tree(unsigned int, double, const std::vector<bool>&, const std::vector<double>&,
-            unsigned int nParticles = 16, bool touchIsOverlap=true);
+    /*! \brief An allocator returning memory aligned to a cache line.
 
-        //! Set the periodicity of the simulation box.
-        /*! \param periodicity_
-                Whether the system is periodic in each dimension.
+        Used by the structure-of-arrays node storage so that each array
+        starts on a cache-line boundary.
+     */
+    template <typename T, std::size_t Alignment = 64>
+    class AlignedAllocator
+    {
+    public:
+        /// The value type.
+        typedef T value_type;
+
+        /// Rebind the allocator to another value type.
+        template <typename U>
+        struct rebind
+        {
+            /// The rebound allocator type.
+            typedef AlignedAllocator<U, Alignment> other;
+        };
+
+        /// Constructor.
+        AlignedAllocator() {}
+
+        /// Converting constructor.
+        template <typename U>
+        AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+        //! Allocate aligned storage.
+        /*! \param n
+                The number of objects.
+
+            \return
+                A pointer to the storage.
          */
-        void setPeriodicity(const std::vector<bool>&);
+        T* allocate(std::size_t n)
+        {
+            // Over-allocate and store the original pointer ahead of the aligned block.
+            char* raw = static_cast<char*>(::operator new(n*sizeof(T) + Alignment + sizeof(void*)));
+            std::size_t address = reinterpret_cast<std::size_t>(raw + sizeof(void*));
+            char* aligned = raw + sizeof(void*) + (Alignment - address % Alignment) % Alignment;
+            reinterpret_cast<void**>(aligned)[-1] = raw;
 
-        //! Set the size of the simulation box.
-        /*! \param boxSize_
-                The size of the simulation box in each dimension.
+            return reinterpret_cast<T*>(aligned);
+        }
+
+        //! Free aligned storage.
+        /*! \param p
+                A pointer to the storage.
          */
-        void setBoxSize(const std::vector<double>&);
+        void deallocate(T* p, std::size_t)
+        {
+            ::operator delete(reinterpret_cast<void**>(p)[-1]);
+        }
+    };
 
-        //! Insert a particle into the tree (point particle).
-        /*! \param index
-                The index of the particle.
+    /// Allocators compare equal since they are stateless.
+    template <typename T, typename U, std::size_t Alignment>
+    bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+    {
+        return true;
+    }
 
-            \param position
-                The position vector of the particle.
+    /// Allocators compare equal since they are stateless.
+    template <typename T, typename U, std::size_t Alignment>
+    bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+    {
+        return false;
+    }
 
-            \param radius
-                The radius of the particle.
-         */
-        void insertParticle(unsigned int, std::vector<double>&, double);
+    /*! \brief The node pool of the AABB tree.
 
-        //! Insert a particle into the tree (arbitrary shape with bounding box).
-        /*! \param index
-                The index of the particle.
+        The pool exposes each node field through an accessor taking the node
+        index, so that the tree is independent of the memory layout. The
+        layout is selected by the second template parameter. The default, AoS,
+        stores an array of BasicNode objects. SoA keeps the node bounds in one
+        contiguous, cache-line-aligned array and the topology fields (parent,
+        next, left, right, height, particle) in separate dense arrays indexed
+        by the same node id, so that a traversal streams through the bounds
+        without pulling in topology for nodes that are culled.
 
-            \param lowerBound
-                The lower bound in each dimension.
+        In both layouts the centre and radius of spherical particles, and the
+        skin and ghost links of each leaf, are held in separate arrays, since
+        they are only used at the leaves.
+     */
+    template <unsigned int D, class Layout = AoS>
+    class NodePool;
 
-            \param upperBound
-                The upper bound in each dimension.
+    /// Array-of-structures node storage.
+    template <unsigned int D>
+    class NodePool<D, AoS>
+    {
+    public:
+        //! Resize the pool.
+        /*! \param capacity
+                The new node capacity.
          */
-        void insertParticle(unsigned int, std::vector<double>&, std::vector<double>&);
+        void resize(unsigned int capacity)
+        {
+            nodes.resize(capacity);
+            positions.resize(capacity);
+            radii.resize(capacity);
+            skins.resize(capacity);
+            ages.resize(capacity);
+            ghosts.resize(capacity);
+            owners.resize(capacity);
+        }
 
-        /// Return the number of particles in the tree.
-        unsigned int nParticles();
+        /// The AABB of a node.
+        BasicAABB<D>& aabb(unsigned int node) { return nodes[node].aabb; }
+        /// The AABB of a node.
+        const BasicAABB<D>& aabb(unsigned int node) const { return nodes[node].aabb; }
 
-        //! Remove a particle from the tree.
-        /*! \param particle
-                The particle index (particleMap will be used to map the node).
-         */
-        void removeParticle(unsigned int);
+        /// The parent of a node.
+        unsigned int& parent(unsigned int node) { return nodes[node].parent; }
+        /// The parent of a node.
+        unsigned int parent(unsigned int node) const { return nodes[node].parent; }
 
-        /// Remove all particles from the tree.
-        void removeAll();
+        /// The next node in the free list.
+        unsigned int& next(unsigned int node) { return nodes[node].next; }
+        /// The next node in the free list.
+        unsigned int next(unsigned int node) const { return nodes[node].next; }
 
-        //! Update the tree if a particle moves outside its fattened AABB.
-        /*! \param particle
-                The particle index (particleMap will be used to map the node).
+        /// The left-hand child of a node.
+        unsigned int& left(unsigned int node) { return nodes[node].left; }
+        /// The left-hand child of a node.
+        unsigned int left(unsigned int node) const { return nodes[node].left; }
 
-            \param position
-                The position vector of the particle.
+        /// The right-hand child of a node.
+        unsigned int& right(unsigned int node) { return nodes[node].right; }
+        /// The right-hand child of a node.
+        unsigned int right(unsigned int node) const { return nodes[node].right; }
 
-            \param radius
-                The radius of the particle.
+        /// The height of a node.
+        int& height(unsigned int node) { return nodes[node].height; }
+        /// The height of a node.
+        int height(unsigned int node) const { return nodes[node].height; }
 
-            \param alwaysReinsert
-                Always reinsert the particle, even if it's within its old AABB (default:false)
+        /// The particle held by a node.
+        unsigned int& particle(unsigned int node) { return nodes[node].particle; }
+        /// The particle held by a node.
+        unsigned int particle(unsigned int node) const { return nodes[node].particle; }
 
-            \return
-                Whether the particle was reinserted.
-         */
-        bool updateParticle(unsigned int, std::vector<double>&, double, bool alwaysReinsert=false);
+        /// The centre of a spherical particle (leaf nodes only).
+        typename VectorTraits<D>::Vector& position(unsigned int node) { return positions[node]; }
+        /// The centre of a spherical particle (leaf nodes only).
+        const typename VectorTraits<D>::Vector& position(unsigned int node) const { return positions[node]; }
 
-        //! Update the tree if a particle moves outside its fattened AABB.
-        /*! \param particle
-                The particle index (particleMap will be used to map the node).
+        /// The radius of a spherical particle, or -1 for other shapes (leaf nodes only).
+        double& radius(unsigned int node) { return radii[node]; }
+        /// The radius of a spherical particle, or -1 for other shapes (leaf nodes only).
+        double radius(unsigned int node) const { return radii[node]; }
 
-            \param lowerBound
-                The lower bound in each dimension.
+        /// The skin thickness of a leaf, as a fraction of its AABB base length (leaf nodes only).
+        double& skin(unsigned int node) { return skins[node]; }
+        /// The skin thickness of a leaf, as a fraction of its AABB base length (leaf nodes only).
+        double skin(unsigned int node) const { return skins[node]; }
 
-            \param upperBound
-                The upper bound in each dimension.
+        /// The number of updates since a leaf was last inserted (leaf nodes only).
+        unsigned int& age(unsigned int node) { return ages[node]; }
+        /// The number of updates since a leaf was last inserted (leaf nodes only).
+        unsigned int age(unsigned int node) const { return ages[node]; }
 
-            \param alwaysReinsert
-                Always reinsert the particle, even if it's within its old AABB (default: false)
-         */
-        bool updateParticle(unsigned int, std::vector<double>&, std::vector<double>&, bool alwaysReinsert=false);
+        /// The first ghost of a leaf, or the next ghost of the same particle for a ghost (leaf nodes only).
+        unsigned int& ghost(unsigned int node) { return ghosts[node]; }
+        /// The first ghost of a leaf, or the next ghost of the same particle for a ghost (leaf nodes only).
+        unsigned int ghost(unsigned int node) const { return ghosts[node]; }
 
-        //! Query the tree to find candidate interactions for a particle.
-        /*! \param particle
-                The particle index.
+        /// The leaf that a ghost mirrors, or NULL_NODE if the leaf isn't a ghost (leaf nodes only).
+        unsigned int& owner(unsigned int node) { return owners[node]; }
+        /// The leaf that a ghost mirrors, or NULL_NODE if the leaf isn't a ghost (leaf nodes only).
+        unsigned int owner(unsigned int node) const { return owners[node]; }
 
-            \return particles
-                A vector of particle indices.
-         */
-        std::vector<unsigned int> query(unsigned int);
+        /// Test whether a node is a leaf.
+        bool isLeaf(unsigned int node) const { return nodes[node].isLeaf(); }
 
-        //! Query the tree to find candidate interactions for an AABB.
-        /*! \param particle
-                The particle index.
+    private:
+        /// The nodes.
+        std::vector<BasicNode<D> > nodes;
 
-            \param aabb
-                The AABB.
+        /// The centre of each spherical particle.
+        std::vector<typename VectorTraits<D>::Vector> positions;
 
-            \return particles
-                A vector of particle indices.
-         */
-        std::vector<unsigned int> query(unsigned int, const AABB&);
+        /// The radius of each spherical particle.
+        std::vector<double> radii;
 
-        //! Query the tree to find candidate interactions for an AABB.
-        /*! \param aabb
-                The AABB.
+        /// The skin thickness of each leaf.
+        std::vector<double> skins;
 
-            \return particles
-                A vector of particle indices.
-         */
-        std::vector<unsigned int> query(const AABB&);
+        /// The number of updates since each leaf was inserted.
+        std::vector<unsigned int> ages;
 
-        //! Get a particle AABB.
-        /*! \param particle
-                The particle index.
-         */
-        const AABB& getAABB(unsigned int);
+        /// The ghost chain of each leaf.
+        std::vector<unsigned int> ghosts;
 
-        //! Get the height of the tree.
-        /*! \return
-                The height of the binary tree.
-         */
-        unsigned int getHeight() const;
+        /// The leaf mirrored by each ghost.
+        std::vector<unsigned int> owners;
+    };
 
-        //! Get the number of nodes in the tree.
-        /*! \return
-                The number of nodes in the tree.
+    /// Structure-of-arrays node storage.
+    template <unsigned int D>
+    class NodePool<D, SoA>
+    {
+    public:
+        //! Resize the pool.
+        /*! \param capacity
+                The new node capacity.
          */
-        unsigned int getNodeCount() const;
+        void resize(unsigned int capacity)
+        {
+            aabbs.resize(capacity);
+            parents.resize(capacity);
+            nexts.resize(capacity);
+            lefts.resize(capacity);
+            rights.resize(capacity);
+            heights.resize(capacity);
+            particles.resize(capacity);
+            positions.resize(capacity);
+            radii.resize(capacity);
+            skins.resize(capacity);
+            ages.resize(capacity);
+            ghosts.resize(capacity);
+            owners.resize(capacity);
+        }
 
-        //! Compute the maximum balancance of the tree.
-        /*! \return
-                The maximum difference between the height of two
-                children of a node.
-         */
-        unsigned int computeMaximumBalance() const;
+        /// The AABB of a node.
+        BasicAABB<D>& aabb(unsigned int node) { return aabbs[node]; }
+        /// The AABB of a node.
+        const BasicAABB<D>& aabb(unsigned int node) const { return aabbs[node]; }
 
-        //! Compute the surface area ratio of the tree.
-        /*! \return
-                The ratio of the sum of the node surface area to the surface
-                area of the root node.
-         */
-        double computeSurfaceAreaRatio() const;
+        /// The parent of a node.
+        unsigned int& parent(unsigned int node) { return parents[node]; }
+        /// The parent of a node.
+        unsigned int parent(unsigned int node) const { return parents[node]; }
 
-        /// Validate the tree.
-        void validate() const;
+        /// The next node in the free list.
+        unsigned int& next(unsigned int node) { return nexts[node]; }
+        /// The next node in the free list.
+        unsigned int next(unsigned int node) const { return nexts[node]; }
 
-        /// Rebuild an optimal tree.
-        void rebuild();
+        /// The left-hand child of a node.
+        unsigned int& left(unsigned int node) { return lefts[node]; }
+        /// The left-hand child of a node.
+        unsigned int left(unsigned int node) const { return lefts[node]; }
 
-    private:
-        /// The index of the root node.
-        unsigned int root;
+        /// The right-hand child of a node.
+        unsigned int& right(unsigned int node) { return rights[node]; }
+        /// The right-hand child of a node.
+        unsigned int right(unsigned int node) const { return rights[node]; }
 
-        /// The dynamic tree.
-        std::vector<Node> nodes;
+        /// The height of a node.
+        int& height(unsigned int node) { return heights[node]; }
+        /// The height of a node.
+        int height(unsigned int node) const { return heights[node]; }
 
-        /// The current number of nodes in the tree.
-        unsigned int nodeCount;
+        /// The particle held by a node.
+        unsigned int& particle(unsigned int node) { return particles[node]; }
+        /// The particle held by a node.
+        unsigned int particle(unsigned int node) const { return particles[node]; }
 
-        /// The current node capacity.
-        unsigned int nodeCapacity;
+        /// The centre of a spherical particle (leaf nodes only).
+        typename VectorTraits<D>::Vector& position(unsigned int node) { return positions[node]; }
+        /// The centre of a spherical particle (leaf nodes only).
+        const typename VectorTraits<D>::Vector& position(unsigned int node) const { return positions[node]; }
 
-        /// The position of node at the top of the free list.
-        unsigned int freeList;
+        /// The radius of a spherical particle, or -1 for other shapes (leaf nodes only).
+        double& radius(unsigned int node) { return radii[node]; }
+        /// The radius of a spherical particle, or -1 for other shapes (leaf nodes only).
+        double radius(unsigned int node) const { return radii[node]; }
 
-        /// The dimensionality of the system.
-        unsigned int dimension;
+        /// The skin thickness of a leaf, as a fraction of its AABB base length (leaf nodes only).
+        double& skin(unsigned int node) { return skins[node]; }
+        /// The skin thickness of a leaf, as a fraction of its AABB base length (leaf nodes only).
+        double skin(unsigned int node) const { return skins[node]; }
 
-        /// Whether the system is periodic along at least one axis.
-        bool isPeriodic;
+        /// The number of updates since a leaf was last inserted (leaf nodes only).
+        unsigned int& age(unsigned int node) { return ages[node]; }
+        /// The number of updates since a leaf was last inserted (leaf nodes only).
+        unsigned int age(unsigned int node) const { return ages[node]; }
 
-        /// The skin thickness of the fattened AABBs, as a fraction of the AABB base length.
-        double skinThickness;
+        /// The first ghost of a leaf, or the next ghost of the same particle for a ghost (leaf nodes only).
+        unsigned int& ghost(unsigned int node) { return ghosts[node]; }
+        /// The first ghost of a leaf, or the next ghost of the same particle for a ghost (leaf nodes only).
+        unsigned int ghost(unsigned int node) const { return ghosts[node]; }
 
-        /// Whether the system is periodic along each axis.
-        std::vector<bool> periodicity;
+        /// The leaf that a ghost mirrors, or NULL_NODE if the leaf isn't a ghost (leaf nodes only).
+        unsigned int& owner(unsigned int node) { return owners[node]; }
+        /// The leaf that a ghost mirrors, or NULL_NODE if the leaf isn't a ghost (leaf nodes only).
+        unsigned int owner(unsigned int node) const { return owners[node]; }
 
-        /// The size of the system in each dimension.
-        std::vector<double> boxSize;
+        /// Test whether a node is a leaf.
+        bool isLeaf(unsigned int node) const { return lefts[node] == NULL_NODE; }
 
-        /// The position of the negative minimum image.
-        std::vector<double> negMinImage;
+    private:
+        /// The node bounds.
+        std::vector<BasicAABB<D>, AlignedAllocator<BasicAABB<D> > > aabbs;
 
-        /// The position of the positive minimum image.
-        std::vector<double> posMinImage;
+        /// The parent of each node.
+        std::vector<unsigned int, AlignedAllocator<unsigned int> > parents;
 
-        /// A map between particle and node indices.
-        std::unordered_map<unsigned int, unsigned int> particleMap;
+        /// The next node in the free list.
+        std::vector<unsigned int, AlignedAllocator<unsigned int> > nexts;
 
-        /// Does touching count as overlapping in tree queries?
-        bool touchIsOverlap;
+        /// The left-hand child of each node.
+        std::vector<unsigned int, AlignedAllocator<unsigned int> > lefts;
 
-        //! Allocate a new node.
-        /*! \return
-                The index of the allocated node.
-         */
-        unsigned int allocateNode();
+        /// The right-hand child of each node.
+        std::vector<unsigned int, AlignedAllocator<unsigned int> > rights;
 
-        //! Free an existing node.
-        /*! \param node
-                The index of the node to be freed.
-         */
-        void freeNode(unsigned int);
+        /// The height of each node.
+        std::vector<int, AlignedAllocator<int> > heights;
 
-        //! Insert a leaf into the tree.
-        /*! \param leaf
-                The index of the leaf node.
+        /// The particle held by each node.
+        std::vector<unsigned int, AlignedAllocator<unsigned int> > particles;
+
+        /// The centre of each spherical particle.
+        std::vector<typename VectorTraits<D>::Vector> positions;
+
+        /// The radius of each spherical particle.
+        std::vector<double> radii;
+
+        /// The skin thickness of each leaf.
+        std::vector<double> skins;
+
+        /// The number of updates since each leaf was inserted.
+        std::vector<unsigned int> ages;
+
+        /// The ghost chain of each leaf.
+        std::vector<unsigned int> ghosts;
+
+        /// The leaf mirrored by each ghost.
+        std::vector<unsigned int> owners;
+    };
+
+    /*! \brief A map from particle indices to leaf nodes.
+
+        With ParticleIndex::Dense the node of each particle is stored in a
+        vector indexed by the particle, which grows as needed, so memory use
+        scales with the largest index. With ParticleIndex::Sparse the entries
+        are held in a single flat array using open addressing with linear
+        probing, so there is no per-particle allocation or pointer chasing
+        as there is with std::unordered_map. Lookups are const and so can
+        be made concurrently. NULL_NODE marks an empty slot, so it can't be
+        used as a particle index.
+     */
+    class ParticleMap
+    {
+    public:
+        //! Constructor.
+        /*! \param index_
+                The method used to map particles to nodes.
          */
-        void insertLeaf(unsigned int);
+        explicit ParticleMap(ParticleIndex index_ = ParticleIndex::Sparse) :
+            index(index_), nEntries(0), shift(32)
+        {
+        }
 
-        //! Remove a leaf from the tree.
-        /*! \param leaf
-                The index of the leaf node.
+        //! Find the node of a particle.
+        /*! \param particle
+                The particle index.
+
+            \return
+                The index of the node, or NULL_NODE if the particle isn't mapped.
          */
-        void removeLeaf(unsigned int);
+        unsigned int find(unsigned int particle) const
+        {
+            if (index == ParticleIndex::Dense)
+                return (particle < nodes.size()) ? nodes[particle] : NULL_NODE;
 
-        //! Balance the tree.
-        /*! \param node
+            if (nEntries == 0) return NULL_NODE;
+
+            for (unsigned int i=hash(particle);;i=(i + 1) & (entries.size() - 1))
+            {
+                if (entries[i].particle == particle) return entries[i].node;
+                if (entries[i].particle == NULL_NODE) return NULL_NODE;
+            }
+        }
+
+        //! Map a particle to a node.
+        /*! \param particle
+                The particle index.
+
+            \param node
                 The index of the node.
+
+            \return
+                Whether the particle was inserted, i.e. it wasn't already mapped.
          */
-        unsigned int balance(unsigned int);
+        bool insert(unsigned int particle, unsigned int node)
+        {
+            if (particle == NULL_NODE)
+            {
+                throw std::invalid_argument("[ERROR]: Particle index 0xffffffff is reserved!");
+            }
 
-        //! Compute the height of the tree.
-        /*! \return
-                The height of the entire tree.
+            if (index == ParticleIndex::Dense)
+            {
+                if (particle >= nodes.size()) nodes.resize(particle + 1, NULL_NODE);
+                if (nodes[particle] != NULL_NODE) return false;
+
+                nodes[particle] = node;
+                nEntries++;
+
+                return true;
+            }
+
+            // Keep the load factor below one half.
+            if (2*(nEntries + 1) > entries.size()) rehash(std::max(16u, unsigned(2*entries.size())));
+
+            unsigned int i = hash(particle);
+            while (entries[i].particle != NULL_NODE)
+            {
+                if (entries[i].particle == particle) return false;
+                i = (i + 1) & (entries.size() - 1);
+            }
+
+            entries[i].particle = particle;
+            entries[i].node = node;
+            nEntries++;
+
+            return true;
+        }
+
+        //! Remove a particle from the map.
+        /*! \param particle
+                The particle index.
+
+            \return
+                Whether the particle was mapped.
          */
-        unsigned int computeHeight() const;
+        bool erase(unsigned int particle)
+        {
+            if (index == ParticleIndex::Dense)
+            {
+                if ((particle >= nodes.size()) || (nodes[particle] == NULL_NODE)) return false;
 
-        //! Compute the height of a sub-tree.
-        /*! \param node
-                The index of the root node.
+                nodes[particle] = NULL_NODE;
+                nEntries--;
+
+                return true;
+            }
+
+            if (nEntries == 0) return false;
+
+            unsigned int mask = entries.size() - 1;
+            unsigned int i = hash(particle);
+            while (entries[i].particle != particle)
+            {
+                if (entries[i].particle == NULL_NODE) return false;
+                i = (i + 1) & mask;
+            }
+
+            // Shift later entries in the probe sequence back into the gap,
+            // rather than leaving a tombstone.
+            for (unsigned int j=(i + 1) & mask;entries[j].particle!=NULL_NODE;j=(j + 1) & mask)
+            {
+                unsigned int home = hash(entries[j].particle);
+
+                // Move the entry if its home slot doesn't lie in (i, j].
+                if (((j - home) & mask) >= ((j - i) & mask))
+                {
+                    entries[i] = entries[j];
+                    i = j;
+                }
+            }
+
+            entries[i].particle = NULL_NODE;
+            nEntries--;
+
+            return true;
+        }
+
+        /// Return the number of mapped particles.
+        unsigned int size() const { return nEntries; }
+
+        /// Remove all particles from the map.
+        void clear()
+        {
+            nodes.clear();
+            entries.clear();
+            nEntries = 0;
+            shift = 32;
+        }
+
+        //! Reserve space for a number of particles.
+        /*! \param n
+                The number of particles.
+         */
+        void reserve(unsigned int n)
+        {
+            if (index == ParticleIndex::Dense)
+            {
+                if (n > nodes.size()) nodes.resize(n, NULL_NODE);
+            }
+            else
+            {
+                unsigned int capacity = 16;
+                while (capacity < 2*n) capacity *= 2;
+
+                if (capacity > entries.size()) rehash(capacity);
+            }
+        }
+
+        /// Return the method used to map particles to nodes.
+        ParticleIndex getIndex() const { return index; }
+
+    private:
+        /// A slot in the hash table.
+        struct Entry
+        {
+            /// The particle index, or NULL_NODE for an empty slot.
+            unsigned int particle;
+
+            /// The index of the node.
+            unsigned int node;
+        };
+
+        /// The method used to map particles to nodes.
+        ParticleIndex index;
+
+        /// The number of mapped particles.
+        unsigned int nEntries;
+
+        /// The shift that maps a hash onto a slot in the table.
+        unsigned int shift;
+
+        /// The node of each particle (dense index).
+        std::vector<unsigned int> nodes;
+
+        /// The hash table (sparse index), whose size is a power of two.
+        std::vector<Entry> entries;
+
+        //! Compute the home slot of a particle (Fibonacci hashing).
+        /*! \param particle
+                The particle index.
 
             \return
-                The height of the sub-tree.
+                The slot index.
          */
-        unsigned int computeHeight(unsigned int) const;
+        unsigned int hash(unsigned int particle) const
+        {
+            return unsigned(uint32_t(particle * 2654435769u) >> shift);
+        }
 
-        //! Assert that the sub-tree has a valid structure.
-        /*! \param node
-                The index of the root node.
+        //! Resize the hash table, reinserting the entries.
+        /*! \param capacity
+                The new number of slots (a power of two).
          */
-        void validateStructure(unsigned int) const;
+        void rehash(unsigned int capacity)
+        {
+            std::vector<Entry> oldEntries(capacity, Entry{NULL_NODE, NULL_NODE});
+            oldEntries.swap(entries);
 
-        //! Assert that the sub-tree has valid metrics.
-        /*! \param node
-                The index of the root node.
+            shift = 32;
+            for (unsigned int i=capacity;i>1;i/=2) shift--;
+
+            for (unsigned int i=0;i<oldEntries.size();i++)
+            {
+                if (oldEntries[i].particle == NULL_NODE) continue;
+
+                unsigned int j = hash(oldEntries[i].particle);
+                while (entries[j].particle != NULL_NODE) j = (j + 1) & (capacity - 1);
+
+                entries[j] = oldEntries[i];
+            }
+        }
+    };
+
+    /*! \brief A node of a tree snapshot under construction.
+
+        The nodes of a tree are copied into this form, with ghost leaves
+        removed, before a snapshot is built from them.
+     */
+    template <unsigned int D>
+    struct BasicSnapshotNode
+    {
+        /// The AABB of the node.
+        BasicAABB<D> aabb;
+
+        /// The left-hand child, or NULL_NODE for a leaf.
+        unsigned int left;
+
+        /// The right-hand child, or NULL_NODE for a leaf.
+        unsigned int right;
+
+        /// The particle held by a leaf.
+        unsigned int particle;
+    };
+
+    /*! \brief A compressed, read-only snapshot of an AABB tree.
+
+        See BasicCompressedTree below.
+     */
+    template <unsigned int D, class Offset = std::uint16_t>
+    class BasicCompressedTree;
+
+    /*! \brief A read-only snapshot of an AABB tree with a wide branching factor.
+
+        See BasicWideTree below.
+     */
+    template <unsigned int D, unsigned int Width = 4>
+    class BasicWideTree;
+
+    /*! \brief The dynamic AABB tree.
+
+        The dynamic AABB tree is a hierarchical data structure that can be used
+        to efficiently query overlaps between objects of arbitrary shape and
+        size that lie inside of a simulation box. Support is provided for
+        periodic and non-periodic boxes, as well as boxes with partial
+        periodicity, e.g. periodic along specific axes.
+
+        The template parameter sets the dimensionality of the system. Fixed
+        dimensionalities, e.g. BasicTree<2> and BasicTree<3>, store all node
+        bounds inline so that tree operations are free of heap allocation.
+        D = 0 selects the run-time dimensionality, which is available through
+        the Tree typedef.
+
+        The second template parameter selects the node memory layout, either
+        AoS (the default) or SoA. See NodePool for details.
+
+        Thread safety: all const member functions, i.e. queries and
+        inspection of the tree, only read from the tree and use no shared
+        scratch storage. Any number of threads may call them concurrently
+        without locking, provided that no thread modifies the tree (inserts,
+        removes, updates, or rebuilds) at the same time.
+     */
+    template <unsigned int D, class Layout = AoS>
+    class BasicTree
+    {
+    public:
+        /// The AABB type.
+        typedef BasicAABB<D> AABBType;
+
+        /// The position vector type.
+        typedef typename VectorTraits<D>::Vector Vector;
+
+        //! Constructor (non-periodic).
+        /*! \param dimension_
+                The dimensionality of the system.
+
+            \param skinThickness_
+                The skin thickness for fattened AABBs, as a fraction
+                of the AABB base length.
+
+            \param nParticles
+                The number of particles (for fixed particle number systems).
+
+            \param touchIsOverlap
+                Does touching count as overlapping in query operations?
+
+            \param particleIndex
+                How particle indices are mapped to nodes. Use ParticleIndex::Dense
+                when the indices run from 0 to N-1.
          */
-        void validateMetrics(unsigned int) const;
+        BasicTree(unsigned int dimension_= (D == 0 ? 3 : D), double skinThickness_ = 0.05,
+            unsigned int nParticles = 16, bool touchIsOverlap=true,
+            ParticleIndex particleIndex=ParticleIndex::Sparse);
 
-        //! Apply periodic boundary conditions.
-        /* \param position
-                The position vector.
+        //! Constructor (custom periodicity).
+        /*! \param dimension_
+                The dimensionality of the system.
+
+            \param skinThickness_
+                The skin thickness for fattened AABBs, as a fraction
+                of the AABB base length.
+
+            \param periodicity_
+                Whether the system is periodic in each dimension.
+
+            \param boxSize_
+                The size of the simulation box in each dimension.
+
+            \param nParticles
+                The number of particles (for fixed particle number systems).
+
+            \param touchIsOverlap
+                Does touching count as overlapping in query operations?
+
+            \param particleIndex
+                How particle indices are mapped to nodes. Use ParticleIndex::Dense
+                when the indices run from 0 to N-1.
          */
-        void periodicBoundaries(std::vector<double>&);
+        BasicTree(unsigned int, double, const std::vector<bool>&, const std::vector<double>&,
+            unsigned int nParticles = 16, bool touchIsOverlap=true,
+            ParticleIndex particleIndex=ParticleIndex::Sparse);
 
-        //! Compute minimum image separation.
-        /*! \param separation
-                The separation vector.
+        //! Constructor (non-periodic, bulk load).
+        /*! Build a tree from the bounds of a set of particles, indexed from
+            zero in the order given, using the binned SAH builder described
+            in rebuild(). This is much faster than inserting the particles
+            one at a time.
 
-            \param shift
-                The shift vector.
+            \param dimension_
+                The dimensionality of the system.
 
-            \return
-                Whether a periodic shift has been applied.
+            \param skinThickness_
+                The skin thickness for fattened AABBs, as a fraction
+                of the AABB base length.
+
+            \param lowerBounds
+                The lower bound of each particle.
+
+            \param upperBounds
+                The upper bound of each particle.
+
+            \param touchIsOverlap
+                Does touching count as overlapping in query operations?
+
+            \param particleIndex
+                How particle indices are mapped to nodes. Use ParticleIndex::Dense
+                when the indices run from 0 to N-1.
          */
-        bool minimumImage(std::vector<double>&, std::vector<double>&);
-    };
+        BasicTree(unsigned int, double, const std::vector<Vector>&,
+            const std::vector<Vector>&, bool touchIsOverlap=true,
+            ParticleIndex particleIndex=ParticleIndex::Sparse);
+
+        //! Constructor (custom periodicity, bulk load).
+        /*! \param dimension_
+                The dimensionality of the system.
+
+            \param skinThickness_
+                The skin thickness for fattened AABBs, as a fraction
+                of the AABB base length.
+
+            \param periodicity_
+                Whether the system is periodic in each dimension.
+
+            \param boxSize_
+                The size of the simulation box in each dimension.
+
+            \param lowerBounds
+                The lower bound of each particle.
+
+            \param upperBounds
+                The upper bound of each particle.
+
+            \param touchIsOverlap
+                Does touching count as overlapping in query operations?
+
+            \param particleIndex
+                How particle indices are mapped to nodes. Use ParticleIndex::Dense
+                when the indices run from 0 to N-1.
+         */
+        BasicTree(unsigned int, double, const std::vector<bool>&, const std::vector<double>&,
+            const std::vector<Vector>&, const std::vector<Vector>&, bool touchIsOverlap=true,
+            ParticleIndex particleIndex=ParticleIndex::Sparse);
+
+        //! Set the periodicity of the simulation box.
+        /*! \param periodicity_
+                Whether the system is periodic in each dimension.
+         */
+        void setPeriodicity(const std::vector<bool>&);
+
+        //! Set the size of the simulation box.
+        /*! \param boxSize_
+                The size of the simulation box in each dimension.
+         */
+        void setBoxSize(const std::vector<double>&);
+
+        //! Set the method used to restructure the tree on insertion and removal.
+        /*! Balance::Height (the default) keeps the tree height balanced.
+            Balance::SurfaceArea instead applies rotations that reduce the
+            surface area of the tree, which keeps query costs from drifting
+            upward over long dynamic simulations, at the cost of a tree that
+            may be somewhat deeper.
+
+            \param balance_
+                The balancing method.
+         */
+        void setBalance(Balance);
+
+        //! Get the method used to restructure the tree.
+        /*! \return
+                The balancing method.
+         */
+        Balance getBalance() const;
+
+        //! Set the method used by updateParticles to handle escaped particles.
+        /*! Update::Reinsert (the default) removes and reinserts each particle
+            that has moved outside of its fattened AABB. Update::Refit instead
+            writes the new bounds to the leaves and refits every internal node
+            in a single bottom-up pass, leaving the topology unchanged. This
+            is much cheaper when particles move coherently by small amounts,
+            e.g. in molecular dynamics with a small timestep.
+
+            \param update_
+                The update method.
+         */
+        void setUpdate(Update);
+
+        //! Get the method used by updateParticles to handle escaped particles.
+        /*! \return
+                The update method.
+         */
+        Update getUpdate() const;
+
+        //! Set the maximum degradation of the tree allowed when refitting.
+        /*! Refitting in place lets the quality of the tree drift. When the
+            surface area ratio (see computeSurfaceAreaRatio) grows by more than
+            this factor over its value when refitting began, the escaped
+            particles are reinserted, and if that isn't enough (or most of
+            the particles escaped) the tree is rebuilt.
+
+            \param threshold
+                The maximum ratio of the current and initial surface area
+                ratios (must be at least one).
+         */
+        void setRefitThreshold(double);
+
+        //! Get the maximum degradation of the tree allowed when refitting.
+        /*! \return
+                The refit threshold.
+         */
+        double getRefitThreshold() const;
+
+        //! Set whether the skin of each particle adapts to its motion.
+        /*! A fixed skin is a poor fit when particles move at different
+            speeds: fast particles keep escaping their fattened AABBs and are
+            reinserted, while slow particles carry skin that only adds false
+            positives to queries. With an adaptive skin, each time a particle
+            is reinserted its skin is rescaled so that its fattened AABB would
+            have lasted for roughly the target number of updates. Particles
+            that don't escape within four times the target are reinserted with
+            a thinner skin. The skin is kept within a factor of four of the
+            skin thickness passed to the constructor.
+
+            \param isAdaptive
+                Whether the skin is adaptive.
+
+            \param targetAge
+                The target number of updates between reinsertions (default: 10).
+         */
+        void setAdaptiveSkin(bool, unsigned int targetAge=10);
+
+        //! Set whether leaves near periodic boundaries are mirrored as ghosts.
+        /*! With ghosts enabled, every particle whose fattened AABB lies close to
+            a periodic face is also inserted as a ghost leaf, shifted by the box
+            length, for each image that a query inside the box could overlap.
+            Queries then reduce to plain (non-periodic) overlap tests, with no
+            minimum image work at each node, at the cost of a larger tree, so
+            ghosts suit small particles in large boxes. Ghosts are
+            kept up to date as particles are inserted, updated and removed,
+            and results always report the real particle index.
+
+            The ghosts cover queries whose AABBs are no larger than the largest
+            fattened particle AABB. Larger queries fall back on the minimum
+            image tests. Ghosts add to the node count of the tree.
+
+            \param isGhosts_
+                Whether to use ghosts.
+         */
+        void setPeriodicGhosts(bool);
+
+        //! Get whether leaves near periodic boundaries are mirrored as ghosts.
+        /*! \return
+                Whether ghosts are used.
+         */
+        bool getPeriodicGhosts() const;
+
+        //! Set the precision of the node bounds used to cull queries.
+        /*! The bounds of every node are always held in double precision, so
+            that inserting, balancing and refitting are exact. With
+            Precision::Mixed or Precision::Single a copy of the bounds is also
+            kept in single precision, rounded outward so that each float box
+            contains the double box, and in one compact array, less than a
+            third of the size of the node AABBs. Overlap queries (query, queryBatch and
+            anyOverlap) stream through this array rather than the nodes, so
+            no true overlap is ever culled.
+
+            With Precision::Mixed a leaf that passes the float test is then
+            tested exactly, so results are unchanged. With Precision::Single
+            the leaves are tested in float too, so a query may also report
+            particles whose AABBs lie within float rounding of it, e.g. about
+            one part in 10^7 of the coordinates.
+
+            Minimum image tests on periodic boxes, i.e. without ghosts or for
+            queries larger than the ghost width, always use double precision.
+
+            \param precision_
+                The precision of the culling bounds.
+         */
+        void setPrecision(Precision);
+
+        //! Get the precision of the node bounds used to cull queries.
+        /*! \return
+                The precision of the culling bounds.
+         */
+        Precision getPrecision() const;
+
+        //! Get whether the skin of each particle adapts to its motion.
+        /*! \return
+                Whether the skin is adaptive.
+         */
+        bool getAdaptiveSkin() const;
+
+        //! Insert a particle into the tree (point particle).
+        /*! \param index
+                The index of the particle. Any value except NULL_NODE
+                (0xffffffff), which is reserved.
+
+            \param position
+                The position vector of the particle.
+
+            \param radius
+                The radius of the particle.
+         */
+        void insertParticle(unsigned int, const Vector&, double);
+
+        //! Insert a particle into the tree (arbitrary shape with bounding box).
+        /*! \param index
+                The index of the particle. Any value except NULL_NODE
+                (0xffffffff), which is reserved.
+
+            \param lowerBound
+                The lower bound in each dimension.
+
+            \param upperBound
+                The upper bound in each dimension.
+         */
+        void insertParticle(unsigned int, const Vector&, const Vector&);
+
+        /// Return the number of particles in the tree.
+        unsigned int nParticles() const;
+
+        //! Remove a particle from the tree.
+        /*! \param particle
+                The particle index (particleMap will be used to map the node).
+         */
+        void removeParticle(unsigned int);
+
+        /// Remove all particles from the tree.
+        void removeAll();
+
+        //! Update the tree if a particle moves outside its fattened AABB.
+        /*! \param particle
+                The particle index (particleMap will be used to map the node).
+
+            \param position
+                The position vector of the particle.
+
+            \param radius
+                The radius of the particle.
+
+            \param alwaysReinsert
+                Always reinsert the particle, even if it's within its old AABB (default:false)
+
+            \return
+                Whether the particle was reinserted.
+         */
+        bool updateParticle(unsigned int, const Vector&, double, bool alwaysReinsert=false);
+
+        //! Update the tree if a particle moves outside its fattened AABB.
+        /*! \param particle
+                The particle index (particleMap will be used to map the node).
+
+            \param lowerBound
+                The lower bound in each dimension.
+
+            \param upperBound
+                The upper bound in each dimension.
+
+            \param alwaysReinsert
+                Always reinsert the particle, even if it's within its old AABB (default: false)
+         */
+        bool updateParticle(unsigned int, const Vector&, const Vector&, bool alwaysReinsert=false);
+
+        //! Update the tree if a particle moves outside its fattened AABB, predicting its motion.
+        /*! When the particle is reinserted, its fattened AABB is also stretched
+            along the direction of motion by twice the displacement, as in
+            Box2D, so that fast particles escape less often. The particle is
+            also reinserted if its fattened AABB has become much larger than
+            needed, e.g. after the particle slows down.
+
+            \param particle
+                The particle index (particleMap will be used to map the node).
+
+            \param position
+                The position vector of the particle.
+
+            \param radius
+                The radius of the particle.
+
+            \param displacement
+                The displacement of the particle since its last update,
+                e.g. its velocity multiplied by the time step.
+
+            \param alwaysReinsert
+                Always reinsert the particle, even if it's within its old AABB (default:false)
+
+            \return
+                Whether the particle was reinserted.
+         */
+        bool updateParticle(unsigned int, const Vector&, double, const Vector&, bool alwaysReinsert=false);
+
+        //! Update the tree if a particle moves outside its fattened AABB, predicting its motion.
+        /*! \param particle
+                The particle index (particleMap will be used to map the node).
+
+            \param lowerBound
+                The lower bound in each dimension.
+
+            \param upperBound
+                The upper bound in each dimension.
+
+            \param displacement
+                The displacement of the particle since its last update.
+
+            \param alwaysReinsert
+                Always reinsert the particle, even if it's within its old AABB (default: false)
+
+            \return
+                Whether the particle was reinserted.
+         */
+        bool updateParticle(unsigned int, const Vector&, const Vector&, const Vector&, bool alwaysReinsert=false);
+
+        //! Update the bounds of many particles at once.
+        /*! The particles that have moved outside of their fattened AABBs are
+            found in parallel. They are then removed from the tree and
+            reinserted, and each affected ancestor is refit (and rebalanced)
+            once at the end, rather than walking back up to the root for every
+            particle. When refitting is enabled (see setUpdate) the escaped
+            particles instead keep their place in the tree.
+
+            The bounds are read from raw buffers, where the bound of particle i
+            along axis j is found at offset i*particleStride + j*axisStride.
+            For packed data, e.g. x0 y0 z0 x1 y1 z1 ..., use the defaults; for a structure-of-arrays
+            layout, with one array per axis, set particleStride to 1 and
+            axisStride to the number of particles. All particles and bounds are
+            validated before the tree is modified. As with updateParticle, the
+            particles are no longer described by spheres, so queries test
+            their AABBs; use the overload taking radii to keep the spheres.
+
+            \param particles
+                The particle indices.
+
+            \param lowerBounds
+                The lower bounds buffer.
+
+            \param upperBounds
+                The upper bounds buffer.
+
+            \param particleStride
+                The offset between particles (default: the dimensionality).
+
+            \param axisStride
+                The offset between axes (default: 1).
+
+            \param nThreads
+                The number of threads (zero for hardware concurrency).
+
+            \return
+                The indices of the particles that moved outside of their
+                fattened AABBs.
+         */
+        std::vector<unsigned int> updateParticles(const std::vector<unsigned int>&, const double*,
+            const double*, unsigned int particleStride=0, unsigned int axisStride=1, unsigned int nThreads=0);
+
+        //! Update the positions and radii of many particles at once.
+        /*! As above, but for spherical particles, whose positions are read
+            from a raw buffer with the same layout as the bounds. The spheres
+            are stored for exact overlap tests.
+
+            \param particles
+                The particle indices.
+
+            \param positions
+                The positions buffer.
+
+            \param radii
+                The radius of each particle.
+
+            \param particleStride
+                The offset between particles (default: the dimensionality).
+
+            \param axisStride
+                The offset between axes (default: 1).
+
+            \param nThreads
+                The number of threads (zero for hardware concurrency).
+
+            \return
+                The indices of the particles that moved outside of their
+                fattened AABBs.
+         */
+        std::vector<unsigned int> updateParticles(const std::vector<unsigned int>&, const double*,
+            const std::vector<double>&, unsigned int particleStride=0, unsigned int axisStride=1,
+            unsigned int nThreads=0);
+
+        //! Query the tree to find candidate interactions for a particle.
+        /*! \param particle
+                The particle index.
+
+            \return particles
+                A vector of particle indices.
+         */
+        std::vector<unsigned int> query(unsigned int) const;
+
+        //! Query the tree to find candidate interactions for an AABB.
+        /*! \param particle
+                The particle index.
+
+            \param aabb
+                The AABB.
+
+            \return particles
+                A vector of particle indices.
+         */
+        std::vector<unsigned int> query(unsigned int, const AABBType&) const;
+
+        //! Query the tree to find candidate interactions for an AABB.
+        /*! \param aabb
+                The AABB.
+
+            \return particles
+                A vector of particle indices.
+         */
+        std::vector<unsigned int> query(const AABBType&) const;
+
+        //! Visit all particles whose AABBs overlap an AABB.
+        /*! The traversal uses a fixed-size stack and makes no heap
+            allocations, so it is suited to tight simulation loops.
+
+            \param aabb
+                The AABB.
+
+            \param callback
+                A callable, bool(unsigned int particle), invoked for each
+                overlapping particle. Return false to stop the traversal.
+         */
+        template <class Callback>
+        void query(const AABBType&, Callback&&) const;
+
+        //! Visit all particles whose AABBs overlap an AABB.
+        /*! \param particle
+                The particle index. This particle is excluded from the
+                results.
+
+            \param aabb
+                The AABB.
+
+            \param callback
+                A callable, bool(unsigned int particle), invoked for each
+                overlapping particle. Return false to stop the traversal.
+         */
+        template <class Callback>
+        void query(unsigned int, const AABBType&, Callback&&) const;
+
+        //! Query the tree for particles that overlap a sphere.
+        /*! \param position
+                The centre of the sphere.
+
+            \param radius
+                The radius of the sphere.
+
+            \return particles
+                A vector of particle indices.
+         */
+        std::vector<unsigned int> queryRadius(const Vector&, double) const;
+
+        //! Visit all particles that overlap a sphere.
+        /*! Internal nodes are pruned by the squared distance from the centre
+            of the sphere to their AABBs, which is tighter than an AABB overlap
+            test. Particles inserted, or last updated, as spheres are then
+            tested exactly against their stored centre and radius, and others
+            against their fattened AABB, so no filtering is needed afterwards.
+            To find the particles whose centres lie within a distance of a
+            point, pass that distance as the radius and store particles with
+            zero radius. Minimum image separations are used for periodic boxes.
+
+            \param position
+                The centre of the sphere.
+
+            \param radius
+                The radius of the sphere.
+
+            \param callback
+                A callable, bool(unsigned int particle), invoked for each
+                overlapping particle. Return false to stop the traversal.
+         */
+        template <class Callback>
+        void queryRadius(const Vector&, double, Callback&&) const;
+
+        //! Find all pairs of particles whose AABBs overlap.
+        /*! The tree is traversed against itself, descending simultaneously
+            into pairs of subtrees whose bounds overlap, so each overlapping
+            pair is found once (rather than twice, as when querying each
+            particle in turn). Periodicity and touchIsOverlap are respected,
+            so the pairs match those found by query(particle).
+
+            \param callback
+                A callable, bool(unsigned int particle1, unsigned int particle2),
+                that is invoked for each overlapping pair. Return false to stop
+                the search.
+         */
+        template <class Callback>
+        void queryAllPairs(Callback&&) const;
+
+        //! Find all pairs of particles whose AABBs overlap, in parallel.
+        /*! As above, but the traversal is split into independent pairs of
+            subtrees that are processed by a set of worker threads. The
+            callback is invoked concurrently from the workers, so it must be
+            thread safe, and pairs are reported in no particular order. When
+            the callback returns false the workers stop as soon as possible,
+            although other pairs may still be reported in the meantime.
+
+            \param callback
+                A callable, bool(unsigned int particle1, unsigned int particle2),
+                that is invoked for each overlapping pair. Return false to stop
+                the search.
+
+            \param nThreads
+                The number of threads (zero for hardware concurrency).
+         */
+        template <class Callback>
+        void queryAllPairs(Callback&&, unsigned int nThreads) const;
+
+        //! Find all overlapping pairs of particles between this tree and another.
+        /*! Both trees are descended simultaneously, so the cost scales with
+            the number of overlapping pairs rather than requiring a query of
+            this tree for each particle in the other. The trees must share the
+            same simulation box, i.e. have the same dimensionality, periodicity,
+            and box size. The touchIsOverlap setting of this tree is used.
+
+            \param other
+                The other tree.
+
+            \param callback
+                A callable, bool(unsigned int particle, unsigned int otherParticle),
+                that is invoked for each overlapping pair, where particle is in
+                this tree and otherParticle is in the other. Return false to stop
+                the search.
+         */
+        template <class Callback>
+        void queryOverlaps(const BasicTree&, Callback&&) const;
+
+        //! Query the tree for many AABBs in parallel.
+        /*! The queries are distributed over a set of worker threads. Results
+            are written in compressed sparse row (CSR) form: the particles
+            overlapping query i are indices[offsets[i]] to
+            indices[offsets[i+1] - 1]. The output vectors are resized as
+            needed, so reusing them between calls avoids reallocation. The
+            tree must not be modified while the batch is running.
+
+            \param aabbs
+                The AABBs to query.
+
+            \param offsets
+                The CSR row offsets (resized to aabbs.size() + 1).
+
+            \param indices
+                The CSR particle indices.
+
+            \param nThreads
+                The number of threads (default: hardware concurrency).
+         */
+        void queryBatch(const std::vector<AABBType>&, std::vector<unsigned int>&,
+            std::vector<unsigned int>&, unsigned int nThreads=0) const;
+
+        //! Query the tree for the neighbours of many particles in parallel.
+        /*! As above, but each query uses the fattened AABB of a particle in
+            the tree, with the particle itself excluded from its results,
+            i.e. row i matches query(particles[i]).
+
+            \param particles
+                The particle indices.
+
+            \param offsets
+                The CSR row offsets (resized to particles.size() + 1).
+
+            \param indices
+                The CSR particle indices.
+
+            \param nThreads
+                The number of threads (default: hardware concurrency).
+         */
+        void queryBatch(const std::vector<unsigned int>&, std::vector<unsigned int>&,
+            std::vector<unsigned int>&, unsigned int nThreads=0) const;
+
+        //! Test whether a sphere overlaps any particle in the tree.
+        /*! Candidate leaves are found by AABB overlap, then tested exactly
+            against the centre and radius stored when the particle was
+            inserted, or last updated, as a sphere. Minimum image separations
+            are used for periodic boxes. The search stops at the first true
+            overlap. Particles inserted or updated using AABB bounds have no
+            stored sphere and count as overlapping if their fattened AABB
+            overlaps the sphere's AABB.
+
+            \param position
+                The centre of the sphere.
+
+            \param radius
+                The radius of the sphere.
+
+            \return
+                Whether the sphere overlaps any particle.
+         */
+        bool anyOverlap(const Vector&, double) const;
+
+        //! Test whether a sphere overlaps any particle in the tree.
+        /*! \param particle
+                The particle index. This particle is excluded from the test,
+                e.g. when testing a trial move of the particle itself.
+
+            \param position
+                The centre of the sphere.
+
+            \param radius
+                The radius of the sphere.
+
+            \return
+                Whether the sphere overlaps any other particle.
+         */
+        bool anyOverlap(unsigned int, const Vector&, double) const;
+
+        //! Cast a ray through the tree, visiting the particles that it hits.
+        /*! The ray is the set of points origin + t*direction, for t between
+            zero and maxT. Nodes are visited front to back using slab tests,
+            and subtrees that the ray enters beyond maxT are pruned. Particles
+            inserted, or last updated, as spheres are tested exactly, with t
+            giving the point where the ray enters the sphere (zero if the
+            origin lies inside). Others are reported where the ray enters
+            their fattened AABB.
+
+            The callback returns the new value of maxT, so subtrees lying
+            beyond it are skipped. Return maxT unchanged to visit every hit,
+            t to search for the closest hit, or a negative value to stop.
+
+            In periodic boxes the ray is unwrapped across the periodic
+            images of the tree, so a long ray can hit the same particle more
+            than once, at different values of t. The ray must then have a
+            finite length along periodic axes.
+
+            \param origin
+                The origin of the ray.
+
+            \param direction
+                The direction of the ray (need not be normalised).
+
+            \param maxT
+                The maximum value of the ray parameter.
+
+            \param callback
+                A callable, double(unsigned int particle, double t), invoked
+                for each hit.
+         */
+        template <class Callback>
+        void rayCast(const Vector&, const Vector&, double, Callback&&) const;
+
+        //! Find the particles nearest to a point.
+        /*! The tree is searched best first: nodes are visited in order of the
+            distance from the point to their AABBs, and the search stops once
+            no remaining node can be nearer than the kth nearest particle found.
+            Distances are measured to the centre of each particle, i.e. the
+            position stored when it was inserted, or last updated, as a sphere,
+            or else the centre of its fattened AABB. Minimum image separations
+            are used for periodic boxes.
+
+            \param point
+                The point.
+
+            \param k
+                The number of particles to find.
+
+            \return
+                The indices of the (at most) k nearest particles, nearest first.
+         */
+        std::vector<unsigned int> nearest(const Vector&, unsigned int) const;
+
+        //! Find the particles nearest to a point, using a custom distance.
+        /*! As above, but the distance to each candidate particle is supplied by
+            the caller, e.g. to measure to the surface of non-spherical particles.
+            The distance is used to bound the search, so it must be no less than
+            the (minimum image) distance from the point to the particle's AABB,
+            i.e. the particle must lie within its AABB.
+
+            \param point
+                The point.
+
+            \param k
+                The number of particles to find.
+
+            \param distance
+                A callable, double(unsigned int particle), that returns the
+                squared distance from the point to the particle.
+
+            \return
+                The indices of the (at most) k nearest particles, nearest first.
+         */
+        template <class Distance>
+        std::vector<unsigned int> nearest(const Vector&, unsigned int, Distance&&) const;
+
+        //! Find the nearest neighbours of many particles in parallel.
+        /*! Each row holds the (at most) k particles nearest to the centre of
+            a particle, nearest first, excluding the particle itself, i.e. the
+            k-nearest-neighbour graph of the particles. Results are written in
+            compressed sparse row (CSR) form, as for queryBatch. The tree must
+            not be modified while the batch is running.
+
+            \param particles
+                The particle indices.
+
+            \param k
+                The number of neighbours of each particle.
+
+            \param offsets
+                The CSR row offsets (resized to particles.size() + 1).
+
+            \param indices
+                The CSR particle indices.
+
+            \param nThreads
+                The number of threads (default: hardware concurrency).
+         */
+        void nearestBatch(const std::vector<unsigned int>&, unsigned int, std::vector<unsigned int>&,
+            std::vector<unsigned int>&, unsigned int nThreads=0) const;
+
+        //! Get a particle AABB.
+        /*! \param particle
+                The particle index.
+         */
+        const AABBType& getAABB(unsigned int) const;
+
+        //! Get the height of the tree.
+        /*! \return
+                The height of the binary tree.
+         */
+        unsigned int getHeight() const;
+
+        //! Get the number of nodes in the tree.
+        /*! \return
+                The number of nodes in the tree.
+         */
+        unsigned int getNodeCount() const;
+
+        //! Compute the maximum balancance of the tree.
+        /*! \return
+                The maximum difference between the height of two
+                children of a node.
+         */
+        unsigned int computeMaximumBalance() const;
+
+        //! Compute the surface area ratio of the tree.
+        /*! \return
+                The ratio of the sum of the node surface area to the surface
+                area of the root node.
+         */
+        double computeSurfaceAreaRatio() const;
+
+        /// Validate the tree.
+        void validate() const;
+
+        //! Rebuild an optimal tree.
+        /*! The tree is rebuilt top down using a binned surface area heuristic
+            (SAH): the leaves of each node are binned by their centres along
+            the axis of greatest spread, and split at the bin boundary that
+            minimises the surface area of the children weighted by their
+            particle counts. Large subtrees are built in parallel.
+
+            \param nThreads
+                The number of threads (zero for hardware concurrency).
+         */
+        void rebuild(unsigned int nThreads=0);
+
+        //! Rebuild the tree as a linear BVH (LBVH).
+        /*! The leaf centres are quantised onto a grid spanning the simulation
+            box (or the extent of the centres along non-periodic axes) and
+            sorted by their Morton codes using a parallel radix sort. The
+            hierarchy is then emitted by splitting ranges of sorted codes at
+            their highest differing bit. This is considerably faster than
+            rebuild(), at the cost of a lower quality tree, so is well suited
+            to frames where most particles have moved a long way, e.g. after
+            rescaling the box.
+
+            \param nThreads
+                The number of threads (zero for hardware concurrency).
+         */
+        void rebuildLinear(unsigned int nThreads=0);
+
+        //! Save the tree to a binary file.
+        /*! The file holds the settings of the tree, e.g. its periodicity,
+            box size and skin, along with every node in the pool, the root
+            and the free list, so that load() restores the tree exactly,
+            without reinserting any particles. Values are stored in the byte
+            order of the machine writing the file.
+
+            \param fileName
+                The path of the file.
+         */
+        void save(const std::string&) const;
+
+        //! Load a tree saved with save(), replacing the contents of this one.
+        /*! The file is read in one go. The particle map and any
+            single-precision bounds are rebuilt from the nodes. The structure
+            of the tree and its free list are checked before this tree is
+            replaced, so a corrupt file throws and leaves it untouched.
+
+            \param fileName
+                The path of the file.
+         */
+        void load(const std::string&);
+
+    private:
+        /// The snapshots read the nodes directly.
+        template <unsigned int, class> friend class BasicCompressedTree;
+        template <unsigned int, unsigned int> friend class BasicWideTree;
+
+        /// The size of the fixed traversal stack used by queries.
+        static const unsigned int STACK_SIZE = 64;
+
+        /// The version of the file format written by save().
+        static const std::uint32_t FILE_VERSION = 1;
+
+        /// The factor by which fattened AABBs are stretched along a particle's displacement.
+        static constexpr double DISPLACEMENT_MULTIPLIER = 2.0;
+
+        /// The factor by which the skin can grow or shrink relative to the skin thickness.
+        static constexpr double SKIN_RANGE = 4.0;
+
+        /// The factor by which the ghost width exceeds the largest leaf.
+        static constexpr double GHOST_MARGIN = 1.25;
+
+        /// The number of bins used to evaluate SAH splits.
+        static const unsigned int SAH_BINS = 16;
+
+        /// The minimum number of particles in a subtree built on its own thread.
+        static const unsigned int PARALLEL_BUILD_SIZE = 4096;
+
+        /// A leaf and its Morton code, used when building a linear BVH.
+        struct MortonLeaf
+        {
+            /// The Morton code of the leaf centre.
+            uint64_t code;
+
+            /// The index of the leaf node.
+            unsigned int node;
+        };
+
+        /// A leaf and a copy of its AABB, stored contiguously while building the tree.
+        struct BuildLeaf
+        {
+            /// The AABB of the leaf.
+            AABBType aabb;
+
+            /// The index of the leaf node.
+            unsigned int node;
+        };
+
+        /// The index of the root node.
+        unsigned int root;
+
+        /// The dynamic tree.
+        NodePool<D, Layout> nodes;
+
+        /// The current number of nodes in the tree.
+        unsigned int nodeCount;
+
+        /// The current node capacity.
+        unsigned int nodeCapacity;
+
+        /// The position of node at the top of the free list.
+        unsigned int freeList;
+
+        /// The dimensionality of the system.
+        unsigned int dimension;
+
+        /// Whether the system is periodic along at least one axis.
+        bool isPeriodic;
+
+        /// The skin thickness of the fattened AABBs, as a fraction of the AABB base length.
+        double skinThickness;
+
+        /// Whether the system is periodic along each axis.
+        std::vector<bool> periodicity;
+
+        /// The size of the system in each dimension.
+        Vector boxSize;
+
+        /// The period along each axis: the box size if periodic, otherwise zero.
+        Vector periods;
+
+        /// The position of the negative minimum image.
+        Vector negMinImage;
+
+        /// The position of the positive minimum image.
+        Vector posMinImage;
+
+        /// A map between particle and node indices.
+        ParticleMap particleMap;
+
+        /// Does touching count as overlapping in tree queries?
+        bool touchIsOverlap;
+
+        /// The method used to restructure the tree.
+        Balance balanceMethod;
+
+        /// The method used to handle escaped particles in batched updates.
+        Update updateMethod;
+
+        /// The maximum relative growth in the surface area ratio when refitting.
+        double refitThreshold;
+
+        /// The surface area ratio when refitting began (zero if not yet known).
+        double refitReference;
+
+        /// Whether the skin of each particle adapts to its motion.
+        bool isAdaptiveSkin;
+
+        /// The target number of updates between reinsertions with an adaptive skin.
+        unsigned int targetAge;
+
+        /// Whether leaves near periodic boundaries are mirrored as ghosts.
+        bool isGhosts;
+
+        /// The distance from each periodic face within which leaves are mirrored.
+        Vector ghostWidth;
+
+        /// The precision of the node bounds used to cull queries.
+        Precision precision;
+
+        /// The node bounds in single precision, rounded outward: the lower then upper bound of each node.
+        std::vector<float, AlignedAllocator<float> > floatBounds;
+
+        //! Allocate a new node.
+        /*! \return
+                The index of the allocated node.
+         */
+        unsigned int allocateNode();
+
+        //! Free an existing node.
+        /*! \param node
+                The index of the node to be freed.
+         */
+        void freeNode(unsigned int);
+
+        //! Free the internal nodes of the tree, collecting its leaves.
+        /*! \param leaves
+                The indices of the leaf nodes.
+         */
+        void collectLeaves(std::vector<unsigned int>&);
+
+        //! Sort leaves by their Morton codes using a parallel LSD radix sort.
+        /*! \param leaves
+                The leaves to sort.
+
+            \param nThreads
+                The number of threads.
+         */
+        void sortMorton(std::vector<MortonLeaf>&, unsigned int) const;
+
+        //! Build a linear BVH subtree from a range of leaves sorted by Morton code.
+        /*! \param leaves
+                Pointer to the first leaf in the range.
+
+            \param nLeaves
+                The number of leaves in the range.
+
+            \param slots
+                Pointer to the internal nodes reserved for the subtree.
+
+            \param parent
+                The parent of the subtree.
+
+            \param nThreads
+                The number of threads available to build the subtree.
+
+            \return
+                The index of the root node of the subtree.
+         */
+        unsigned int buildMorton(const MortonLeaf*, unsigned int, const unsigned int*,
+            unsigned int, unsigned int);
+
+        //! Run a worker function on a number of threads.
+        /*! The calling thread is used as one of the workers.
+
+            \param nThreads
+                The number of threads.
+
+            \param worker
+                A callable, void(unsigned int thread), where thread runs
+                from zero to nThreads - 1.
+         */
+        template <class Worker>
+        static void runParallel(unsigned int, const Worker&);
+
+        //! Load particles from their bounds and build the tree.
+        /*! \param lowerBounds
+                The lower bound of each particle.
+
+            \param upperBounds
+                The upper bound of each particle.
+         */
+        void bulkLoad(const std::vector<Vector>&, const std::vector<Vector>&);
+
+        //! Build the tree top down from a set of leaves.
+        /*! \param leaves
+                The indices of the leaf nodes.
+
+            \param nThreads
+                The number of threads (zero for hardware concurrency).
+         */
+        void buildTree(const std::vector<unsigned int>&, unsigned int);
+
+        //! Build a subtree from a range of leaves.
+        /*! \param leaves
+                Pointer to the first leaf in the range.
+
+            \param nLeaves
+                The number of leaves in the range.
+
+            \param slots
+                Pointer to the internal nodes reserved for the subtree. A range of
+                n leaves uses n - 1 internal nodes.
+
+            \param parent
+                The parent of the subtree.
+
+            \param nThreads
+                The number of threads available to build the subtree.
+
+            \param bins
+                Scratch storage for the SAH bins.
+
+            \return
+                The index of the root node of the subtree.
+         */
+        unsigned int buildRange(BuildLeaf*, unsigned int, const unsigned int*,
+            unsigned int, unsigned int, std::vector<AABBType>&);
+
+        //! Compute the bounds of a range of leaves and partition it using the SAH.
+        /*! \param leaves
+                Pointer to the first leaf in the range.
+
+            \param nLeaves
+                The number of leaves in the range.
+
+            \param node
+                The internal node that will hold the range.
+
+            \param bins
+                Scratch storage for the SAH bins.
+
+            \return
+                The number of leaves in the left partition.
+         */
+        unsigned int splitRange(BuildLeaf*, unsigned int, unsigned int, std::vector<AABBType>&);
+
+        //! Insert a leaf into the tree.
+        /*! \param leaf
+                The index of the leaf node.
+         */
+        void insertLeaf(unsigned int);
+
+        //! Find the best sibling for a new leaf, i.e. the node with the lowest SAH cost.
+        /*! \param leafAABB
+                The fattened AABB of the leaf.
+
+            \return
+                The index of the sibling node.
+         */
+        unsigned int findSibling(const AABBType&) const;
+
+        //! Attach a leaf to the tree, creating a new parent with its sibling.
+        /*! Ancestors of the new parent aren't refit.
+
+            \param leaf
+                The index of the leaf node.
+
+            \param sibling
+                The index of the sibling node.
+
+            \return
+                The index of the new parent node.
+         */
+        unsigned int attachLeaf(unsigned int, unsigned int);
+
+        //! Detach a leaf from the tree, freeing its parent.
+        /*! Ancestors of the leaf aren't refit.
+
+            \param leaf
+                The index of the leaf node.
+
+            \return
+                The index of the lowest ancestor whose bounds are stale,
+                or NULL_NODE if there is none.
+         */
+        unsigned int detachLeaf(unsigned int);
+
+        //! Remove a set of leaves and reinsert them with their current AABBs.
+        /*! Affected ancestors are refit and rebalanced once, children first.
+
+            \param leaves
+                The indices of the leaf nodes.
+         */
+        void reinsertLeaves(const std::vector<unsigned int>&);
+
+        //! Refit every internal node, children first, keeping the topology.
+        /*! \return
+                The surface area ratio of the refit tree.
+         */
+        double refitAll();
+
+        //! Update a leaf if its particle moves outside the fattened AABB.
+        /*! \param leaf
+                The index of the leaf node.
+
+            \param lowerBound
+                The lower bound in each dimension.
+
+            \param upperBound
+                The upper bound in each dimension.
+
+            \param displacement
+                Pointer to the displacement of the particle, or nullptr if unknown.
+
+            \param alwaysReinsert
+                Always reinsert the leaf, even if it's within its old AABB.
+
+            \return
+                Whether the leaf was reinserted.
+         */
+        bool updateLeaf(unsigned int, const Vector&, const Vector&, const Vector*, bool);
+
+        //! Update the leaves of many particles at once.
+        /*! \param particles
+                The particle indices.
+
+            \param first
+                The lower bounds buffer, or the positions buffer for spheres.
+
+            \param second
+                The upper bounds buffer, unused for spheres.
+
+            \param radii
+                The radius of each sphere, or nullptr if the particles are
+                described by their bounds.
+
+            \param particleStride
+                The offset between particles.
+
+            \param axisStride
+                The offset between axes.
+
+            \param nThreads
+                The number of threads (zero for hardware concurrency).
+
+            \return
+                The indices of the particles that moved outside of their
+                fattened AABBs.
+         */
+        std::vector<unsigned int> updateLeaves(const std::vector<unsigned int>&, const double*,
+            const double*, const double*, unsigned int, unsigned int, unsigned int);
+
+        //! Fatten an AABB by a skin, optionally stretching it along a displacement.
+        /*! The surface area and centre of the AABB are updated.
+
+            \param aabb
+                The AABB to fatten.
+
+            \param skin
+                The skin thickness, as a fraction of the AABB base length.
+
+            \param displacement
+                Pointer to the displacement of the particle, or nullptr if unknown.
+         */
+        void fatten(AABBType&, double, const Vector*) const;
+
+        //! Rescale the skin of a leaf that is about to be reinserted.
+        /*! Does nothing unless the skin is adaptive.
+
+            \param leaf
+                The index of the leaf node.
+         */
+        void adaptSkin(unsigned int);
+
+        //! Remove a leaf from the tree.
+        /*! \param leaf
+                The index of the leaf node.
+         */
+        void removeLeaf(unsigned int);
+
+        //! Balance the tree.
+        /*! \param node
+                The index of the node.
+         */
+        unsigned int balance(unsigned int);
+
+        //! Rotate the children of a node to reduce the surface area of the tree.
+        /*! Each swap of a child of the node with a grandchild on the opposite
+            side is considered, and the one that most reduces the surface area
+            of the affected child is applied. The children of the node must
+            have up to date bounds.
+
+            \param node
+                The index of the node.
+
+            \return
+                The index of the node (which is unchanged).
+         */
+        unsigned int rotate(unsigned int);
+
+        //! Compute the height of the tree.
+        /*! \return
+                The height of the entire tree.
+         */
+        unsigned int computeHeight() const;
+
+        //! Compute the height of a sub-tree.
+        /*! \param node
+                The index of the root node.
+
+            \return
+                The height of the sub-tree.
+         */
+        unsigned int computeHeight(unsigned int) const;
+
+        //! Assert that the sub-tree has a valid structure.
+        /*! \param node
+                The index of the root node.
+         */
+        void validateStructure(unsigned int) const;
+
+        //! Assert that the sub-tree has valid metrics.
+        /*! \param node
+                The index of the root node.
+         */
+        void validateMetrics(unsigned int) const;
+
+        //! Apply periodic boundary conditions.
+        /* \param position
+                The position vector.
+         */
+        void periodicBoundaries(Vector&) const;
+
+        //! Compute minimum image separation.
+        /*! \param separation
+                The separation vector.
+
+            \param shift
+                The shift vector.
+
+            \return
+                Whether a periodic shift has been applied.
+         */
+        bool minimumImage(Vector&, Vector&) const;
+
+        //! Test whether a node overlaps an AABB.
+        /*! For periodic systems the node is shifted to its minimum image
+            with respect to the AABB, one axis at a time, so that no
+            temporary vectors or AABB copies are needed.
+
+            \param node
+                The node index.
+
+            \param aabb
+                The AABB.
+
+            \return
+                Whether the node overlaps the AABB.
+         */
+        bool overlaps(unsigned int, const AABBType&) const;
+
+        //! Test whether the single-precision bounds of a node overlap an AABB.
+        /*! \param node
+                The node index.
+
+            \param aabb
+                The AABB.
+
+            \return
+                Whether the node may overlap the AABB.
+         */
+        bool overlapsFloat(unsigned int, const AABBType&) const;
+
+        //! Store the single-precision bounds of a node, rounding outward.
+        /*! \param node
+                The node index.
+         */
+        void storeFloatBounds(unsigned int);
+
+        //! Update the single-precision bounds of a node and its children.
+        /*! Called as each node is refit, since restructuring the node
+            also changes the bounds of one of its children.
+
+            \param node
+                The node index.
+         */
+        void syncFloatBounds(unsigned int);
+
+        /// Update the single-precision bounds of every node.
+        void syncFloatBounds();
+
+        //! Test whether a leaf overlaps a sphere exactly.
+        /*! \param leaf
+                The index of the leaf node.
+
+            \param position
+                The centre of the sphere.
+
+            \param radius
+                The radius of the sphere.
+
+            \return
+                Whether the leaf's particle overlaps the sphere.
+         */
+        bool overlapsSphere(unsigned int, const Vector&, double) const;
+
+        //! Cast a ray through the tree, without periodic images.
+        /*! \param origin
+                The origin of the ray.
+
+            \param direction
+                The direction of the ray.
+
+            \param invDirection
+                The reciprocal of each component of the direction.
+
+            \param maxT
+                The maximum value of the ray parameter, updated by the callback.
+
+            \param callback
+                The callback passed to rayCast.
+
+            \return
+                Whether the cast should continue, i.e. the callback didn't stop it.
+         */
+        template <class Callback>
+        bool castRay(const Vector&, const Vector&, const Vector&, double&, Callback&) const;
+
+        //! Find the leaves nearest to a point.
+        /*! \param point
+                The point.
+
+            \param k
+                The number of particles to find.
+
+            \param particle
+                A particle index to exclude from the search.
+
+            \param distance
+                A callable, double(unsigned int leaf), that returns the squared
+                distance from the point to the particle of a leaf.
+
+            \param neighbours
+                The squared distance and index of the nearest particles, nearest first.
+         */
+        template <class Distance>
+        void findNearest(const Vector&, unsigned int, unsigned int, const Distance&,
+            std::vector<std::pair<double, unsigned int> >&) const;
+
+        //! Get the centre of the particle of a leaf.
+        /*! \param leaf
+                The index of the leaf node.
+
+            \return
+                The position of the stored sphere, or the centre of the fattened AABB.
+         */
+        const Vector& getCentre(unsigned int) const;
+
+        //! Compute the squared distance from a point to the centre of a leaf's particle.
+        /*! \param leaf
+                The index of the leaf node.
+
+            \param point
+                The point.
+
+            \return
+                The squared minimum image distance.
+         */
+        double computeDistanceSqd(unsigned int, const Vector&) const;
+
+        //! Compute the squared distance from a point to an AABB.
+        /*! \param aabb
+                The AABB.
+
+            \param point
+                The point.
+
+            \return
+                The squared minimum image distance (zero if the point lies inside).
+         */
+        double computeDistanceSqd(const AABBType&, const Vector&) const;
+
+        //! Test whether a point lies within a distance of an AABB.
+        /*! \param aabb
+                The AABB.
+
+            \param point
+                The point.
+
+            \param distanceSqd
+                The squared distance.
+
+            \param isInclusive
+                Whether a point at exactly the distance counts as within it.
+
+            \return
+                Whether the squared minimum image distance to the AABB is within the distance.
+         */
+        bool isWithinDistance(const AABBType&, const Vector&, double, bool) const;
+
+        //! Find where a ray enters an AABB.
+        /*! \param aabb
+                The AABB.
+
+            \param origin
+                The origin of the ray.
+
+            \param invDirection
+                The reciprocal of each component of the ray direction.
+
+            \param maxT
+                The maximum value of the ray parameter.
+
+            \param t
+                The value of the ray parameter where the ray enters the AABB
+                (zero if the origin lies inside).
+
+            \return
+                Whether the ray enters the AABB before maxT.
+         */
+        bool intersectRay(const AABBType&, const Vector&, const Vector&, double, double&) const;
+
+        //! Find where a ray enters the particle of a leaf.
+        /*! Particles with no stored sphere are hit where the ray enters
+            the leaf's fattened AABB.
+
+            \param leaf
+                The index of the leaf node.
+
+            \param origin
+                The origin of the ray.
+
+            \param direction
+                The direction of the ray.
+
+            \param invDirection
+                The reciprocal of each component of the ray direction.
+
+            \param maxT
+                The maximum value of the ray parameter.
+
+            \param t
+                The value of the ray parameter where the ray enters the particle.
+
+            \return
+                Whether the ray hits the particle before maxT.
+         */
+        bool intersectLeaf(unsigned int, const Vector&, const Vector&, const Vector&, double, double&) const;
+
+        //! Visit all leaves whose AABBs overlap an AABB.
+        /*! \param aabb
+                The AABB.
+
+            \param callback
+                A callable, bool(unsigned int leaf), invoked for each
+                overlapping leaf node. Return false to stop the traversal.
+         */
+        template <class Callback>
+        void traverse(const AABBType&, Callback&&) const;
+
+        //! Visit all leaves whose AABBs overlap an AABB, using a given overlap test.
+        /*! \param aabb
+                The AABB.
+
+            \param isMinimumImage
+                Whether to apply minimum image tests, or plain overlap tests.
+
+            \param callback
+                A callable, bool(unsigned int leaf), invoked for each
+                overlapping leaf node. Return false to stop the traversal.
+         */
+        template <class Callback>
+        void traverseNodes(const AABBType&, bool, Callback&&) const;
+
+        //! Test whether the ghosts cover a query AABB.
+        /*! \param aabb
+                The AABB.
+
+            \param isOutside
+                Whether the centre of the AABB lies outside of the box, so it
+                must be shifted by wrapQuery before traversing the tree.
+
+            \return
+                Whether the ghosts cover the AABB, i.e. it is no wider than the ghost width.
+         */
+        bool isGhostQuery(const AABBType&, bool&) const;
+
+        //! Shift a query AABB so that its centre lies in the box.
+        /*! \param aabb
+                The AABB.
+         */
+        void wrapQuery(AABBType&) const;
+
+        //! Mirror a leaf as ghosts, widening the ghosts of all leaves if needed.
+        /*! Does nothing unless ghosts are enabled.
+
+            \param leaf
+                The index of the leaf node.
+         */
+        void addGhosts(unsigned int);
+
+        //! Insert a ghost leaf for each image of a leaf that lies near the box.
+        /*! \param leaf
+                The index of the leaf node.
+         */
+        void createGhosts(unsigned int);
+
+        //! Remove the ghosts of a leaf.
+        /*! \param leaf
+                The index of the leaf node.
+         */
+        void removeGhosts(unsigned int);
+
+        /// Remove all ghosts and, if enabled, recreate them with a fresh ghost width.
+        void resetGhosts();
+
+        //! Test whether two node AABBs overlap in any periodic image.
+        /*! This is a conservative test used to prune pairs of subtrees. Node
+            bounds can span more than half of the box, so all images along
+            each periodic axis are considered.
+
+            \param aabb1
+                The AABB of the first node.
+
+            \param aabb2
+                The AABB of the second node.
+
+            \return
+                Whether the nodes may contain an overlapping pair of leaves.
+         */
+        bool overlapsImages(const AABBType&, const AABBType&) const;
+
+        //! Process a pair of nodes during a self-traversal of the tree.
+        /*! Leaf pairs are tested and reported, otherwise the child pairs
+            that need to be visited are pushed onto the stack. A node paired
+            with itself stands for all of the pairs within its subtree.
+
+            \param pair
+                The pair of node indices.
+
+            \param stack
+                The stack of node pairs still to be visited.
+
+            \param callback
+                The pair callback.
+
+            \return
+                False if the callback requested that the search stop.
+         */
+        template <class Callback>
+        bool expandPair(const std::pair<unsigned int, unsigned int>&,
+            std::vector<std::pair<unsigned int, unsigned int> >&, Callback&) const;
+
+        //! Run a batch of queries in parallel, storing the results in CSR form.
+        /*! \param nQueries
+                The number of queries.
+
+            \param query
+                A callable, void(unsigned int i, std::vector<unsigned int>& buffer),
+                that appends the results of query i to the buffer.
+
+            \param offsets
+                The CSR row offsets.
+
+            \param indices
+                The CSR particle indices.
+
+            \param nThreads
+                The number of threads (zero for hardware concurrency).
+         */
+        template <class Query>
+        void runBatch(unsigned int, const Query&, std::vector<unsigned int>&,
+            std::vector<unsigned int>&, unsigned int) const;
+
+        //! Copy the tree for building a snapshot.
+        /*! Ghost leaves are dropped, along with the internal nodes that are
+            left with a single child, so every copied internal node has two
+            children. Children are copied before their parents.
+
+            \param snapshotNodes
+                The copied nodes.
+
+            \return
+                The index of the copied root, or NULL_NODE if there are no
+                particles.
+         */
+        unsigned int exportNodes(std::vector<BasicSnapshotNode<D> >&) const;
+    };
+
+    /*! \brief A compressed, read-only snapshot of an AABB tree.
+
+        The snapshot keeps only what is needed to answer overlap queries.
+        Each internal node holds the indices of its two children and their
+        bounds, quantised relative to the node's own box: the lower bound of
+        a child is stored as the number of steps up from the lower face of
+        the node, and the upper bound as the number of steps down from its
+        upper face, with (2^bits - 1) steps spanning the box. Offsets are
+        rounded outward, so each decoded box contains the true one. Leaves
+        have no node of their own: the particle index is stored in place of
+        the child index, with the top bit set.
+
+        Internal nodes take 8 + 4*D*sizeof(Offset) bytes, e.g. 20 bytes in
+        3D with 8-bit offsets, compared to over 100 bytes for each node of
+        the tree, and there is one fewer internal node than particles.
+
+        Since leaf bounds are quantised, queries report every particle whose
+        AABB overlaps the query, along with a few whose AABBs lie within one
+        quantisation step of it. Ghost leaves are dropped and periodic images
+        are tested directly instead. The snapshot isn't updated when the
+        tree changes, so it suits large, static systems, or systems that are
+        queried many times between updates.
+
+        The template parameters set the dimensionality, as for BasicTree,
+        and the offset type, which should be std::uint8_t or std::uint16_t.
+     */
+    template <unsigned int D, class Offset>
+    class BasicCompressedTree
+    {
+    public:
+        /// The AABB type.
+        typedef BasicAABB<D> AABBType;
+
+        /// The position vector type.
+        typedef typename VectorTraits<D>::Vector Vector;
+
+        //! Constructor.
+        /*! \param tree
+                The tree to compress.
+         */
+        template <class Layout>
+        explicit BasicCompressedTree(const BasicTree<D, Layout>&);
+
+        //! Query the snapshot to find candidate interactions for an AABB.
+        /*! \param aabb
+                The AABB.
+
+            \return
+                A vector of particle indices.
+         */
+        std::vector<unsigned int> query(const AABBType&) const;
+
+        //! Visit all particles whose quantised AABBs overlap an AABB.
+        /*! \param aabb
+                The AABB.
+
+            \param callback
+                A callable, bool(unsigned int particle), invoked for each
+                candidate. Return false to stop the query early.
+         */
+        template <class Callback>
+        void query(const AABBType&, Callback&&) const;
+
+        /// Return the number of particles in the snapshot.
+        unsigned int nParticles() const;
+
+        /// Get the number of internal nodes in the snapshot.
+        unsigned int getNodeCount() const;
+
+        /// Get the height of the snapshot.
+        unsigned int getHeight() const;
+
+        /// Get the number of bytes used to store the nodes.
+        std::size_t getMemoryUsage() const;
+
+    private:
+        /// The flag marking a child as a particle, rather than a node.
+        static const std::uint32_t LEAF = 0x80000000u;
+
+        /// The size of the fixed traversal stack used by queries.
+        static const unsigned int STACK_SIZE = 64;
+
+        /// A node of the uncompressed tree, with ghosts removed.
+        typedef BasicSnapshotNode<D> BuildNode;
+
+        /// The dimensionality of the system.
+        unsigned int dimension;
+
+        /// Whether the system is periodic along at least one axis.
+        bool isPeriodic;
+
+        /// The period along each axis: the box size if periodic, otherwise zero.
+        Vector periods;
+
+        /// Does touching count as overlapping in queries?
+        bool touchIsOverlap;
+
+        /// The root, as a child reference, or NULL_NODE if the snapshot is empty.
+        std::uint32_t root;
+
+        /// The bounds of the root: the lower then the upper bound.
+        std::vector<double> rootBounds;
+
+        /// The two children of each node.
+        std::vector<std::uint32_t> children;
+
+        /// The offsets of the lower then upper bounds of each child of each node.
+        std::vector<Offset> offsets;
+
+        /// The number of particles.
+        unsigned int nLeaves;
+
+        /// The height of the snapshot.
+        unsigned int height;
+
+        //! Quantise the uncompressed tree.
+        /*! \param buildNodes
+                The nodes of the uncompressed tree.
+
+            \param buildRoot
+                The index of its root, or NULL_NODE if it is empty.
+         */
+        void compress(const std::vector<BuildNode>&, unsigned int);
+
+        //! Compute the quantisation step along an axis of a node.
+        /*! A child's bounds decode to lowerBound + offset*step and
+            upperBound - offset*step. The same arithmetic is used when
+            compressing, so the decoded bounds are exact.
+
+            \param lowerBound
+                The lower bound of the node.
+
+            \param upperBound
+                The upper bound of the node.
+
+            \return
+                The step.
+         */
+        static double computeStep(double, double);
+
+        //! Test whether a decoded box, or any of its periodic images, overlaps an AABB.
+        /*! \param bounds
+                The lower then upper bounds of the box.
+
+            \param aabb
+                The AABB.
+
+            \return
+                Whether the box overlaps the AABB.
+         */
+        bool overlaps(const double*, const AABBType&) const;
+    };
+
+    /*! \brief A read-only snapshot of an AABB tree with a wide branching factor.
+
+        The binary tree is collapsed so that each node has up to Width
+        children, by repeatedly opening the child with the largest surface
+        area until the node is full. The bounds of the children are stored
+        together, axis by axis, as Width lower bounds followed by Width upper
+        bounds, and empty slots hold an inverted box that never overlaps.
+        A query therefore tests all children of a node at once, with the
+        same branch-free comparisons across the Width slots, which the
+        compiler turns into SIMD instructions, and descends about half as
+        many levels (Width = 4) as in the binary tree. As for the compressed
+        snapshot, leaves have no node of their own and the particle index is
+        stored in place of the child index, with the top bit set.
+
+        Bounds are stored exactly, so queries return the same particles as
+        the tree. Ghost leaves are dropped and periodic images are tested
+        directly instead. The snapshot isn't updated when the tree changes,
+        but building it is cheap compared to a sweep of queries, so it can be
+        rebuilt after each batch of updates.
+
+        The template parameters set the dimensionality, as for BasicTree,
+        and the branching factor, which should be 4 or 8.
+     */
+    template <unsigned int D, unsigned int Width>
+    class BasicWideTree
+    {
+    public:
+        /// The AABB type.
+        typedef BasicAABB<D> AABBType;
+
+        /// The position vector type.
+        typedef typename VectorTraits<D>::Vector Vector;
+
+        //! Constructor.
+        /*! \param tree
+                The tree to collapse.
+         */
+        template <class Layout>
+        explicit BasicWideTree(const BasicTree<D, Layout>&);
+
+        //! Query the snapshot to find candidate interactions for an AABB.
+        /*! \param aabb
+                The AABB.
+
+            \return
+                A vector of particle indices.
+         */
+        std::vector<unsigned int> query(const AABBType&) const;
+
+        //! Visit all particles whose AABBs overlap an AABB.
+        /*! \param aabb
+                The AABB.
+
+            \param callback
+                A callable, bool(unsigned int particle), invoked for each
+                candidate. Return false to stop the query early.
+         */
+        template <class Callback>
+        void query(const AABBType&, Callback&&) const;
+
+        /// Return the number of particles in the snapshot.
+        unsigned int nParticles() const;
+
+        /// Get the number of internal nodes in the snapshot.
+        unsigned int getNodeCount() const;
+
+        /// Get the height of the snapshot.
+        unsigned int getHeight() const;
+
+        /// Get the number of bytes used to store the nodes.
+        std::size_t getMemoryUsage() const;
+
+    private:
+        /// The flag marking a child as a particle, rather than a node.
+        static const std::uint32_t LEAF = 0x80000000u;
+
+        /// The size of the fixed traversal stack used by queries.
+        static const unsigned int STACK_SIZE = 256;
+
+        /// A node of the binary tree, with ghosts removed.
+        typedef BasicSnapshotNode<D> BuildNode;
+
+        /// The dimensionality of the system.
+        unsigned int dimension;
+
+        /// Whether the system is periodic along at least one axis.
+        bool isPeriodic;
+
+        /// The period along each axis: the box size if periodic, otherwise zero.
+        Vector periods;
+
+        /// Does touching count as overlapping in queries?
+        bool touchIsOverlap;
+
+        /// The Width children of each node. The root is node 0.
+        std::vector<std::uint32_t> children;
+
+        /// The bounds of the children of each node, Width lower then Width upper bounds per axis.
+        std::vector<double, AlignedAllocator<double> > bounds;
+
+        /// The number of particles.
+        unsigned int nLeaves;
+
+        /// The height of the snapshot.
+        unsigned int height;
+
+        //! Collapse the binary tree.
+        /*! \param buildNodes
+                The nodes of the binary tree.
+
+            \param buildRoot
+                The index of its root, or NULL_NODE if it is empty.
+         */
+        void build(const std::vector<BuildNode>&, unsigned int);
+
+        //! Test which children of a node overlap an AABB, or any of its periodic images.
+        /*! \param node
+                The index of the node.
+
+            \param aabb
+                The AABB.
+
+            \param isOverlap
+                Whether each child overlaps the AABB.
+         */
+        void overlaps(unsigned int, const AABBType&, bool*) const;
+    };
+
+    /// The AABB object with run-time dimensionality.
+    typedef BasicAABB<0> AABB;
+
+    /// A node of the AABB tree with run-time dimensionality.
+    typedef BasicNode<0> Node;
+
+    /// The dynamic AABB tree with run-time dimensionality.
+    typedef BasicTree<0> Tree;
+
+    /// The compressed tree snapshot with run-time dimensionality.
+    typedef BasicCompressedTree<0> CompressedTree;
+
+    /// The wide tree snapshot with run-time dimensionality.
+    typedef BasicWideTree<0> WideTree;
+
+    // The AABB is defined here, rather than in AABB.cc, so that its kernels
+    // can be inlined into tree traversals, and so that it can be used with
+    // any dimensionality. Each loop runs over every axis without an early
+    // exit, so for a fixed dimensionality it is unrolled into straight-line,
+    // branch-free code that the compiler can vectorise.
+
+    template <unsigned int D>
+    inline BasicAABB<D>::BasicAABB()
+    {
+    }
+
+    template <unsigned int D>
+    inline BasicAABB<D>::BasicAABB(unsigned int dimension)
+    {
+        assert(dimension >= 2);
+
+        VectorTraits<D>::resize(lowerBound, dimension);
+        VectorTraits<D>::resize(upperBound, dimension);
+    }
+
+    template <unsigned int D>
+    inline BasicAABB<D>::BasicAABB(const Vector& lowerBound_, const Vector& upperBound_) :
+        lowerBound(lowerBound_), upperBound(upperBound_)
+    {
+        // Validate the dimensionality of the bounds vectors.
+        if (lowerBound.size() != upperBound.size())
+        {
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+        }
+
+        // Validate that the upper bounds exceed the lower bounds.
+        for (unsigned int i=0;i<lowerBound.size();i++)
+        {
+            // Validate the bound.
+            if (lowerBound[i] > upperBound[i])
+            {
+                throw std::invalid_argument("[ERROR]: AABB lower bound is greater than the upper bound!");
+            }
+        }
+
+        surfaceArea = computeSurfaceArea();
+        centre = computeCentre();
+    }
+
+    template <unsigned int D>
+    inline void BasicAABB<D>::setDimension(unsigned int dimension)
+    {
+        assert(dimension >= 2);
+
+        VectorTraits<D>::resize(lowerBound, dimension);
+        VectorTraits<D>::resize(upperBound, dimension);
+    }
+
+    template <unsigned int D>
+    inline double BasicAABB<D>::computeSurfaceArea() const
+    {
+        unsigned int dim = lowerBound.size();
+
+        // The "area" of a pair of sides is the product of the lengths along
+        // every other axis, i.e. the product of the lengths before and after
+        // the axis held constant.
+        double sum = 0;
+        double before = 1;
+
+        for (unsigned int i=0;i<dim;i++)
+        {
+            double after = 1;
+            for (unsigned int j=i+1;j<dim;j++) after *= upperBound[j] - lowerBound[j];
+
+            sum += before*after;
+            before *= upperBound[i] - lowerBound[i];
+        }
+
+        return 2.0 * sum;
+    }
+
+    template <unsigned int D>
+    inline double BasicAABB<D>::getSurfaceArea() const
+    {
+        return surfaceArea;
+    }
+
+    template <unsigned int D>
+    inline void BasicAABB<D>::merge(const BasicAABB& aabb1, const BasicAABB& aabb2)
+    {
+        assert(aabb1.lowerBound.size() == aabb2.lowerBound.size());
+        assert(aabb1.upperBound.size() == aabb2.upperBound.size());
+
+        unsigned int dim = aabb1.lowerBound.size();
+
+        VectorTraits<D>::resize(lowerBound, dim);
+        VectorTraits<D>::resize(upperBound, dim);
+        VectorTraits<D>::resize(centre, dim);
+
+        AABBKernels<D>::merge(aabb1.lowerBound.data(), aabb1.upperBound.data(),
+            aabb2.lowerBound.data(), aabb2.upperBound.data(), lowerBound.data(), upperBound.data(), dim);
+
+        for (unsigned int i=0;i<dim;i++)
+            centre[i] = 0.5 * (lowerBound[i] + upperBound[i]);
+
+        surfaceArea = computeSurfaceArea();
+    }
+
+    template <unsigned int D>
+    inline bool BasicAABB<D>::contains(const BasicAABB& aabb) const
+    {
+        assert(aabb.lowerBound.size() == lowerBound.size());
+
+        // The AABB sticks out if it lies below the lower bound or above the upper bound.
+        return AABBKernels<D>::compare(aabb.lowerBound.data(), lowerBound.data(),
+            aabb.upperBound.data(), upperBound.data(), lowerBound.size(), false) == 0;
+    }
+
+    template <unsigned int D>
+    inline bool BasicAABB<D>::overlaps(const BasicAABB& aabb, bool touchIsOverlap) const
+    {
+        return overlapMask(aabb, touchIsOverlap) == ((1u << lowerBound.size()) - 1);
+    }
+
+    template <unsigned int D>
+    inline unsigned int BasicAABB<D>::overlapMask(const BasicAABB& aabb, bool touchIsOverlap) const
+    {
+        assert(aabb.lowerBound.size() == lowerBound.size());
+
+        // The AABBs are separated along an axis if the upper bound of one
+        // lies below the lower bound of the other.
+        unsigned int separated = AABBKernels<D>::compare(aabb.upperBound.data(), lowerBound.data(),
+            aabb.lowerBound.data(), upperBound.data(), lowerBound.size(), !touchIsOverlap);
+
+        return ~separated & ((1u << lowerBound.size()) - 1);
+    }
+
+    template <unsigned int D>
+    inline typename BasicAABB<D>::Vector BasicAABB<D>::computeCentre() const
+    {
+        Vector position = VectorTraits<D>::create(lowerBound.size());
+
+        for (unsigned int i=0;i<position.size();i++)
+            position[i] = 0.5 * (lowerBound[i] + upperBound[i]);
+
+        return position;
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    void BasicTree<D, Layout>::query(const AABBType& aabb, Callback&& callback) const
+    {
+        query(std::numeric_limits<unsigned int>::max(), aabb, std::forward<Callback>(callback));
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    void BasicTree<D, Layout>::query(unsigned int particle, const AABBType& aabb, Callback&& callback) const
+    {
+        traverse(aabb, [&](unsigned int leaf)
+        {
+            // Can't interact with itself.
+            if (nodes.particle(leaf) == particle) return true;
+
+            return bool(callback(nodes.particle(leaf)));
+        });
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    void BasicTree<D, Layout>::queryRadius(const Vector& position, double radius, Callback&& callback) const
+    {
+        // Validate the dimensionality of the position vector.
+        if (position.size() != dimension)
+        {
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+        }
+
+        // The tree is empty.
+        if (root == NULL_NODE) return;
+
+        double radiusSqd = radius*radius;
+
+        unsigned int fixedStack[STACK_SIZE];
+        std::vector<unsigned int> heapStack;
+        unsigned int* stack = fixedStack;
+
+        if (nodes.height(root) >= int(STACK_SIZE))
+        {
+            heapStack.resize(nodes.height(root) + 1);
+            stack = heapStack.data();
+        }
+
+        unsigned int stackSize = 0;
+        stack[stackSize++] = root;
+
+        while (stackSize > 0)
+        {
+            unsigned int node = stack[--stackSize];
+
+            if (nodes.isLeaf(node))
+            {
+                // Ghosts duplicate the minimum image of their leaf.
+                if (isGhosts && (nodes.owner(node) != NULL_NODE)) continue;
+
+                // Particles with no stored sphere are tested against their AABB.
+                bool isOverlap = (nodes.radius(node) < 0)
+                    ? isWithinDistance(nodes.aabb(node), position, radiusSqd, touchIsOverlap)
+                    : overlapsSphere(node, position, radius);
+
+                if (isOverlap && !callback(nodes.particle(node))) return;
+            }
+            else if (isWithinDistance(nodes.aabb(node), position, radiusSqd, true))
+            {
+                stack[stackSize++] = nodes.left(node);
+                stack[stackSize++] = nodes.right(node);
+            }
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    void BasicTree<D, Layout>::traverse(const AABBType& aabb, Callback&& callback) const
+    {
+        if (isGhosts && isPeriodic)
+        {
+            // Queries covered by the ghosts reduce to plain overlap tests.
+            bool isOutside;
+            if (isGhostQuery(aabb, isOutside))
+            {
+                if (!isOutside) traverseNodes(aabb, false, callback);
+                else
+                {
+                    AABBType wrapped(aabb);
+                    wrapQuery(wrapped);
+                    traverseNodes(wrapped, false, callback);
+                }
+                return;
+            }
+
+            // Otherwise fall back on minimum image tests, skipping the ghosts.
+            traverseNodes(aabb, true, [&](unsigned int leaf)
+            {
+                return (nodes.owner(leaf) != NULL_NODE) || bool(callback(leaf));
+            });
+            return;
+        }
+
+        traverseNodes(aabb, isPeriodic, std::forward<Callback>(callback));
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    void BasicTree<D, Layout>::traverseNodes(const AABBType& aabb, bool isMinimumImage, Callback&& callback) const
+    {
+        // The tree is empty.
+        if (root == NULL_NODE) return;
+
+        // A depth-first traversal never holds more than height + 1 nodes on
+        // the stack, so the fixed stack suffices unless the tree is very deep.
+        unsigned int fixedStack[STACK_SIZE];
+        std::vector<unsigned int> heapStack;
+        unsigned int* stack = fixedStack;
+
+        if (nodes.height(root) >= int(STACK_SIZE))
+        {
+            heapStack.resize(nodes.height(root) + 1);
+            stack = heapStack.data();
+        }
+
+        unsigned int stackSize = 0;
+        stack[stackSize++] = root;
+
+        // Cull with the single-precision bounds, checking leaves exactly if required.
+        bool isFloat = !isMinimumImage && (precision != Precision::Double);
+        bool isExactLeaf = isFloat && (precision == Precision::Mixed);
+
+        while (stackSize > 0)
+        {
+            unsigned int node = stack[--stackSize];
+
+            // Test for overlap between the AABBs.
+            if (isMinimumImage ? overlaps(node, aabb)
+                : (isFloat ? overlapsFloat(node, aabb) : aabb.overlaps(nodes.aabb(node), touchIsOverlap)))
+            {
+                // Check that we're at a leaf node.
+                if (nodes.isLeaf(node))
+                {
+                    if (isExactLeaf && !aabb.overlaps(nodes.aabb(node), touchIsOverlap)) continue;
+                    if (!callback(node)) return;
+                }
+                else
+                {
+                    stack[stackSize++] = nodes.left(node);
+                    stack[stackSize++] = nodes.right(node);
+                }
+            }
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    void BasicTree<D, Layout>::queryAllPairs(Callback&& callback) const
+    {
+        // The tree is empty.
+        if (root == NULL_NODE) return;
+
+        std::vector<std::pair<unsigned int, unsigned int> > stack;
+        stack.reserve(4*(nodes.height(root) + 1));
+        stack.push_back(std::make_pair(root, root));
+
+        while (!stack.empty())
+        {
+            std::pair<unsigned int, unsigned int> pair = stack.back();
+            stack.pop_back();
+
+            if (!expandPair(pair, stack, callback)) return;
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    void BasicTree<D, Layout>::queryAllPairs(Callback&& callback, unsigned int nThreads) const
+    {
+        // The tree is empty.
+        if (root == NULL_NODE) return;
+
+        if (nThreads == 0) nThreads = std::thread::hardware_concurrency();
+        nThreads = std::max(1u, nThreads);
+
+        // Expand the traversal breadth first until there are enough
+        // independent pairs of subtrees to keep the workers busy.
+        std::vector<std::pair<unsigned int, unsigned int> > tasks(1, std::make_pair(root, root));
+        std::vector<std::pair<unsigned int, unsigned int> > expanded;
+
+        while (!tasks.empty() && (tasks.size() < 8*nThreads) && (nThreads > 1))
+        {
+            expanded.clear();
+            for (unsigned int i=0;i<tasks.size();i++)
+            {
+                if (!expandPair(tasks[i], expanded, callback)) return;
+            }
+            tasks.swap(expanded);
+        }
+
+        std::atomic<unsigned int> nextTask(0);
+        std::atomic<bool> isStopped(false);
+
+        auto worker = [&](unsigned int)
+        {
+            std::vector<std::pair<unsigned int, unsigned int> > stack;
+            unsigned int task;
+
+            while (((task = nextTask++) < tasks.size()) && !isStopped)
+            {
+                stack.push_back(tasks[task]);
+
+                while (!stack.empty() && !isStopped)
+                {
+                    std::pair<unsigned int, unsigned int> pair = stack.back();
+                    stack.pop_back();
+
+                    if (!expandPair(pair, stack, callback)) isStopped = true;
+                }
+
+                stack.clear();
+            }
+        };
+
+        runParallel(nThreads, worker);
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Worker>
+    void BasicTree<D, Layout>::runParallel(unsigned int nThreads, const Worker& worker)
+    {
+        std::vector<std::thread> threads;
+        for (unsigned int i=1;i<nThreads;i++)
+            threads.push_back(std::thread(worker, i));
+        worker(0);
+        for (unsigned int i=0;i<threads.size();i++)
+            threads[i].join();
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    void BasicTree<D, Layout>::queryOverlaps(const BasicTree& other, Callback&& callback) const
+    {
+        // Make sure that the trees share the same simulation box.
+        if ((other.dimension != dimension) || (other.isPeriodic != isPeriodic)
+            || (isPeriodic && ((other.periodicity != periodicity) || (other.boxSize != boxSize))))
+        {
+            throw std::invalid_argument("[ERROR]: Trees must share the same simulation box!");
+        }
+
+        // One of the trees is empty.
+        if ((root == NULL_NODE) || (other.root == NULL_NODE)) return;
+
+        std::vector<std::pair<unsigned int, unsigned int> > stack;
+        stack.reserve(2*(nodes.height(root) + other.nodes.height(other.root) + 1));
+        stack.push_back(std::make_pair(root, other.root));
+
+        while (!stack.empty())
+        {
+            unsigned int node = stack.back().first;
+            unsigned int otherNode = stack.back().second;
+            stack.pop_back();
+
+            const AABBType& aabb = nodes.aabb(node);
+            const AABBType& otherAABB = other.nodes.aabb(otherNode);
+
+            // Prune pairs of subtrees that can't contain an overlap.
+            if (!overlapsImages(aabb, otherAABB)) continue;
+
+            bool isLeaf = nodes.isLeaf(node);
+            bool isOtherLeaf = other.nodes.isLeaf(otherNode);
+
+            if (isLeaf && isOtherLeaf)
+            {
+                // Ghosts are only used by queries, since the minimum image
+                // tests already find the pairs that span the boundaries.
+                if ((nodes.owner(node) != NULL_NODE) || (other.nodes.owner(otherNode) != NULL_NODE))
+                    continue;
+
+                // Apply the same minimum image test used by query.
+                if (overlaps(node, otherAABB))
+                {
+                    if (!callback(nodes.particle(node), other.nodes.particle(otherNode))) return;
+                }
+            }
+
+            // Descend into the larger of the two nodes.
+            else if (isOtherLeaf || (!isLeaf && (aabb.surfaceArea >= otherAABB.surfaceArea)))
+            {
+                stack.push_back(std::make_pair(nodes.right(node), otherNode));
+                stack.push_back(std::make_pair(nodes.left(node), otherNode));
+            }
+            else
+            {
+                stack.push_back(std::make_pair(node, other.nodes.right(otherNode)));
+                stack.push_back(std::make_pair(node, other.nodes.left(otherNode)));
+            }
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    void BasicTree<D, Layout>::rayCast(const Vector& origin, const Vector& direction,
+        double maxT, Callback&& callback) const
+    {
+        // Validate the dimensionality of the origin and direction vectors.
+        if ((origin.size() != dimension) || (direction.size() != dimension))
+        {
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+        }
+
+        Vector invDirection = VectorTraits<D>::create(dimension);
+        bool isZero = true;
+
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            if (direction[i] != 0) isZero = false;
+
+            // A zero component gives an infinite slab, so the ray is only
+            // inside it if the origin is.
+            invDirection[i] = 1.0 / direction[i];
+
+            // Only a finite ray can be unwrapped across the periodic images.
+            if (isPeriodic && (periods[i] != 0) && (direction[i] != 0) && std::isinf(maxT))
+            {
+                throw std::invalid_argument("[ERROR]: Ray must have a finite length in a periodic box!");
+            }
+        }
+
+        if (isZero)
+        {
+            throw std::invalid_argument("[ERROR]: Ray direction must be non-zero!");
+        }
+
+        // The tree is empty.
+        if ((root == NULL_NODE) || (maxT < 0)) return;
+
+        if (!isPeriodic)
+        {
+            castRay(origin, direction, invDirection, maxT, callback);
+            return;
+        }
+
+        // Work out the range of images of the tree that overlap the ray.
+        const AABBType& rootAABB = nodes.aabb(root);
+        std::vector<int> minImage(dimension), maxImage(dimension), image(dimension);
+
+        for (unsigned int i=0;i<dimension;i++)
+        {
+            minImage[i] = maxImage[i] = 0;
+
+            if (periods[i] != 0)
+            {
+                double end = origin[i] + maxT*direction[i];
+                double lower = std::min(origin[i], end);
+                double upper = std::max(origin[i], end);
+
+                minImage[i] = int(std::ceil((lower - rootAABB.upperBound[i]) / periods[i]));
+                maxImage[i] = int(std::floor((upper - rootAABB.lowerBound[i]) / periods[i]));
+            }
+            image[i] = minImage[i];
+        }
+
+        // Find the images that the ray enters, shifting the origin rather
+        // than the tree.
+        std::vector<std::pair<double, Vector> > images;
+        Vector shiftedOrigin = VectorTraits<D>::create(dimension);
+
+        while (true)
+        {
+            for (unsigned int i=0;i<dimension;i++)
+                shiftedOrigin[i] = origin[i] - image[i]*periods[i];
+
+            double t;
+            if (intersectRay(rootAABB, shiftedOrigin, invDirection, maxT, t))
+                images.push_back(std::make_pair(t, shiftedOrigin));
+
+            // Advance to the next image.
+            unsigned int i = 0;
+            while ((i < dimension) && (image[i] >= maxImage[i]))
+            {
+                image[i] = minImage[i];
+                i++;
+            }
+
+            if (i == dimension) break;
+
+            image[i]++;
+        }
+
+        // Visit the images front to back.
+        std::sort(images.begin(), images.end(),
+            [](const std::pair<double, Vector>& a, const std::pair<double, Vector>& b)
+            {
+                return a.first < b.first;
+            });
+
+        for (unsigned int i=0;i<images.size();i++)
+        {
+            if (images[i].first > maxT) return;
+
+            if (!castRay(images[i].second, direction, invDirection, maxT, callback)) return;
+        }
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    bool BasicTree<D, Layout>::castRay(const Vector& origin, const Vector& direction,
+        const Vector& invDirection, double& maxT, Callback& callback) const
+    {
+        double t;
+        if (!intersectRay(nodes.aabb(root), origin, invDirection, maxT, t)) return true;
+
+        // The stack holds each node with the value of t where the ray enters it.
+        std::pair<unsigned int, double> fixedStack[STACK_SIZE];
+        std::vector<std::pair<unsigned int, double> > heapStack;
+        std::pair<unsigned int, double>* stack = fixedStack;
+
+        if (nodes.height(root) >= int(STACK_SIZE))
+        {
+            heapStack.resize(nodes.height(root) + 1);
+            stack = heapStack.data();
+        }
+
+        unsigned int stackSize = 0;
+        stack[stackSize++] = std::make_pair(root, t);
+
+        while (stackSize > 0)
+        {
+            unsigned int node = stack[--stackSize].first;
+
+            // The node lies beyond a hit found since it was pushed.
+            if (stack[stackSize].second > maxT) continue;
+
+            if (nodes.isLeaf(node))
+            {
+                // Ghosts are covered by unwrapping the ray.
+                if (nodes.owner(node) != NULL_NODE) continue;
+
+                if (intersectLeaf(node, origin, direction, invDirection, maxT, t))
+                {
+                    maxT = std::min(maxT, double(callback(nodes.particle(node), t)));
+                    if (maxT < 0) return false;
+                }
+            }
+            else
+            {
+                unsigned int left = nodes.left(node);
+                unsigned int right = nodes.right(node);
+                double tLeft, tRight;
+
+                bool isLeft = intersectRay(nodes.aabb(left), origin, invDirection, maxT, tLeft);
+                bool isRight = intersectRay(nodes.aabb(right), origin, invDirection, maxT, tRight);
+
+                // Push the nearer child last, so that it is visited first.
+                if (isLeft && isRight && (tLeft < tRight))
+                {
+                    stack[stackSize++] = std::make_pair(right, tRight);
+                    stack[stackSize++] = std::make_pair(left, tLeft);
+                }
+                else
+                {
+                    if (isLeft) stack[stackSize++] = std::make_pair(left, tLeft);
+                    if (isRight) stack[stackSize++] = std::make_pair(right, tRight);
+                }
+            }
+        }
+
+        return true;
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Distance>
+    std::vector<unsigned int> BasicTree<D, Layout>::nearest(const Vector& point, unsigned int k,
+        Distance&& distance) const
+    {
+        // Validate the dimensionality of the point.
+        if (point.size() != dimension)
+        {
+            throw std::invalid_argument("[ERROR]: Dimensionality mismatch!");
+        }
+
+        std::vector<std::pair<double, unsigned int> > neighbours;
+        findNearest(point, k, std::numeric_limits<unsigned int>::max(), [&](unsigned int leaf)
+        {
+            return double(distance(nodes.particle(leaf)));
+        }, neighbours);
+
+        std::vector<unsigned int> particles(neighbours.size());
+        for (unsigned int i=0;i<neighbours.size();i++)
+            particles[i] = neighbours[i].second;
+
+        return particles;
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Distance>
+    void BasicTree<D, Layout>::findNearest(const Vector& point, unsigned int k, unsigned int particle,
+        const Distance& distance, std::vector<std::pair<double, unsigned int> >& neighbours) const
+    {
+        neighbours.clear();
+
+        if ((root == NULL_NODE) || (k == 0)) return;
+
+        // The nodes still to visit are held in a min-heap keyed on the distance
+        // to their AABBs, and the k nearest particles found so far in a max-heap.
+        auto isFarther = [](const std::pair<double, unsigned int>& a, const std::pair<double, unsigned int>& b)
+        {
+            return a.first > b.first;
+        };
+
+        std::vector<std::pair<double, unsigned int> > queue;
+        queue.reserve(2*(nodes.height(root) + 1));
+
+        // Test a particle against the k nearest found so far.
+        auto visitLeaf = [&](unsigned int leaf)
+        {
+            // Ghosts duplicate the minimum image of their leaf.
+            if ((nodes.owner(leaf) != NULL_NODE) || (nodes.particle(leaf) == particle)) return;
+
+            double rSqd = distance(leaf);
+
+            if (neighbours.size() < k)
+            {
+                neighbours.push_back(std::make_pair(rSqd, nodes.particle(leaf)));
+                std::push_heap(neighbours.begin(), neighbours.end());
+            }
+            else if (rSqd < neighbours.front().first)
+            {
+                std::pop_heap(neighbours.begin(), neighbours.end());
+                neighbours.back() = std::make_pair(rSqd, nodes.particle(leaf));
+                std::push_heap(neighbours.begin(), neighbours.end());
+            }
+        };
+
+        if (nodes.isLeaf(root)) visitLeaf(root);
+        else queue.push_back(std::make_pair(computeDistanceSqd(nodes.aabb(root), point), root));
+
+        while (!queue.empty())
+        {
+            std::pop_heap(queue.begin(), queue.end(), isFarther);
+            std::pair<double, unsigned int> next = queue.back();
+            queue.pop_back();
+
+            // No remaining node can hold a nearer particle.
+            if ((neighbours.size() == k) && (next.first >= neighbours.front().first)) break;
+
+            // Descend towards the nearer child, queueing the farther one, for as
+            // long as it remains the nearest node left to visit.
+            unsigned int node = next.second;
+
+            while (node != NULL_NODE)
+            {
+                unsigned int children[2] = {nodes.left(node), nodes.right(node)};
+                node = NULL_NODE;
+                double nodeDistance = 0;
+
+                for (unsigned int i=0;i<2;i++)
+                {
+                    unsigned int child = children[i];
+
+                    // Leaves are tested straight away, which tightens the bound sooner.
+                    if (nodes.isLeaf(child))
+                    {
+                        visitLeaf(child);
+                        continue;
+                    }
+
+                    double rSqd = computeDistanceSqd(nodes.aabb(child), point);
+
+                    if ((neighbours.size() == k) && (rSqd >= neighbours.front().first)) continue;
+
+                    if (node == NULL_NODE)
+                    {
+                        node = child;
+                        nodeDistance = rSqd;
+                        continue;
+                    }
+
+                    // Queue the farther of the two children.
+                    if (rSqd < nodeDistance)
+                    {
+                        std::swap(node, child);
+                        std::swap(nodeDistance, rSqd);
+                    }
+                    queue.push_back(std::make_pair(rSqd, child));
+                    std::push_heap(queue.begin(), queue.end(), isFarther);
+                }
+
+                // Another node is nearer, so return to the queue.
+                if ((node != NULL_NODE) && !queue.empty() && (queue.front().first < nodeDistance))
+                {
+                    queue.push_back(std::make_pair(nodeDistance, node));
+                    std::push_heap(queue.begin(), queue.end(), isFarther);
+                    node = NULL_NODE;
+                }
+
+                // The bound may have tightened since the node was found.
+                if ((node != NULL_NODE) && (neighbours.size() == k) && (nodeDistance >= neighbours.front().first))
+                    node = NULL_NODE;
+            }
+        }
+
+        std::sort_heap(neighbours.begin(), neighbours.end());
+    }
+
+    template <unsigned int D, class Layout>
+    template <class Callback>
+    bool BasicTree<D, Layout>::expandPair(const std::pair<unsigned int, unsigned int>& pair,
+        std::vector<std::pair<unsigned int, unsigned int> >& stack, Callback& callback) const
+    {
+        unsigned int node1 = pair.first;
+        unsigned int node2 = pair.second;
+
+        // All pairs within a subtree.
+        if (node1 == node2)
+        {
+            if (!nodes.isLeaf(node1))
+            {
+                unsigned int left = nodes.left(node1);
+                unsigned int right = nodes.right(node1);
+
+                stack.push_back(std::make_pair(left, right));
+                stack.push_back(std::make_pair(right, right));
+                stack.push_back(std::make_pair(left, left));
+            }
+
+            return true;
+        }
+
+        // Prune pairs of subtrees that can't contain an overlap.
+        if (!overlapsImages(nodes.aabb(node1), nodes.aabb(node2))) return true;
+
+        bool isLeaf1 = nodes.isLeaf(node1);
+        bool isLeaf2 = nodes.isLeaf(node2);
+
+        if (isLeaf1 && isLeaf2)
+        {
+            // Ghosts are only used by queries, since the minimum image
+            // tests already find the pairs that span the boundaries.
+            if ((nodes.owner(node1) != NULL_NODE) || (nodes.owner(node2) != NULL_NODE))
+                return true;
+
+            // Apply the same minimum image test used by query.
+            if (overlaps(node2, nodes.aabb(node1)))
+                return bool(callback(nodes.particle(node1), nodes.particle(node2)));
+
+            return true;
+        }
+
+        // Descend into the larger of the two nodes.
+        if (isLeaf2 || (!isLeaf1 &&
+            (nodes.aabb(node1).surfaceArea >= nodes.aabb(node2).surfaceArea)))
+        {
+            stack.push_back(std::make_pair(nodes.right(node1), node2));
+            stack.push_back(std::make_pair(nodes.left(node1), node2));
+        }
+        else
+        {
+            stack.push_back(std::make_pair(node1, nodes.right(node2)));
+            stack.push_back(std::make_pair(node1, nodes.left(node2)));
+        }
+
+        return true;
+    }
+
+    template <unsigned int D, class Layout>
+    inline bool BasicTree<D, Layout>::overlapsImages(const AABBType& aabb1, const AABBType& aabb2) const
+    {
+        if (!isPeriodic) return aabb1.overlaps(aabb2, touchIsOverlap);
+
+        for (unsigned int i=0;i<aabb1.lowerBound.size();i++)
+        {
+            // Test the unshifted image, then the neighbouring images.
+            int nImages = (periods[i] != 0) ? 3 : 1;
+            bool isOverlap = false;
+
+            for (int j=0;j<nImages && !isOverlap;j++)
+            {
+                double shift = (j == 0) ? 0 : ((j == 1) ? periods[i] : -periods[i]);
+
+                if (touchIsOverlap)
+                {
+                    isOverlap = !(aabb2.upperBound[i] + shift < aabb1.lowerBound[i]
+                               || aabb2.lowerBound[i] + shift > aabb1.upperBound[i]);
+                }
+                else
+                {
+                    isOverlap = !(aabb2.upperBound[i] + shift <= aabb1.lowerBound[i]
+                               || aabb2.lowerBound[i] + shift >= aabb1.upperBound[i]);
+                }
+            }
+
+            if (!isOverlap) return false;
+        }
+
+        return true;
+    }
+
+    template <unsigned int D, class Layout>
+    inline bool BasicTree<D, Layout>::overlaps(unsigned int node, const AABBType& aabb) const
+    {
+        const AABBType& nodeAABB = nodes.aabb(node);
+
+        if (!isPeriodic) return aabb.overlaps(nodeAABB, touchIsOverlap);
+
+        for (unsigned int i=0;i<nodeAABB.lowerBound.size();i++)
+        {
+            // Compute the minimum image shift along this axis. The period is
+            // zero along open axes, so this compiles to selects, not branches.
+            double separation = nodeAABB.centre[i] - aabb.centre[i];
+            double shift = (separation < negMinImage[i]) ? periods[i]
+                         : ((separation >= posMinImage[i]) ? -periods[i] : 0.0);
+
+            double lowerBound = nodeAABB.lowerBound[i] + shift;
+            double upperBound = nodeAABB.upperBound[i] + shift;
+
+            if (touchIsOverlap)
+            {
+                if (aabb.upperBound[i] < lowerBound || aabb.lowerBound[i] > upperBound)
+                    return false;
+            }
+            else
+            {
+                if (aabb.upperBound[i] <= lowerBound || aabb.lowerBound[i] >= upperBound)
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    template <unsigned int D, class Layout>
+    inline bool BasicTree<D, Layout>::overlapsFloat(unsigned int node, const AABBType& aabb) const
+    {
+        unsigned int dim = aabb.lowerBound.size();
+        const float* lowerBound = &floatBounds[std::size_t(2*dim)*node];
+        const float* upperBound = lowerBound + dim;
+
+        // The float bounds contain the node AABB, so this never misses an overlap.
+        if (touchIsOverlap)
+        {
+            for (unsigned int i=0;i<dim;i++)
+            {
+                if (aabb.upperBound[i] < lowerBound[i] || aabb.lowerBound[i] > upperBound[i])
+                    return false;
+            }
+        }
+        else
+        {
+            for (unsigned int i=0;i<dim;i++)
+            {
+                if (aabb.upperBound[i] <= lowerBound[i] || aabb.lowerBound[i] >= upperBound[i])
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    template <unsigned int D, class Layout>
+    inline bool BasicTree<D, Layout>::overlapsSphere(unsigned int leaf, const Vector& position, double radius) const
+    {
+        // Ghosts use the sphere of the leaf that they mirror.
+        if (isGhosts && (nodes.owner(leaf) != NULL_NODE)) leaf = nodes.owner(leaf);
+
+        // No sphere is stored, so fall back on the AABB overlap.
+        if (nodes.radius(leaf) < 0) return true;
+
+        const Vector& centre = nodes.position(leaf);
+        double rSqd = 0;
+
+        for (unsigned int i=0;i<centre.size();i++)
+        {
+            double separation = centre[i] - position[i];
+
+            // Compute the minimum image separation.
+            if (isPeriodic)
+            {
+                separation += (separation < negMinImage[i]) ? periods[i]
+                            : ((separation >= posMinImage[i]) ? -periods[i] : 0.0);
+            }
+
+            rSqd += separation*separation;
+        }
+
+        double cutOff = radius + nodes.radius(leaf);
+        cutOff *= cutOff;
+
+        return touchIsOverlap ? (rSqd <= cutOff) : (rSqd < cutOff);
+    }
+
+    template <unsigned int D, class Layout>
+    inline const typename BasicTree<D, Layout>::Vector& BasicTree<D, Layout>::getCentre(unsigned int leaf) const
+    {
+        return (nodes.radius(leaf) < 0) ? nodes.aabb(leaf).centre : nodes.position(leaf);
+    }
+
+    template <unsigned int D, class Layout>
+    inline double BasicTree<D, Layout>::computeDistanceSqd(unsigned int leaf, const Vector& point) const
+    {
+        const Vector& centre = getCentre(leaf);
+        double rSqd = 0;
+
+        for (unsigned int i=0;i<centre.size();i++)
+        {
+            double separation = centre[i] - point[i];
+
+            // Compute the minimum image separation.
+            if (isPeriodic)
+            {
+                separation += (separation < negMinImage[i]) ? periods[i]
+                            : ((separation >= posMinImage[i]) ? -periods[i] : 0.0);
+            }
+
+            rSqd += separation*separation;
+        }
+
+        return rSqd;
+    }
+
+    template <unsigned int D, class Layout>
+    inline double BasicTree<D, Layout>::computeDistanceSqd(const AABBType& aabb, const Vector& point) const
+    {
+        double rSqd = 0;
+
+        for (unsigned int i=0;i<point.size();i++)
+        {
+            double separation = aabb.centre[i] - point[i];
+
+            // Compute the minimum image separation.
+            if (isPeriodic)
+            {
+                separation += (separation < negMinImage[i]) ? periods[i]
+                            : ((separation >= posMinImage[i]) ? -periods[i] : 0.0);
+            }
+
+            // The gap between the point and the nearest face.
+            double gap = std::fabs(separation) - 0.5*(aabb.upperBound[i] - aabb.lowerBound[i]);
+            if (gap > 0) rSqd += gap*gap;
+        }
+
+        return rSqd;
+    }
+
+    template <unsigned int D, class Layout>
+    inline bool BasicTree<D, Layout>::isWithinDistance(const AABBType& aabb, const Vector& point,
+        double distanceSqd, bool isInclusive) const
+    {
+        double rSqd = 0;
+
+        for (unsigned int i=0;i<point.size();i++)
+        {
+            double lowerBound = aabb.lowerBound[i];
+            double upperBound = aabb.upperBound[i];
+
+            // Shift the AABB to its minimum image.
+            if (isPeriodic)
+            {
+                double separation = aabb.centre[i] - point[i];
+                double shift = (separation < negMinImage[i]) ? periods[i]
+                             : ((separation >= posMinImage[i]) ? -periods[i] : 0.0);
+
+                lowerBound += shift;
+                upperBound += shift;
+            }
+
+            // Add the gap between the point and the nearest face, stopping
+            // as soon as the point is out of reach.
+            double gap = std::max(lowerBound - point[i], point[i] - upperBound);
+            if (gap > 0)
+            {
+                rSqd += gap*gap;
+                if (rSqd > distanceSqd) return false;
+            }
+        }
+
+        return isInclusive ? (rSqd <= distanceSqd) : (rSqd < distanceSqd);
+    }
+
+    template <unsigned int D, class Layout>
+    inline bool BasicTree<D, Layout>::intersectRay(const AABBType& aabb, const Vector& origin,
+        const Vector& invDirection, double maxT, double& t) const
+    {
+        double tEnter = 0;
+        double tExit = maxT;
+
+        for (unsigned int i=0;i<origin.size();i++)
+        {
+            double t1 = (aabb.lowerBound[i] - origin[i]) * invDirection[i];
+            double t2 = (aabb.upperBound[i] - origin[i]) * invDirection[i];
+
+            // An origin on the face of an infinite slab gives NaN, which the
+            // comparisons treat as inside the slab.
+            if (t1 > t2) std::swap(t1, t2);
+            if (t1 > tEnter) tEnter = t1;
+            if (t2 < tExit) tExit = t2;
+
+            if (tEnter > tExit) return false;
+        }
+
+        t = tEnter;
+        return true;
+    }
+
+    template <unsigned int D, class Layout>
+    inline bool BasicTree<D, Layout>::intersectLeaf(unsigned int leaf, const Vector& origin,
+        const Vector& direction, const Vector& invDirection, double maxT, double& t) const
+    {
+        if (!intersectRay(nodes.aabb(leaf), origin, invDirection, maxT, t)) return false;
+
+        // No sphere is stored, so the ray hits the fattened AABB.
+        if (nodes.radius(leaf) < 0) return true;
+
+        // Solve |origin + t*direction - centre|^2 = radius^2.
+        const Vector& centre = nodes.position(leaf);
+        double a = 0, b = 0, c = 0;
+
+        for (unsigned int i=0;i<centre.size();i++)
+        {
+            double separation = origin[i] - centre[i];
+
+            a += direction[i]*direction[i];
+            b += separation*direction[i];
+            c += separation*separation;
+        }
+        c -= nodes.radius(leaf)*nodes.radius(leaf);
+
+        // The origin lies inside the sphere.
+        if (c <= 0)
+        {
+            t = 0;
+            return true;
+        }
+
+        double discriminant = b*b - a*c;
+
+        // The ray misses, or points away from, the sphere.
+        if ((discriminant < 0) || (b > 0)) return false;
+
+        t = (-b - std::sqrt(discriminant)) / a;
+        return (t <= maxT);
+    }
+
+    template <unsigned int D, class Offset>
+    template <class Layout>
+    BasicCompressedTree<D, Offset>::BasicCompressedTree(const BasicTree<D, Layout>& tree) :
+        dimension(tree.dimension), isPeriodic(tree.isPeriodic), touchIsOverlap(tree.touchIsOverlap)
+    {
+        periods = VectorTraits<D>::create(dimension);
+        if (isPeriodic) periods = tree.periods;
+
+        std::vector<BuildNode> buildNodes;
+        unsigned int buildRoot = tree.exportNodes(buildNodes);
+
+        compress(buildNodes, buildRoot);
+    }
+
+    template <unsigned int D, class Offset>
+    template <class Callback>
+    void BasicCompressedTree<D, Offset>::query(const AABBType& aabb, Callback&& callback) const
+    {
+        // The snapshot is empty.
+        if (root == NULL_NODE) return;
+
+        assert(aabb.lowerBound.size() == dimension);
+
+        if (!overlaps(rootBounds.data(), aabb)) return;
+
+        if (root & LEAF)
+        {
+            callback(root & ~LEAF);
+            return;
+        }
+
+        // Each entry on the stack holds a node and its decoded bounds. As for
+        // the tree, the stack never holds more than height + 1 entries.
+        unsigned int dim = aabb.lowerBound.size();
+        unsigned int stride = 2*dim;
+
+        unsigned int fixedStack[STACK_SIZE];
+        double fixedBounds[STACK_SIZE*2*((D == 0) ? 3 : D)];
+        std::vector<unsigned int> heapStack;
+        std::vector<double> heapBounds;
+        unsigned int* stack = fixedStack;
+        double* bounds = fixedBounds;
+
+        if ((height >= STACK_SIZE) || ((D == 0) && (dim > 3)))
+        {
+            heapStack.resize(height + 1);
+            heapBounds.resize(std::size_t(height + 1)*stride);
+            stack = heapStack.data();
+            bounds = heapBounds.data();
+        }
+
+        unsigned int stackSize = 0;
+        stack[stackSize] = root;
+        std::copy(rootBounds.begin(), rootBounds.end(), bounds);
+        stackSize++;
+
+        while (stackSize > 0)
+        {
+            unsigned int node = stack[--stackSize];
+
+            // Decode the children into this slot and the next. The left-hand
+            // child overwrites the parent, one axis at a time.
+            double* parent = bounds + std::size_t(stackSize)*stride;
+            double* right = parent + stride;
+            const Offset* offset = &offsets[std::size_t(2*stride)*node];
+
+            for (unsigned int i=0;i<dim;i++)
+            {
+                double lowerBound = parent[i];
+                double upperBound = parent[dim + i];
+                double step = computeStep(lowerBound, upperBound);
+
+                parent[i] = lowerBound + offset[i]*step;
+                parent[dim + i] = upperBound - offset[dim + i]*step;
+                right[i] = lowerBound + offset[stride + i]*step;
+                right[dim + i] = upperBound - offset[stride + dim + i]*step;
+            }
+
+            unsigned int nPushed = 0;
+
+            for (unsigned int i=0;i<2;i++)
+            {
+                std::uint32_t child = children[2*node + i];
+                const double* childBounds = (i == 0) ? parent : right;
+
+                if (!overlaps(childBounds, aabb)) continue;
+
+                if (child & LEAF)
+                {
+                    if (!callback(child & ~LEAF)) return;
+                }
+                else
+                {
+                    // Close the gap if the left-hand child wasn't pushed.
+                    double* slot = parent + std::size_t(nPushed)*stride;
+                    if (slot != childBounds) std::copy(childBounds, childBounds + stride, slot);
+
+                    stack[stackSize++] = child;
+                    nPushed++;
+                }
+            }
+        }
+    }
+
+    template <unsigned int D, class Offset>
+    inline double BasicCompressedTree<D, Offset>::computeStep(double lowerBound, double upperBound)
+    {
+        return (upperBound - lowerBound) * (1.0 / std::numeric_limits<Offset>::max());
+    }
+
+    template <unsigned int D, class Offset>
+    inline bool BasicCompressedTree<D, Offset>::overlaps(const double* bounds, const AABBType& aabb) const
+    {
+        unsigned int dim = aabb.lowerBound.size();
+        const double* lowerBound = bounds;
+        const double* upperBound = bounds + dim;
+
+        for (unsigned int i=0;i<dim;i++)
+        {
+            // Test the unshifted image, then the neighbouring images.
+            int nImages = (isPeriodic && (periods[i] != 0)) ? 3 : 1;
+            bool isOverlap = false;
+
+            for (int j=0;j<nImages && !isOverlap;j++)
+            {
+                double shift = (j == 0) ? 0 : ((j == 1) ? periods[i] : -periods[i]);
+
+                if (touchIsOverlap)
+                {
+                    isOverlap = !(upperBound[i] + shift < aabb.lowerBound[i]
+                               || lowerBound[i] + shift > aabb.upperBound[i]);
+                }
+                else
+                {
+                    isOverlap = !(upperBound[i] + shift <= aabb.lowerBound[i]
+                               || lowerBound[i] + shift >= aabb.upperBound[i]);
+                }
+            }
+
+            if (!isOverlap) return false;
+        }
+
+        return true;
+    }
+
+    template <unsigned int D, unsigned int Width>
+    template <class Layout>
+    BasicWideTree<D, Width>::BasicWideTree(const BasicTree<D, Layout>& tree) :
+        dimension(tree.dimension), isPeriodic(tree.isPeriodic), touchIsOverlap(tree.touchIsOverlap)
+    {
+        periods = VectorTraits<D>::create(dimension);
+        if (isPeriodic) periods = tree.periods;
+
+        std::vector<BuildNode> buildNodes;
+        unsigned int buildRoot = tree.exportNodes(buildNodes);
+
+        build(buildNodes, buildRoot);
+    }
+
+    template <unsigned int D, unsigned int Width>
+    template <class Callback>
+    void BasicWideTree<D, Width>::query(const AABBType& aabb, Callback&& callback) const
+    {
+        // The snapshot is empty.
+        if (children.empty()) return;
+
+        assert(aabb.lowerBound.size() == dimension);
+
+        // Each node visited replaces itself with at most Width children.
+        unsigned int fixedStack[STACK_SIZE];
+        std::vector<unsigned int> heapStack;
+        unsigned int* stack = fixedStack;
+
+        if (height*(Width - 1) + 1 > STACK_SIZE)
+        {
+            heapStack.resize(height*(Width - 1) + 1);
+            stack = heapStack.data();
+        }
+
+        unsigned int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        bool isOverlap[Width];
+
+        while (stackSize > 0)
+        {
+            unsigned int node = stack[--stackSize];
+
+            overlaps(node, aabb, isOverlap);
+
+            for (unsigned int i=0;i<Width;i++)
+            {
+                if (!isOverlap[i]) continue;
+
+                std::uint32_t child = children[Width*node + i];
+
+                if (child & LEAF)
+                {
+                    if (!callback(child & ~LEAF)) return;
+                }
+                else stack[stackSize++] = child;
+            }
+        }
+    }
+
+    template <unsigned int D, unsigned int Width>
+    inline void BasicWideTree<D, Width>::overlaps(unsigned int node, const AABBType& aabb, bool* isOverlap) const
+    {
+        unsigned int dim = aabb.lowerBound.size();
+        const double* nodeBounds = &bounds[std::size_t(2*Width)*dim*node];
+
+        for (unsigned int i=0;i<Width;i++) isOverlap[i] = true;
+
+        for (unsigned int i=0;i<dim;i++)
+        {
+            const double* lowerBound = nodeBounds + 2*Width*i;
+            const double* upperBound = lowerBound + Width;
+
+            // Test the unshifted image, then the neighbouring images, by
+            // shifting the query rather than the children.
+            int nImages = (isPeriodic && (periods[i] != 0)) ? 3 : 1;
+            bool isAxisOverlap[Width] = {};
+
+            for (int j=0;j<nImages;j++)
+            {
+                double shift = (j == 0) ? 0 : ((j == 1) ? periods[i] : -periods[i]);
+                double queryLower = aabb.lowerBound[i] - shift;
+                double queryUpper = aabb.upperBound[i] - shift;
+
+                if (touchIsOverlap)
+                {
+                    for (unsigned int k=0;k<Width;k++)
+                        isAxisOverlap[k] |= (lowerBound[k] <= queryUpper) & (upperBound[k] >= queryLower);
+                }
+                else
+                {
+                    for (unsigned int k=0;k<Width;k++)
+                        isAxisOverlap[k] |= (lowerBound[k] < queryUpper) & (upperBound[k] > queryLower);
+                }
+            }
+
+            for (unsigned int k=0;k<Width;k++) isOverlap[k] &= isAxisOverlap[k];
+        }
+    }
 }
 
 #endif /* _AABB_H */